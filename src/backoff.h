@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+// Exponential backoff with jitter for reconnect attempts.
+//
+// Each call to next() doubles the base delay up to maxMs and returns a value
+// between half the base and the full base ("equal jitter"), so devices that
+// lost the same router do not all retry in lockstep, yet never retry with
+// no delay at all. The random value is passed in, so nothing here depends on
+// Arduino.
+class Backoff {
+public:
+  Backoff(uint32_t initialMs, uint32_t maxMs)
+      : initialMs(initialMs), maxMs(maxMs), attempts(0) {}
+
+  void reset() { attempts = 0; }
+
+  // Delay before the next attempt; random is any uniformly distributed value
+  uint32_t next(uint32_t random) {
+    uint32_t base = initialMs;
+    for (uint32_t i = 0; i < attempts && base < maxMs; i++) {
+      base = base > maxMs / 2 ? maxMs : base * 2;
+    }
+    if (base > maxMs) {
+      base = maxMs;
+    }
+    attempts++;
+
+    uint32_t half = base / 2;
+    return base - half + random % (half + 1);
+  }
+
+  uint32_t getAttempts() const { return attempts; }
+
+private:
+  uint32_t initialMs;
+  uint32_t maxMs;
+  uint32_t attempts;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DEBOUNCE_TIME 20
+#define CONTACT_DEBOUNCE_TIME 50   // Reed switches bounce longer than the button
+
+// Debounces a digital input from timestamped edges.
+//
+// Edges come from an ISR (see InputMonitor in main.cpp), so the timestamps
+// are exact even when they are processed late. Any edge opens a settle
+// window; once the input has been quiet for settleMs its level is compared
+// with the last stable one. Bounces that end where they started are ignored.
+// Millisecond timestamps may wrap.
+class Debouncer {
+public:
+  explicit Debouncer(uint32_t settleMs)
+      : settleMs(settleMs), stableLevel(false), rawLevel(false), bouncing(false),
+        rawSince(0), burstStart(0), changedAt(0) {}
+
+  void reset(bool level, uint32_t now) {
+    stableLevel = level;
+    rawLevel = level;
+    bouncing = false;
+    rawSince = now;
+    changedAt = now;
+  }
+
+  // Level read by the ISR right after the edge
+  void onEdge(bool level, uint32_t timestamp) {
+    if (!bouncing) {
+      bouncing = true;
+      burstStart = timestamp;
+    }
+    rawLevel = level;
+    rawSince = timestamp;
+  }
+
+  // Returns true once when the input has settled at a new level.
+  // lastChange() is then the time of the first edge of that burst.
+  bool update(uint32_t now) {
+    if (!bouncing || now - rawSince < settleMs) {
+      return false;
+    }
+    bouncing = false;
+    if (rawLevel == stableLevel) {
+      return false;
+    }
+    stableLevel = rawLevel;
+    changedAt = burstStart;
+    return true;
+  }
+
+  // Milliseconds until update() can report a change; UINT32_MAX when idle
+  uint32_t timeToSettle(uint32_t now) const {
+    if (!bouncing) {
+      return UINT32_MAX;
+    }
+    uint32_t quiet = now - rawSince;
+    return quiet >= settleMs ? 0 : settleMs - quiet;
+  }
+
+  // True from an edge until update() has seen the input settle
+  bool settling() const { return bouncing; }
+  bool level() const { return stableLevel; }
+  uint32_t lastChange() const { return changedAt; }
+
+private:
+  uint32_t settleMs;
+  bool stableLevel;
+  bool rawLevel;
+  bool bouncing;
+  uint32_t rawSince;     // Time of the most recent edge
+  uint32_t burstStart;   // Time of the first edge since the input was last stable
+  uint32_t changedAt;
+};
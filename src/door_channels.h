@@ -0,0 +1,156 @@
+#pragma once
+
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Table of the doors one controller drives.
+//
+// Each channel is a contact input, a relay output and how they behave. The
+// pin and timing fields pack into one 32-bit word for Preferences, so a
+// channel costs one number and one name. Channel 0 is the board's own door
+// and keeps the single-door names everywhere ("door", "trigger",
+// /api/trigger); channel n > 0 adds the suffix n + 1 ("door2", "trigger2").
+// Nothing here touches GPIO; see setupGPIO() and InputMonitor in main.cpp.
+
+#define DOOR_MAX_CHANNELS 4
+#define DOOR_NAME_MAX 23
+#define DOOR_PIN_COUNT 22            // ESP32-C3 GPIO0..21
+#define DOOR_PULSE_UNIT_MS 100
+#define DOOR_MIN_PULSE_MS 100
+#define DOOR_MAX_PULSE_MS 10000
+
+enum DoorChannelFlags : uint8_t {
+  DOOR_CONTACT_INVERTED = 0x01,  // Contact reads HIGH when the door is closed
+  DOOR_CONTACT_PULLUP = 0x02     // Enable the internal pull-up (bare reed switch to GND)
+};
+
+struct DoorChannel {
+  uint8_t contactPin;
+  uint8_t relayPin;
+  uint8_t flags;                 // DoorChannelFlags
+  uint8_t pulseUnits;            // Relay pulse in DOOR_PULSE_UNIT_MS
+  char name[DOOR_NAME_MAX + 1];
+
+  uint32_t pulseMs() const { return (uint32_t)pulseUnits * DOOR_PULSE_UNIT_MS; }
+  bool inverted() const { return (flags & DOOR_CONTACT_INVERTED) != 0; }
+  bool pullup() const { return (flags & DOOR_CONTACT_PULLUP) != 0; }
+};
+
+// contact | relay << 8 | flags << 16 | pulse units << 24
+inline uint32_t packDoorChannel(const DoorChannel& channel) {
+  return (uint32_t)channel.contactPin | ((uint32_t)channel.relayPin << 8) |
+         ((uint32_t)channel.flags << 16) | ((uint32_t)channel.pulseUnits << 24);
+}
+
+inline void unpackDoorChannel(uint32_t packed, DoorChannel& channel) {
+  channel.contactPin = (uint8_t)packed;
+  channel.relayPin = (uint8_t)(packed >> 8);
+  channel.flags = (uint8_t)(packed >> 16);
+  channel.pulseUnits = (uint8_t)(packed >> 24);
+}
+
+// "" for channel 0, "2".."4" after it; appended to identifiers and topics
+inline void doorChannelSuffix(size_t index, char* buffer, size_t size) {
+  if (index == 0) {
+    buffer[0] = '\0';
+  } else {
+    snprintf(buffer, size, "%u", (unsigned)(index + 1));
+  }
+}
+
+class DoorChannelTable {
+public:
+  DoorChannelTable() : count(0) {}
+
+  size_t size() const { return count; }
+  const DoorChannel& operator[](size_t index) const { return channels[index]; }
+
+  void clear() { count = 0; }
+
+  // Returns false when the table is full
+  bool add(uint8_t contactPin, uint8_t relayPin, uint8_t flags, uint32_t pulseMs, const char* name) {
+    if (count == DOOR_MAX_CHANNELS) {
+      return false;
+    }
+    DoorChannel& channel = channels[count++];
+    channel.contactPin = contactPin;
+    channel.relayPin = relayPin;
+    channel.flags = flags;
+    uint32_t units = (pulseMs + DOOR_PULSE_UNIT_MS / 2) / DOOR_PULSE_UNIT_MS;
+    channel.pulseUnits = (uint8_t)(units > 0xff ? 0xff : units);   // Too long fails validate()
+    snprintf(channel.name, sizeof(channel.name), "%s", name);
+    return true;
+  }
+
+  bool addPacked(uint32_t packed, const char* name) {
+    if (count == DOOR_MAX_CHANNELS) {
+      return false;
+    }
+    DoorChannel& channel = channels[count++];
+    unpackDoorChannel(packed, channel);
+    snprintf(channel.name, sizeof(channel.name), "%s", name);
+    return true;
+  }
+
+  // Checks that every pin exists, is not in reservedPins (flash, LED,
+  // button) and is used only once, that no relay is on one of inputOnlyPins
+  // (strapping and USB pins a driven output would disturb), that pulses are
+  // in range and that names
+  // are printable ASCII without quotes or backslashes. Names then go into JSON
+  // unescaped and cannot be cut inside a UTF-8 sequence, which the status
+  // buffers sized from DOOR_NAME_MAX rely on. error names the first problem.
+  bool validate(const uint8_t* reservedPins, size_t reservedCount, const uint8_t* inputOnlyPins,
+                size_t inputOnlyCount, const char*& error) const {
+    if (count == 0) {
+      error = "at least one channel is required";
+      return false;
+    }
+    bool used[DOOR_PIN_COUNT] = {false};
+    for (size_t i = 0; i < reservedCount; i++) {
+      if (reservedPins[i] < DOOR_PIN_COUNT) {
+        used[reservedPins[i]] = true;
+      }
+    }
+    for (size_t i = 0; i < count; i++) {
+      const DoorChannel& channel = channels[i];
+      for (uint8_t pin : {channel.contactPin, channel.relayPin}) {
+        if (pin >= DOOR_PIN_COUNT) {
+          error = "pin out of range";
+          return false;
+        }
+        if (used[pin]) {
+          error = "pin reserved or used twice";
+          return false;
+        }
+        used[pin] = true;
+      }
+      for (size_t j = 0; j < inputOnlyCount; j++) {
+        if (channel.relayPin == inputOnlyPins[j]) {
+          error = "relay_pin is a strapping or USB pin";
+          return false;
+        }
+      }
+      if (channel.pulseMs() < DOOR_MIN_PULSE_MS || channel.pulseMs() > DOOR_MAX_PULSE_MS) {
+        error = "pulse_ms out of range";
+        return false;
+      }
+      if (channel.name[0] == '\0') {
+        error = "name is required";
+        return false;
+      }
+      for (const char* c = channel.name; *c != '\0'; c++) {
+        if (*c < 0x20 || *c > 0x7e || *c == '"' || *c == '\\') {
+          error = "name must be printable ASCII without quotes or backslashes";
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  size_t count;
+  DoorChannel channels[DOOR_MAX_CHANNELS];
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "door_channels.h"
+
+// Door state as the loop task publishes it, and the status fields built
+// from it for /api/status and WebSocket pushes. Header-only and free of
+// Arduino calls, so the native benchmarks run the same code; main.cpp
+// gathers the inputs (DeviceStateStore, the Wi-Fi link).
+
+// Shown for STATUS_TRANSITION_DURATION after a trigger
+enum DoorTransition : uint8_t {
+  TRANSITION_NONE,
+  TRANSITION_OPENING,
+  TRANSITION_CLOSING
+};
+
+// One channel of the door state; see DeviceState
+struct DoorState {
+  bool doorOpen;
+  DoorTransition transition;
+  uint32_t transitionStartMs;
+};
+
+// Door state as last published by loop(), one entry per door channel
+struct DeviceState {
+  DoorState doors[DOOR_MAX_CHANNELS];
+  uint8_t doorCount;           // doorChannels.size()
+  uint32_t version;            // Bumped on every change
+};
+
+// Serialized size bounds. validate() keeps names free of characters JSON
+// escapes, so a door entry is its fixed fields plus DOOR_NAME_MAX bytes.
+#define DOOR_STATUS_ENTRY_JSON_MAX (80 + DOOR_NAME_MAX)   // {"channel":..,"name":..,..},
+#define DOOR_STATUS_JSON_MAX (128 + DOOR_MAX_CHANNELS * DOOR_STATUS_ENTRY_JSON_MAX)  // With rssi and uptime
+
+// Network side of a live status
+struct LinkStatus {
+  bool connected;
+  char ip[16];                 // Dotted quad
+  int rssi;
+  uint32_t uptimeSeconds;
+};
+
+// "" when no transition is active
+inline const char* transitionName(DoorTransition transition) {
+  switch (transition) {
+    case TRANSITION_OPENING: return "opening";
+    case TRANSITION_CLOSING: return "closing";
+    default: return "";
+  }
+}
+
+// "doors": [{channel, name, door_open, status_transition}, ...]; the
+// top-level door_open/status_transition fields are channel 0's
+inline void addDoorStatus(JsonDocument& doc, const DeviceState& state, const DoorChannelTable& channels) {
+  JsonArray doors = doc.createNestedArray("doors");
+  for (uint8_t i = 0; i < state.doorCount; i++) {
+    JsonObject door = doors.createNestedObject();
+    door["channel"] = i;
+    door["name"] = (const char*)channels[i].name;  // Fixed after boot, so not copied
+    door["door_open"] = state.doors[i].doorOpen;
+    door["status_transition"] = transitionName(state.doors[i].transition);
+  }
+}
+
+// Door, Wi-Fi and uptime fields. The IP is copied into the document, so
+// link may go away before doc is serialized.
+inline void addLiveStatus(JsonDocument& doc, const DeviceState& state, const DoorChannelTable& channels,
+                          const LinkStatus& link) {
+  doc["door_open"] = state.doors[0].doorOpen;
+  doc["status_transition"] = transitionName(state.doors[0].transition);
+  addDoorStatus(doc, state, channels);
+  doc["wifi_connected"] = link.connected;
+  doc["ip_address"] = (char*)link.ip;   // char* is copied, const char* would be linked
+  doc["rssi"] = link.rssi;
+  doc["uptime"] = link.uptimeSeconds;
+}
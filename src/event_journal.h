@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_RECORDS_PER_SEGMENT 2048   // 32 KB per segment file
+#define HISTORY_MAX_SEGMENTS 16            // ~32k events in 512 KB; the oldest segment goes first
+#define HISTORY_INDEX_STRIDE 64            // Records per time index entry
+#define HISTORY_INDEX_CAPACITY (HISTORY_RECORDS_PER_SEGMENT * HISTORY_MAX_SEGMENTS / HISTORY_INDEX_STRIDE + HISTORY_MAX_SEGMENTS)
+
+// Record layout and time index for the door event journal on LittleFS.
+//
+// Records are fixed-size and numbered by a sequence that never restarts, so
+// record n lives in segment n / recordsPerSegment at a fixed offset and can
+// be read with one seek. The time index maps wall-clock seconds to sequence
+// numbers, with one entry every `stride` records, so a time-range query
+// reads at most a stride of records on either side of the range instead of
+// the whole journal. File handling lives in EventHistory (main.cpp).
+
+enum HistoryEvent : uint8_t {
+  HISTORY_BOOT = 1,
+  HISTORY_OPENED = 2,
+  HISTORY_CLOSED = 3,
+  HISTORY_TRIGGER = 4
+};
+
+enum TriggerSource : uint8_t {
+  SOURCE_NONE = 0,
+  SOURCE_API = 1,
+  SOURCE_MQTT = 2,
+  SOURCE_UDP = 3,
+  SOURCE_BUTTON = 4
+};
+
+struct HistoryRecord {
+  uint32_t seq;
+  uint32_t epoch;       // Wall-clock seconds, 0 when the clock was not known
+  uint32_t uptimeMs;    // millis() when it happened
+  uint8_t event;        // HistoryEvent
+  uint8_t source;       // TriggerSource for HISTORY_TRIGGER, door channel in the high nibble
+  uint8_t doorOpen;
+  uint8_t transition;   // DoorTransition after the event
+};
+
+static_assert(sizeof(HistoryRecord) == 16, "HistoryRecord is stored on flash as is");
+
+// Records written before door channels existed have a zero high nibble, so
+// they read back as channel 0
+inline uint8_t packHistorySource(uint8_t source, uint8_t channel) {
+  return (uint8_t)((channel << 4) | (source & 0x0f));
+}
+
+inline uint8_t historySource(const HistoryRecord& record) { return record.source & 0x0f; }
+inline uint8_t historyChannel(const HistoryRecord& record) { return record.source >> 4; }
+
+struct HistoryIndexEntry {
+  uint32_t epoch;
+  uint32_t seq;
+};
+
+template <size_t Capacity>
+class HistoryIndex {
+public:
+  explicit HistoryIndex(uint32_t stride) : stride(stride), count(0) {}
+
+  void clear() { count = 0; }
+
+  // Adds an entry if the record is at least a stride past the last one and
+  // the clock did not go backwards. Returns true when it was added, so the
+  // caller can persist it.
+  bool add(uint32_t epoch, uint32_t seq) {
+    if (epoch == 0 || count == Capacity) {
+      return false;
+    }
+    if (count > 0) {
+      const HistoryIndexEntry& last = entries[count - 1];
+      if (seq < last.seq + stride || epoch < last.epoch) {
+        return false;
+      }
+    }
+    entries[count].epoch = epoch;
+    entries[count].seq = seq;
+    count++;
+    return true;
+  }
+
+  // Forgets entries for records that were deleted with their segment
+  void dropBefore(uint32_t seq) {
+    size_t keep = 0;
+    while (keep < count && entries[keep].seq < seq) {
+      keep++;
+    }
+    for (size_t i = keep; i < count; i++) {
+      entries[i - keep] = entries[i];
+    }
+    count -= keep;
+  }
+
+  // First sequence number that can hold a record at or after epoch
+  // (firstSeq when the index has nothing earlier)
+  uint32_t seekFrom(uint32_t epoch, uint32_t firstSeq) const {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (entries[mid].epoch < epoch) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    // entries[low - 1] is the last one strictly before epoch
+    if (low == 0) {
+      return firstSeq;
+    }
+    uint32_t seq = entries[low - 1].seq;
+    return seq > firstSeq ? seq : firstSeq;
+  }
+
+  // Sequence number past which every record is after epoch
+  // (UINT32_MAX when the index has nothing later)
+  uint32_t seekTo(uint32_t epoch) const {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (entries[mid].epoch <= epoch) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return low < count ? entries[low].seq : UINT32_MAX;
+  }
+
+  size_t size() const { return count; }
+  const HistoryIndexEntry* data() const { return entries; }
+
+private:
+  uint32_t stride;
+  size_t count;
+  HistoryIndexEntry entries[Capacity];
+};
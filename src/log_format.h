@@ -0,0 +1,27 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <stddef.h>
+
+#include "log_store.h"
+#include "timebase.h"
+
+// Writes {"seq":...,"timestamp":...,"level":...,"message":...} into buffer.
+// Returns its length, or 0 when it does not fit (bufferSize includes the NUL).
+// Shared by /api/logs, WebSocket log lines and replays; header-only so the
+// native benchmarks run the same code.
+inline size_t formatLogRecordJson(const LogRecord& record, const Timebase& timebase, char* buffer,
+                                  size_t bufferSize) {
+  char timestamp[20];
+  timebase.format(record.timestamp, timestamp, sizeof(timestamp));
+  StaticJsonDocument<128> doc;
+  doc["seq"] = record.seq;
+  doc["timestamp"] = (const char*)timestamp;
+  doc["level"] = logLevelName(record.level);
+  doc["message"] = (const char*)record.message;
+
+  if (measureJson(doc) >= bufferSize) {
+    return 0;
+  }
+  return serializeJson(doc, buffer, bufferSize);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "log_store.h"
+#include "msgpack_writer.h"
+#include "timebase.h"
+
+#define LOG_REPLAY_FRAME_BYTES 4096  // Upper bound for one batched replay frame
+#define WS_MSG_LOGS 2                // Binary WebSocket message type of a replay batch
+
+// Clock anchor as two elements: epoch seconds and the millis() value they
+// correspond to, or two nils before the first NTP sync
+inline void packClock(MsgPackWriter& out, const Timebase& timebase) {
+  uint32_t epoch;
+  uint32_t millisAtEpoch;
+  if (timebase.getAnchor(epoch, millisAtEpoch)) {
+    out.writeUint(epoch);
+    out.writeUint(millisAtEpoch);
+  } else {
+    out.writeNil();
+    out.writeNil();
+  }
+}
+
+// Packs one binary replay batch of the records after sinceSeq into frame:
+// [WS_MSG_LOGS, boot, epoch, millisAtEpoch, [[seq, level, ms, message], ...], last, done]
+// read(cursor, record) steps through the log store, so the caller can hold
+// its lock for one record at a time. done is false when a record was left
+// for the next batch. Returns the frame length.
+template <typename ReadRecord>
+size_t packLogReplay(uint8_t* frame, size_t size, uint32_t bootId, const Timebase& timebase, uint32_t sinceSeq,
+                     ReadRecord read) {
+  const size_t footerReserve = 16;  // last (5 bytes) + done (1 byte), with room to spare
+  MsgPackWriter out(frame, size - footerReserve);
+  out.writeArray(7);
+  out.writeUint(WS_MSG_LOGS);
+  out.writeUint(bootId);
+  packClock(out, timebase);
+  size_t entriesHeader = out.beginArray();
+
+  LogCursor cursor = {nextAfter(sinceSeq), 0};
+  LogRecord record;
+  uint32_t entries = 0;
+  bool more = false;
+  for (;;) {
+    LogCursor previous = cursor;
+    if (!read(cursor, record)) {
+      break;
+    }
+
+    size_t before = out.size();
+    out.writeArray(4);
+    out.writeUint(record.seq);
+    out.writeUint(record.level);
+    out.writeUint(record.timestamp);
+    out.writeString(record.message, record.length);
+    if (!out.ok()) {
+      out.truncate(before);
+      cursor = previous;  // Leave this record for the next batch
+      more = true;
+      break;
+    }
+    entries++;
+  }
+  out.finishArray(entriesHeader, entries);
+
+  MsgPackWriter footer(frame + out.size(), footerReserve);
+  footer.writeUint(cursor.seq - 1);
+  footer.writeBool(!more);
+  return out.size() + footer.size();
+}
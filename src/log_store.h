@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Log severity, stored in one byte per record
+enum LogLevel : uint8_t {
+  LOG_DEBUG = 0,
+  LOG_INFO = 1,
+  LOG_WARN = 2,
+  LOG_ERROR = 3
+};
+
+inline const char* logLevelName(uint8_t level) {
+  switch (level) {
+    case LOG_DEBUG: return "DEBUG";
+    case LOG_INFO:  return "INFO";
+    case LOG_WARN:  return "WARN";
+    case LOG_ERROR: return "ERROR";
+    default:        return "INFO";
+  }
+}
+
+#define LOG_MAX_MESSAGE 200   // Longer messages are truncated (must fit the uint8_t length)
+#define LOG_ARENA_SIZE 12288   // Bytes of log history kept in RAM
+
+// First sequence number after a client's "since" cursor. Saturates, so
+// since=4294967295 means nothing newer instead of wrapping to the start.
+inline uint32_t nextAfter(uint32_t seq) {
+  return seq == UINT32_MAX ? UINT32_MAX : seq + 1;
+}
+
+// vsnprintf into message (LOG_MAX_MESSAGE bytes). Returns the length kept,
+// which is what append() takes; the text is always NUL-terminated.
+inline size_t formatLogMessage(char* message, const char* format, va_list args) {
+  int written = vsnprintf(message, LOG_MAX_MESSAGE, format, args);
+  size_t length = written < 0 ? 0 : (size_t)written;
+  if (length > LOG_MAX_MESSAGE - 1) {
+    length = LOG_MAX_MESSAGE - 1;
+  }
+  message[length] = '\0';
+  return length;
+}
+
+// A record copied out of the store
+struct LogRecord {
+  uint32_t seq;
+  uint32_t timestamp;   // millis() when the line was logged
+  uint8_t level;
+  uint8_t length;
+  char message[LOG_MAX_MESSAGE + 1];
+};
+
+// Read position for walking the store. Start with seq = 0 to read from the
+// oldest record; offset is only a hint and is re-validated on every read.
+struct LogCursor {
+  uint32_t seq;
+  uint32_t offset;
+};
+
+// Fixed-size log ring packed into one preallocated byte arena.
+//
+// Each record is a fixed-width 12-byte header followed by the message bytes,
+// padded to 4 bytes. Appending evicts the oldest records until the new one
+// fits; when a record does not fit before the end of the arena the writer
+// wraps to offset 0 and the tail of the arena is left unused until the reader
+// passes it. Nothing is ever allocated after construction.
+//
+// Not thread-safe: callers serialize access (see logLock() in main.cpp).
+template <size_t Size>
+class LogStore {
+  static_assert(Size >= 1024 && (Size % 4) == 0, "LogStore arena must be >= 1 KB and 4-byte aligned");
+
+  struct Header {
+    uint32_t seq;
+    uint32_t timestamp;
+    uint8_t level;
+    uint8_t length;
+    uint16_t check;     // Derived from seq; guards cursor hints against stale bytes
+  };
+  static_assert(sizeof(Header) == 12, "LogStore header must be 12 bytes");
+
+public:
+  LogStore() { clear(); }
+
+  void clear() {
+    head = 0;
+    tail = 0;
+    wrapAt = Size;
+    count = 0;
+    firstSeq = 1;
+    nextSeq = 1;
+  }
+
+  // Appends a record and returns its sequence number (1-based, monotonic).
+  // Only the record's own padded size is reserved, so a short line evicts
+  // just enough of the oldest records to fit.
+  uint32_t append(uint8_t level, uint32_t timestamp, const char* message, size_t length) {
+    if (length > LOG_MAX_MESSAGE) {
+      length = LOG_MAX_MESSAGE;
+    }
+    uint32_t offset = reserve(recordSize(length));
+    Header header;
+    header.seq = nextSeq++;
+    header.timestamp = timestamp;
+    header.level = level;
+    header.length = (uint8_t)length;
+    header.check = checkValue(header.seq);
+    memcpy(arena + offset, &header, sizeof(header));
+    memcpy(arena + offset + sizeof(Header), message, length);
+
+    head = offset + recordSize(length);
+    count++;
+    return header.seq;
+  }
+
+  // Copies the record at the cursor into out and advances the cursor.
+  // Returns false when the cursor has caught up with the newest record.
+  // A cursor that fell behind the oldest record skips ahead to it.
+  bool read(LogCursor& cursor, LogRecord& out) const {
+    if (count == 0 || cursor.seq >= nextSeq) {
+      return false;
+    }
+
+    uint32_t offset;
+    if (cursor.seq < firstSeq) {
+      cursor.seq = firstSeq;
+      offset = tail;
+    } else if (!locate(cursor.seq, cursor.offset, offset)) {
+      return false;
+    }
+
+    Header header;
+    memcpy(&header, arena + offset, sizeof(header));
+    out.seq = header.seq;
+    out.timestamp = header.timestamp;
+    out.level = header.level;
+    out.length = header.length;
+    memcpy(out.message, arena + offset + sizeof(Header), header.length);
+    out.message[header.length] = '\0';
+
+    cursor.seq = header.seq + 1;
+    cursor.offset = advance(offset, recordSize(header.length));
+    return true;
+  }
+
+  uint32_t size() const { return count; }
+  uint32_t oldestSeq() const { return firstSeq; }
+  uint32_t newestSeq() const { return nextSeq - 1; }
+  static constexpr size_t capacityBytes() { return Size; }
+
+private:
+  alignas(4) uint8_t arena[Size];
+  uint32_t head;        // Next write offset
+  uint32_t tail;        // Offset of the oldest record
+  uint32_t wrapAt;      // End of valid data while the ring is wrapped
+  uint32_t count;
+  uint32_t firstSeq;    // Sequence number of the oldest record
+  uint32_t nextSeq;     // Sequence number the next record will get
+
+  static uint16_t checkValue(uint32_t seq) {
+    return (uint16_t)~(seq ^ (seq >> 16));
+  }
+
+  static uint32_t recordSize(size_t length) {
+    return (sizeof(Header) + length + 3) & ~3u;
+  }
+
+  // Offset of the record following one at offset, wrapping where the writer did
+  uint32_t advance(uint32_t offset, uint32_t recordBytes) const {
+    uint32_t next = offset + recordBytes;
+    if (next >= wrapAt && next != head) {
+      return 0;
+    }
+    return next;
+  }
+
+  void evictOldest() {
+    Header header;
+    memcpy(&header, arena + tail, sizeof(header));
+    tail += recordSize(header.length);
+    count--;
+    firstSeq++;
+    if (tail >= wrapAt) {
+      tail = 0;
+      wrapAt = Size;
+    }
+  }
+
+  // Returns an offset with at least `need` contiguous free bytes
+  uint32_t reserve(uint32_t need) {
+    for (;;) {
+      if (count == 0) {
+        head = 0;
+        tail = 0;
+        wrapAt = Size;
+        return 0;
+      }
+      if (head > tail) {
+        // Occupied [tail, head); free [head, Size) and [0, tail)
+        if (Size - head >= need) {
+          return head;
+        }
+        wrapAt = head;
+        head = 0;
+        continue;
+      }
+      // Wrapped (or full): occupied [tail, wrapAt) and [0, head); free [head, tail)
+      if (tail - head >= need) {
+        return head;
+      }
+      evictOldest();
+    }
+  }
+
+  // Finds the offset of a live record, trying the cursor hint first
+  bool locate(uint32_t seq, uint32_t hint, uint32_t& offset) const {
+    if (matches(hint, seq)) {
+      offset = hint;
+      return true;
+    }
+    if (matches(0, seq)) {
+      offset = 0;
+      return true;
+    }
+    uint32_t walk = tail;
+    for (uint32_t i = 0; i < count; i++) {
+      Header header;
+      memcpy(&header, arena + walk, sizeof(header));
+      if (header.seq == seq) {
+        offset = walk;
+        return true;
+      }
+      walk = advance(walk, recordSize(header.length));
+    }
+    return false;
+  }
+
+  bool matches(uint32_t offset, uint32_t seq) const {
+    if ((offset & 3) != 0 || offset + sizeof(Header) > Size) {
+      return false;
+    }
+    Header header;
+    memcpy(&header, arena + offset, sizeof(header));
+    return header.seq == seq && header.check == checkValue(seq) &&
+           offset + recordSize(header.length) <= Size;
+  }
+};
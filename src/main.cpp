@@ -3,19 +3,53 @@
 #include <DNSServer.h>
 #include <ESPAsyncWebServer.h>
 #include <Preferences.h>
+#include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <Update.h>
 #include <ArduinoOTA.h>
 #include <HTTPClient.h>
+#include <AsyncMqttClient.h>
+#include <AsyncUDP.h>
 #include <esp_err.h>
 #include <esp_task_wdt.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
+#include <driver/gpio.h>
+#include <esp_timer.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_wifi.h>
+#include <hal/gpio_ll.h>
+#include <esp_app_format.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+#include <esp32c3/rom/miniz.h>
 #include <time.h>
 #include <sntp.h>
+#include <atomic>
+#include <memory>
+
+#include "backoff.h"
+#include "debouncer.h"
+#include "door_channels.h"
+#include "door_status.h"
+#include "event_journal.h"
+#include "log_format.h"
+#include "log_replay.h"
+#include "log_store.h"
+#include "metrics.h"
+#include "msgpack_writer.h"
+#include "registration_payload.h"
+#include "scheduler.h"
+#include "snapshot_buffer.h"
+#include "spsc_queue.h"
+#include "timebase.h"
+#include "udp_frame.h"
+#include "web_index.h"
 
 // GPIO Pin Definitions (Athom ESP32-C3 garage door opener)
-#define CONTACT_PIN 18      // Door contact sensor
-#define RELAY_PIN 7         // Relay to trigger garage door
+#define CONTACT_PIN 18      // Door contact sensor (channel 0 default)
+#define RELAY_PIN 7         // Relay to trigger garage door (channel 0 default)
 #define LED_PIN 4           // Status LED
 #define BUTTON_PIN 3        // Physical button
 
@@ -23,23 +57,81 @@
 #define AP_SSID "GarageDoor-Setup"
 #define AP_PASSWORD ""  // No password for easy setup
 #define CONFIG_NAMESPACE "garage"
-#define DEBOUNCE_TIME 20
-#define RELAY_PULSE_TIME 1000  // 1 second relay pulse
-#define LOG_BUFFER_SIZE 100    // Number of log messages to keep
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION "1.0.0"   // Override with -DFIRMWARE_VERSION=\"x.y.z\"; compared with the server's offer
+#endif
+#define LONG_PRESS_TIME 4000       // Held this long = factory reset
+#define SHORT_PRESS_TIME 1000      // Released before this = trigger relay
+#define RELAY_PULSE_TIME 1000  // 1 second relay pulse (channel 0 default)
+#define DEFAULT_RELAY_GAP_MS 1500  // Minimum time from the end of one pulse to the next
+#define MAX_RELAY_GAP_MS 30000
+#define RELAY_MAX_PENDING 2        // Triggers queued behind the current pulse; more are rejected
+
+// Lowest level compiled in. Follows CORE_DEBUG_LEVEL (3 = info, 4+ = debug)
+// unless overridden with -DLOG_MIN_LEVEL=...
+#ifndef LOG_MIN_LEVEL
+#if CORE_DEBUG_LEVEL >= 4
+#define LOG_MIN_LEVEL LOG_DEBUG
+#else
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+#endif
+
+// printf-style logging: logf(LOG_INFO, "Signal: %d dBm", rssi).
+// Calls below LOG_MIN_LEVEL are removed at compile time, arguments included.
+void logWrite(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+#define logf(level, ...) \
+  do { \
+    if ((level) >= LOG_MIN_LEVEL) { \
+      logWrite((level), __VA_ARGS__); \
+    } \
+  } while (0)
 #define WATCHDOG_TIMEOUT_SECONDS 15
 #define NTP_SERVER "pool.ntp.org"
 #define TIMEZONE "AEST-10AEDT,M10.1.0,M4.1.0/3" // Australia/Sydney
 
-// Log buffer (circular buffer)
-struct LogEntry {
-  String timestamp;
-  String message;
-  String level;
+// Log buffer (records packed into one preallocated ring, see log_store.h)
+LogStore<LOG_ARENA_SIZE> logStore;
+StaticSemaphore_t logMutexBuffer;
+SemaphoreHandle_t logMutex = nullptr;
+Timebase timebase;  // millis() -> wall clock, learned from the first SNTP sync
+uint32_t bootId = 0;  // Random per boot; tells WebSocket clients that sequence numbers restarted
+#define LOG_JSON_ENTRY_MAX (96 + 6 * LOG_MAX_MESSAGE)  // One record as JSON, worst-case escaping
+
+// Per-request state for streaming /api/logs straight out of logStore
+struct LogStreamState {
+  enum Phase : uint8_t { HEADER, ENTRIES, FOOTER, DONE };
+  LogCursor cursor;
+  uint32_t remaining;        // Entries still allowed by ?limit
+  uint32_t entries;
+  Phase phase;
+  char pending[LOG_JSON_ENTRY_MAX];  // Text not yet handed to the response
+  size_t pendingLength;
+  size_t pendingOffset;
 };
 
-LogEntry logBuffer[LOG_BUFFER_SIZE];
-int logIndex = 0;
-int logCount = 0;
+#define HISTORY_QUERY_DEFAULT_LIMIT 100
+#define HISTORY_QUERY_BATCH 16           // Records read from flash per step
+
+// Per-request state for streaming /api/history out of the journal
+struct HistoryStreamState {
+  enum Phase : uint8_t { HEADER, ENTRIES, FOOTER, DONE };
+  Phase phase;
+  bool hasFrom;
+  bool hasTo;
+  uint32_t from;
+  uint32_t to;
+  uint32_t seq;              // Next record to look at
+  uint32_t end;              // Exclusive
+  uint32_t remaining;        // Events still allowed by ?limit
+  uint32_t entries;
+  HistoryRecord batch[HISTORY_QUERY_BATCH];
+  size_t batchCount;
+  size_t batchIndex;
+  char pending[192];
+  size_t pendingLength;
+  size_t pendingOffset;
+};
 
 // Global objects
 AsyncWebServer server(80);
@@ -52,503 +144,4084 @@ bool watchdogEnabled = false;
 String wifiSSID = "";
 String wifiPassword = "";
 bool apMode = false;
-bool doorOpen = false;
-unsigned long lastButtonPress = 0;
 unsigned long buttonPressStart = 0;
 bool buttonPressed = false;
-unsigned long relayStartTime = 0;
-bool relayActive = false;
-bool statusInverted = true;  // From YAML config
-String doorStatusTransition = "";  // "opening", "closing", or ""
-unsigned long statusTransitionStartTime = 0;
-unsigned long lastWiFiRetryTime = 0;
+
+// Doors driven by this controller, from Preferences (see loadDoorChannels()).
+// Fixed after boot: pin changes through /api/config restart the device.
+DoorChannelTable doorChannels;
+#define DEFAULT_DOOR_NAME "Door"
+#define DEFAULT_DOOR_FLAGS DOOR_CONTACT_INVERTED  // From YAML config
+
+// Station link state, advanced by the "wifi" scheduler task. WiFi events
+// only set flags and wake the loop; every WiFi call happens on the loop task.
+enum LinkState : uint8_t {
+  LINK_IDLE,           // No credentials saved; setup AP only
+  LINK_FAST_CONNECT,   // Directed connect to the cached BSSID/channel
+  LINK_CONNECTING,     // Full scan
+  LINK_ONLINE,
+  LINK_BACKOFF         // Waiting to retry after a failed attempt or a dropped link
+};
+LinkState linkState = LINK_IDLE;
+bool everOnline = false;                 // After the first connect an outage never opens the AP right away
+unsigned long wifiConnectStartTime = 0;  // Boot, or the start of the current outage
+unsigned long wifiAttemptStartTime = 0;
+unsigned long wifiRetryAt = 0;
+std::atomic<bool> wifiGotIp(false);
+std::atomic<bool> wifiDisconnected(false);
+std::atomic<uint8_t> wifiDisconnectReason(0);
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+#define WIFI_BACKOFF_INITIAL_MS 1000
+#define WIFI_BACKOFF_MAX_MS 30000
+#define WIFI_AP_FALLBACK_MS (5 * 60 * 1000)  // Open the setup AP after an outage this long
+Backoff wifiBackoff(WIFI_BACKOFF_INITIAL_MS, WIFI_BACKOFF_MAX_MS);
+#define WIFI_CONNECT_POLL_MS 100
+#define WIFI_BLINK_INTERVAL_MS 500
+
+// Startup milestones in millis() since the app started (0 = not reached yet)
+struct StartupMetrics {
+  uint32_t inputsReadyMs;      // Button and relay respond from here on
+  uint32_t webReadyMs;         // HTTP server listening
+  uint32_t wifiConnectedMs;    // First station connection
+};
+StartupMetrics startupMetrics = {0, 0, 0};
+
+// Last good association, so a reconnect can skip the channel scan
+struct WiFiCache {
+  uint8_t bssid[6];
+  uint8_t channel;   // 0 = nothing cached
+};
 #define STATUS_TRANSITION_DURATION 15000  // 15 seconds
 #define REGISTRATION_INTERVAL_MS (5 * 60 * 1000)  // 5 minutes
-#define WIFI_RETRY_INTERVAL_MS 60000 // 60 seconds
+#define REGISTRATION_TIMEOUT_MS 10000
+#define HEARTBEAT_TIMEOUT_MS 3000
+#define REGISTRATION_HASH_BYTES 8   // Hex-encoded in the payload and heartbeat
+
+// Whether any of the first count doors differ in a reported field
+bool doorsChanged(const DoorState* a, const DoorState* b, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (a[i].doorOpen != b[i].doorOpen || a[i].transition != b[i].transition) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#define POWER_PROFILE_COUNT 3
+
+// See PowerManager
+enum PowerProfile : uint8_t {
+  POWER_PERFORMANCE,
+  POWER_BALANCED,
+  POWER_LOW
+};
 
 // Status update tracking
 unsigned long lastStatusUpdateTime = 0;
-const unsigned long STATUS_UPDATE_INTERVAL = 1000;  // Send status every 1 second
-bool lastDoorOpenState = false;
-
-// Device Registration class
-class DeviceRegistration {
+DoorState reportedDoors[DOOR_MAX_CHANNELS] = {};
+bool statusUpdatePending = false;
+#define DEFAULT_STATUS_HEARTBEAT_S 60     // Report unchanged state once a minute
+#define DEFAULT_STATUS_COALESCE_MS 500    // Changes inside this window share one report
+#define MIN_STATUS_HEARTBEAT_S 5
+#define MAX_STATUS_HEARTBEAT_S 86400      // Keeps the heartbeat in ms well inside 32 bits
+#define MAX_STATUS_COALESCE_MS 10000
+#define STATUS_QUEUE_LENGTH 8                 // Must be a power of two
+#define STATUS_REPORT_JSON_MAX (128 + 80 * DOOR_MAX_CHANNELS)  // Reporter payload; names are not sent
+#define STATUS_REPORTER_STACK_SIZE 8192
+#define STATUS_REPORTER_PRIORITY 1
+#define REGISTRATION_TASK_STACK_SIZE 8192
+#define REGISTRATION_TASK_PRIORITY 1
+#define REGISTRATION_CHECK_INTERVAL_MS 1000
+#define REGISTRATION_URL_MAX 128
+#define REGISTRATION_TEXT_MAX 64            // Device name, type and description
+#define REGISTRATION_ERROR_MAX 64
+
+// WebSocket status push: clients get the full status on connect, then only
+// the fields that changed since the last push
+DoorState pushedDoors[DOOR_MAX_CHANNELS] = {};
+int pushedRssi = 0;
+unsigned long lastRssiCheckTime = 0;
+unsigned long lastFullStatusPushTime = 0;
+#define WS_RSSI_CHECK_INTERVAL_MS 5000
+#define WS_RSSI_DELTA_DBM 3              // Smaller RSSI changes are not pushed
+#define WS_STATUS_REFRESH_MS 60000       // Full status resync for connected clients
+#define STATUS_CACHE_MAX_AGE_MS 1000     // Uptime/RSSI in /api/status are at most this stale
+
+// Binary WebSocket frames (clients that connect to /ws?format=msgpack) are
+// MessagePack arrays whose first element is one of these
+#define WS_MSG_LOG 1
+// WS_MSG_LOGS (2), the replay batch, is defined with its packer in log_replay.h
+#define WS_MSG_STATUS 3
+#define WS_LOG_FRAME_BYTES (32 + LOG_MAX_MESSAGE)
+#define WS_STATUS_FRAME_BYTES 256   // Room for DOOR_MAX_CHANNELS doors with names
+
+#define WS_MAX_CLIENTS 8
+#define WS_CLIENT_LOG_QUEUE 8     // Log frames queued per client; the library's remaining slots stay free for status
+#define WS_LOG_BACKLOG_MAX 64     // A client further behind than this skips its oldest lines
+#define WS_DEBUG_BACKLOG 8        // Behind by more than this, DEBUG lines are skipped first
+#define WS_FLUSH_RETRY_MS 20
+#define WS_OTA_FRAME_BYTES 192
+
+void logLock();
+void logUnlock();
+void sendStatusToClient(AsyncWebSocketClient* client);
+void wakeLoop();
+
+// WebSocket fan-out with per-client backpressure.
+// Every client has a slot with its encoding, the next live log line it is
+// owed and whether it still needs a full status or the latest OTA frame.
+// Log lines are never copied: logStore is the queue and each slot a cursor
+// into it, so a slow client just falls behind. flush() gives each client at
+// most WS_CLIENT_LOG_QUEUE queued log frames. DEBUG lines are skipped first
+// once a client is behind, and the oldest lines past WS_LOG_BACKLOG_MAX.
+// Status and OTA frames are never dropped, only coalesced: a client with a
+// full queue gets the latest state when it drains. A log line is encoded
+// once per format for every client at that position.
+//
+// Frames go out through the public per-client text()/binary() calls, which
+// copy into that client's queue. Shared makeBuffer() buffers would save the
+// copies, but are only freed by the library's private _cleanBuffers().
+//
+// Slots are added and removed on the AsyncTCP task under a spinlock; the
+// sending side runs under a mutex that is only ever try-locked, so AsyncTCP
+// never waits for a send in progress.
+class WsBroadcaster {
 private:
-  Preferences* prefs;
-  String serverUrl;
-  String deviceName;
-  String deviceType;
-  String deviceDescription;
-  bool registrationEnabled;
-  unsigned long lastRegistrationTime;
-  bool lastRegistrationSuccess;
-  String lastRegistrationError;
-
-public:
-  DeviceRegistration(Preferences* preferences) : prefs(preferences),
-                                                lastRegistrationTime(0),
-                                                lastRegistrationSuccess(false),
-                                                registrationEnabled(true) {}
-
-  void loadSettings() {
-    serverUrl = prefs->getString("reg_server", "http://192.168.1.225:3004");
-    deviceName = prefs->getString("reg_name", "Garage-Door");
-    deviceType = prefs->getString("reg_type", "esp32_garage_door");
-    deviceDescription = prefs->getString("reg_desc", "ESP32-C3 Garage Door Opener");
-    registrationEnabled = prefs->getBool("reg_enabled", true);
-  }
-
-  void saveSettings() {
-    prefs->putString("reg_server", serverUrl);
-    prefs->putString("reg_name", deviceName);
-    prefs->putString("reg_type", deviceType);
-    prefs->putString("reg_desc", deviceDescription);
-    prefs->putBool("reg_enabled", registrationEnabled);
-  }
-
-  void updateSettings(const String& url, const String& name, const String& type,
-                     const String& description, bool enabled) {
-    serverUrl = url;
-    deviceName = name;
-    deviceType = type;
-    deviceDescription = description;
-    registrationEnabled = enabled;
-    saveSettings();
+  struct Slot {
+    bool used;
+    bool binary;
+    bool statusResync;   // Missed a status update; owes a full one
+    uint32_t id;
+    uint32_t logSeq;     // Next live log line to send
+    uint32_t otaSeen;    // Last OTA frame generation sent
+  };
+
+  portMUX_TYPE lock;
+  SemaphoreHandle_t sendMutex;
+  Slot slots[WS_MAX_CLIENTS];
+  size_t count;
+  char otaFrame[WS_OTA_FRAME_BYTES];
+  size_t otaLength;
+  uint32_t otaGeneration;
+
+  // Scratch space for the sender (under sendMutex)
+  Slot local[WS_MAX_CLIENTS];
+  AsyncWebSocketClient* clients[WS_MAX_CLIENTS];
+  char textFrame[LOG_JSON_ENTRY_MAX + 16];
+  uint8_t binaryFrame[WS_LOG_FRAME_BYTES];
+  char otaCopy[WS_OTA_FRAME_BYTES];
+
+  uint32_t droppedDebug;
+  uint32_t droppedLogs;
+  uint32_t coalescedStatus;
+  uint32_t coalescedOta;
+
+  // Copies the slots and resolves their clients; returns the OTA generation
+  uint32_t snapshot(size_t& otaCopyLength) {
+    portENTER_CRITICAL(&lock);
+    memcpy(local, slots, sizeof(local));
+    uint32_t generation = otaGeneration;
+    memcpy(otaCopy, otaFrame, otaLength);
+    otaCopyLength = otaLength;
+    portEXIT_CRITICAL(&lock);
+
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      clients[i] = nullptr;
+      if (local[i].used) {
+        AsyncWebSocketClient* client = ws.client(local[i].id);
+        if (client != nullptr && client->status() == WS_CONNECTED) {
+          clients[i] = client;
+        }
+      }
+    }
+    return generation;
   }
 
-  String getSettingsJson() {
-    DynamicJsonDocument doc(512);
-    doc["server_url"] = serverUrl;
-    doc["device_name"] = deviceName;
-    doc["device_type"] = deviceType;
-    doc["device_description"] = deviceDescription;
-    doc["enabled"] = registrationEnabled;
-    doc["last_success"] = lastRegistrationSuccess;
-    doc["last_error"] = lastRegistrationError;
-
-    if (lastRegistrationTime > 0) {
-      unsigned long secondsAgo = (millis() - lastRegistrationTime) / 1000;
-      doc["last_registration_seconds_ago"] = secondsAgo;
-    } else {
-      doc["last_registration_seconds_ago"] = -1;
+  // Skips slots that were freed or reused meanwhile
+  void writeBack() {
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (slots[i].used && local[i].used && slots[i].id == local[i].id) {
+        slots[i].statusResync = local[i].statusResync;
+        slots[i].logSeq = local[i].logSeq;
+        slots[i].otaSeen = local[i].otaSeen;
+      }
     }
-
-    String json;
-    serializeJson(doc, json);
-    return json;
+    portEXIT_CRITICAL(&lock);
   }
 
-  bool registerDevice() {
-    if (!registrationEnabled) {
-      return false;
+  // Encodes into binaryFrame or textFrame; returns the length, 0 on failure
+  size_t encodeLog(const LogRecord& record, bool binary) {
+    if (binary) {
+      MsgPackWriter out(binaryFrame, sizeof(binaryFrame));
+      out.writeArray(5);
+      out.writeUint(WS_MSG_LOG);
+      out.writeUint(record.seq);
+      out.writeUint(record.level);
+      out.writeUint(record.timestamp);
+      out.writeString(record.message, record.length);
+      return out.ok() ? out.size() : 0;
     }
 
-    if (WiFi.status() != WL_CONNECTED) {
-      lastRegistrationSuccess = false;
-      lastRegistrationError = "WiFi not connected";
-      return false;
+    // {"type":"log", followed by the record object without its '{'
+    static const char prefix[] = "{\"type\":\"log\",";
+    const size_t prefixLength = sizeof(prefix) - 1;
+    size_t length = formatLogRecordJson(record, timebase, textFrame + prefixLength - 1,
+                                        sizeof(textFrame) - prefixLength + 1);
+    if (length == 0) {
+      return 0;
     }
+    memcpy(textFrame, prefix, prefixLength);
+    return prefixLength - 1 + length;
+  }
 
-    HTTPClient http;
-    String registrationUrl = serverUrl;
-    if (!registrationUrl.endsWith("/")) {
-      registrationUrl += "/";
+  // Returns true when a client is still behind
+  bool flushLogs() {
+    logLock();
+    uint32_t newest = logStore.newestSeq();
+    logUnlock();
+
+    uint32_t budget[WS_MAX_CLIENTS];
+    uint32_t start = UINT32_MAX;
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      budget[i] = 0;
+      if (clients[i] == nullptr) {
+        continue;
+      }
+      uint32_t behind = newest + 1 - local[i].logSeq;
+      if (behind > WS_LOG_BACKLOG_MAX) {
+        droppedLogs += behind - WS_LOG_BACKLOG_MAX;
+        local[i].logSeq = newest + 1 - WS_LOG_BACKLOG_MAX;
+      }
+      size_t queued = clients[i]->queueLen();
+      budget[i] = queued < WS_CLIENT_LOG_QUEUE ? WS_CLIENT_LOG_QUEUE - queued : 0;
+      if (budget[i] > 0 && local[i].logSeq <= newest && local[i].logSeq < start) {
+        start = local[i].logSeq;
+      }
     }
-    registrationUrl += "api/smart_devices/register";
 
-    http.begin(registrationUrl);
-    http.addHeader("Content-Type", "application/json");
-    http.setTimeout(10000);
+    LogCursor cursor = {start, 0};
+    LogRecord record;
+    while (start != UINT32_MAX) {
+      logLock();
+      bool haveRecord = logStore.read(cursor, record);
+      logUnlock();
+      if (!haveRecord) {
+        break;
+      }
 
-    DynamicJsonDocument doc(1536);
-    
-    // Basic device info
-    doc["name"] = deviceName;
-    doc["ip"] = WiFi.localIP().toString();
-    doc["mac"] = WiFi.macAddress();
-    doc["hostname"] = deviceName;
-    doc["type"] = deviceType;
-    doc["description"] = deviceDescription;
-    
-    // Device capabilities
-    JsonArray capabilities = doc.createNestedArray("capabilities");
-    
-    // Door status sensor (binary_sensor)
-    JsonObject doorCap = capabilities.createNestedObject();
-    doorCap["identifier"] = "door";
-    doorCap["name"] = "Door";
-    doorCap["type"] = "binary_sensor";
-    doorCap["valueType"] = "boolean";
-    doorCap["description"] = "Door open/closed status";
-    
-    // Trigger capability (switch)
-    JsonObject triggerCap = capabilities.createNestedObject();
-    triggerCap["identifier"] = "trigger";
-    triggerCap["name"] = "Trigger";
-    triggerCap["type"] = "switch";
-    triggerCap["valueType"] = "boolean";
-    triggerCap["description"] = "Trigger garage door opener";
-    
-    // Control API for trigger
-    JsonObject triggerApi = triggerCap.createNestedObject("controlApi");
-    triggerApi["method"] = "POST";
-    triggerApi["endpoint"] = "/api/trigger";
-    JsonArray triggerActions = triggerApi.createNestedArray("actions");
-    triggerActions.add("on");
-
-    String jsonPayload;
-    serializeJson(doc, jsonPayload);
+      size_t lengths[2] = {0, 0};   // Text, binary
+      bool encoded[2] = {false, false};
+      bool anyRoom = false;
+      for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+        Slot& slot = local[i];
+        if (clients[i] == nullptr || budget[i] == 0 || slot.logSeq > record.seq) {
+          continue;
+        }
+        if (slot.logSeq < record.seq) {
+          droppedLogs += record.seq - slot.logSeq;   // Evicted before it was sent
+        }
+        slot.logSeq = record.seq + 1;
+        if (record.level == LOG_DEBUG && newest - record.seq >= WS_DEBUG_BACKLOG) {
+          droppedDebug++;
+        } else {
+          int format = slot.binary ? 1 : 0;
+          if (!encoded[format]) {
+            encoded[format] = true;
+            lengths[format] = encodeLog(record, slot.binary);
+          }
+          if (lengths[format] > 0) {
+            if (slot.binary) {
+              clients[i]->binary((const char*)binaryFrame, lengths[format]);
+            } else {
+              clients[i]->text(textFrame, lengths[format]);
+            }
+            budget[i]--;
+          }
+        }
+        anyRoom = anyRoom || (budget[i] > 0 && slot.logSeq <= newest);
+      }
+      if (!anyRoom) {
+        break;
+      }
+    }
 
-    Serial.println("📡 Attempting device registration...");
-    Serial.print("URL: ");
-    Serial.println(registrationUrl);
-    Serial.print("Payload size: ");
-    Serial.println(jsonPayload.length());
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (clients[i] != nullptr && local[i].logSeq <= newest) {
+        return true;
+      }
+    }
+    return false;
+  }
 
-    int httpResponseCode = http.POST(jsonPayload);
+  bool flushLocked() {
+    size_t otaCopyLength;
+    uint32_t generation = snapshot(otaCopyLength);
+    bool pending = false;
 
-    if (httpResponseCode > 0) {
-      // Check response size to prevent memory exhaustion
-      int responseSize = http.getSize();
-      if (responseSize > 4096) {  // Maximum 4KB response
-        lastRegistrationSuccess = false;
-        lastRegistrationError = "Response too large";
-        Serial.print("❌ Response too large: ");
-        Serial.print(responseSize);
-        Serial.println(" bytes");
-        http.end();
-        return false;
+    // State before log lines, so a client never sees a stale door after newer logs
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      AsyncWebSocketClient* client = clients[i];
+      if (client == nullptr) {
+        continue;
       }
-      
-      String response = http.getString();
-      Serial.print("✅ HTTP Response Code: ");
-      Serial.println(httpResponseCode);
-      Serial.print("Response: ");
-      Serial.println(response);
-      
-      DynamicJsonDocument responseDoc(1024);
-      DeserializationError error = deserializeJson(responseDoc, response);
-
-      if (!error) {
-        bool success = responseDoc["success"] | false;
-        String message = responseDoc["message"] | "";
-
-        if (success) {
-          lastRegistrationSuccess = true;
-          lastRegistrationError = "";
-          lastRegistrationTime = millis();
-          Serial.println("✅ Device registered successfully!");
-          http.end();
-          return true;
+      if (local[i].statusResync) {
+        if (client->queueIsFull()) {
+          pending = true;
         } else {
-          lastRegistrationSuccess = false;
-          lastRegistrationError = message;
-          Serial.print("❌ Registration failed: ");
-          Serial.println(message);
+          sendStatusToClient(client);
+          local[i].statusResync = false;
+        }
+      }
+      if (local[i].otaSeen != generation) {
+        if (client->queueIsFull()) {
+          pending = true;
+        } else {
+          client->text(otaCopy, otaCopyLength);
+          local[i].otaSeen = generation;
         }
-      } else {
-        lastRegistrationSuccess = false;
-        lastRegistrationError = "Invalid JSON response";
-        Serial.println("❌ Invalid JSON response from server");
       }
-    } else {
-      lastRegistrationSuccess = false;
-      // Build error message without concatenation
-      char errorBuf[64];
-      snprintf(errorBuf, sizeof(errorBuf), "HTTP error: %d", httpResponseCode);
-      lastRegistrationError = errorBuf;
-      Serial.print("❌ HTTP error: ");
-      Serial.println(httpResponseCode);
     }
 
-    lastRegistrationTime = millis();
-    http.end();
-    return false;
+    pending = flushLogs() || pending;
+    writeBack();
+    return pending;
   }
 
-  bool isRegistrationDue() {
-    if (!registrationEnabled) {
-      return false;
-    }
-    if (lastRegistrationTime == 0) {
-      return true;
-    }
-    unsigned long timeSinceLastRegistration = millis() - lastRegistrationTime;
-    return timeSinceLastRegistration >= REGISTRATION_INTERVAL_MS;
+public:
+  WsBroadcaster()
+      : sendMutex(nullptr), count(0), otaLength(0), otaGeneration(0), droppedDebug(0),
+        droppedLogs(0), coalescedStatus(0), coalescedOta(0) {
+    portMUX_INITIALIZE(&lock);
+    memset(slots, 0, sizeof(slots));
   }
 
-  void checkAndRegister() {
-    if (isRegistrationDue()) {
-      registerDevice();
+  // Call before the web server starts
+  void begin() {
+    if (sendMutex == nullptr) {
+      sendMutex = xSemaphoreCreateMutex();
     }
   }
 
-  void forceRegister() {
-    lastRegistrationTime = 0;
-    registerDevice();
+  // AsyncTCP task, on connect. False when every slot is taken.
+  bool add(uint32_t id, bool binary) {
+    logLock();
+    uint32_t nextSeq = logStore.newestSeq() + 1;
+    logUnlock();
+
+    bool added = false;
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS && !added; i++) {
+      if (!slots[i].used) {
+        slots[i].used = true;
+        slots[i].binary = binary;
+        slots[i].statusResync = false;
+        slots[i].id = id;
+        slots[i].logSeq = nextSeq;
+        slots[i].otaSeen = otaGeneration;
+        count++;
+        added = true;
+      }
+    }
+    portEXIT_CRITICAL(&lock);
+    return added;
   }
 
-  // Send status update to server
-  bool sendStatusUpdate(bool doorOpen, String transition) {
-    if (!registrationEnabled) {
-      return false;
+  void remove(uint32_t id) {
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (slots[i].used && slots[i].id == id) {
+        slots[i].used = false;
+        count--;
+        break;
+      }
     }
+    portEXIT_CRITICAL(&lock);
+  }
 
-    if (WiFi.status() != WL_CONNECTED) {
-      return false;
+  bool isBinary(uint32_t id) {
+    bool binary = false;
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (slots[i].used && slots[i].id == id) {
+        binary = slots[i].binary;
+        break;
+      }
     }
+    portEXIT_CRITICAL(&lock);
+    return binary;
+  }
 
-    HTTPClient http;
+  size_t clientCount() const { return count; }
 
-    // Construct status update URL
-    String statusUrl = serverUrl;
-    if (!statusUrl.endsWith("/")) {
-      statusUrl += "/";
+  size_t binaryCount() {
+    size_t binary = 0;
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (slots[i].used && slots[i].binary) {
+        binary++;
+      }
     }
-    statusUrl += "api/smart_devices/status_update";
+    portEXIT_CRITICAL(&lock);
+    return binary;
+  }
 
-    // Begin HTTP connection
-    http.begin(statusUrl);
-    http.addHeader("Content-Type", "application/json");
-    http.setTimeout(5000); // 5 second timeout
+  // Any task, after a line was added to logStore; the loop sends it
+  void notifyLog() {
+    if (count > 0) {
+      wakeLoop();
+    }
+  }
 
-    // Create status JSON payload
-    DynamicJsonDocument doc(512);
-    doc["mac"] = WiFi.macAddress();
-    doc["door"] = doorOpen;
-    doc["door_transition"] = transition;
-    doc["timestamp"] = millis();
+  // Sends pending status, OTA and log frames. Returns true when something is
+  // still waiting for room (or another task is sending), so the caller retries.
+  bool flush() {
+    if (sendMutex == nullptr || xSemaphoreTake(sendMutex, 0) != pdTRUE) {
+      return true;
+    }
+    bool pending = flushLocked();
+    xSemaphoreGive(sendMutex);
+    return pending;
+  }
 
-    String jsonPayload;
-    serializeJson(doc, jsonPayload);
+  // Loop task. A status update in each encoding (empty when unused). Clients
+  // that cannot take it, or already owe a full status, get the latest full
+  // one from flush() instead. full updates also settle an owed resync.
+  void broadcastStatus(const char* text, size_t textLength, const uint8_t* binary, size_t binaryLength,
+                       bool full) {
+    bool resyncNeeded = false;
+    if (sendMutex == nullptr || xSemaphoreTake(sendMutex, 0) != pdTRUE) {
+      portENTER_CRITICAL(&lock);
+      for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (slots[i].used) {
+          slots[i].statusResync = true;
+        }
+      }
+      coalescedStatus++;
+      portEXIT_CRITICAL(&lock);
+      wakeLoop();
+      return;
+    }
 
-    // Send POST request
-    int httpResponseCode = http.POST(jsonPayload);
+    size_t otaCopyLength;
+    snapshot(otaCopyLength);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      AsyncWebSocketClient* client = clients[i];
+      size_t length = local[i].binary ? binaryLength : textLength;
+      if (client == nullptr || length == 0) {
+        continue;
+      }
+      if ((local[i].statusResync && !full) || client->queueIsFull()) {
+        local[i].statusResync = true;
+        coalescedStatus++;
+        resyncNeeded = true;
+        continue;
+      }
+      if (local[i].binary) {
+        client->binary((const char*)binary, binaryLength);
+      } else {
+        client->text(text, textLength);
+      }
+      local[i].statusResync = false;
+    }
+    writeBack();
+    xSemaphoreGive(sendMutex);
+    if (resyncNeeded) {
+      wakeLoop();
+    }
+  }
 
-    // Check response
-    if (httpResponseCode > 0) {
-      http.end();
-      return true;
+  // Any task. Replaces the OTA frame not yet delivered, then tries to send it
+  // right away: ArduinoOTA reports progress from inside the loop task.
+  void broadcastOta(const char* frame, size_t length) {
+    length = min(length, sizeof(otaFrame));
+    portENTER_CRITICAL(&lock);
+    for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+      if (slots[i].used && slots[i].otaSeen != otaGeneration) {
+        coalescedOta++;
+      }
     }
+    memcpy(otaFrame, frame, length);
+    otaLength = length;
+    otaGeneration++;
+    portEXIT_CRITICAL(&lock);
 
-    http.end();
-    return false;
+    if (flush()) {
+      wakeLoop();
+    }
   }
 
-  String getServerUrl() const { return serverUrl; }
-  String getDeviceName() const { return deviceName; }
-  String getDeviceType() const { return deviceType; }
-  String getDeviceDescription() const { return deviceDescription; }
-  bool isEnabled() const { return registrationEnabled; }
-  bool getLastSuccess() const { return lastRegistrationSuccess; }
-  String getLastError() const { return lastRegistrationError; }
+  uint32_t getDroppedDebug() const { return droppedDebug; }
+  uint32_t getDroppedLogs() const { return droppedLogs; }
+  uint32_t getCoalescedStatus() const { return coalescedStatus; }
+  uint32_t getCoalescedOta() const { return coalescedOta; }
 };
 
-// Global registration instance
-DeviceRegistration* deviceRegistration = nullptr;
-
-// Function declarations
-void setupWiFi();
-void setupWebServer();
-void setupGPIO();
-void setupOTA();
-void loadConfiguration();
-void saveConfiguration();
-void handleButton();
-void handleRelay();
-void updateDoorStatus();
-void triggerRelay();
-void handleStatusTransition();
-void logMessage(String level, String message);
-void sendLogToWebSocket(String level, String message);
-void broadcastStatusUpdate();
-String getFormattedTime();
-void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
-void configureWatchdog(uint32_t timeoutSeconds);
-inline void feedWatchdog();
-void disableWatchdog();
-void checkWiFiConnection();
-
-void setup() {
-  Serial.begin(115200);
-  delay(1000);
+WsBroadcaster wsBroadcaster;
 
-  disableWatchdog();
+#define DEVICE_COMMAND_QUEUE_LENGTH 8
 
-  logMessage("INFO", "=== Athom Garage Door Opener ===");
-  logMessage("INFO", "Version: 1.1.0 (OTA + Logs)");
-  logMessage("INFO", "Starting initialization...");
-  yield();
-  feedWatchdog();
+// Change handed to loop() by the input task, web handlers or MQTT
+struct DeviceCommand {
+  enum Type : uint8_t { CONTACT_CHANGED, TRIGGERED } type;
+  uint8_t channel;             // Door channel it applies to
+  bool level;                  // CONTACT_CHANGED: debounced pin level
+  TriggerSource source;        // TRIGGERED: who asked
+  uint32_t timestamp;
+};
 
-  logMessage("INFO", "Initializing preferences...");
-  preferences.begin(CONFIG_NAMESPACE, false);
-  yield();
-  feedWatchdog();
+void recordHistory(HistoryEvent event, TriggerSource source, uint8_t channel, uint32_t timestamp,
+                   const DeviceState& state);
 
-  logMessage("INFO", "Loading configuration...");
-  loadConfiguration();
-  delay(100);
-  yield();
-  feedWatchdog();
+// Owner of the door state.
+// Other tasks never write it: they post() a command to a FreeRTOS queue and
+// wake the loop, whose "state" task applies the commands in order, expires
+// each door's opening/closing transition and publishes the result. get() returns a
+// consistent copy on any task without locking or allocating.
+class DeviceStateStore {
+private:
+  QueueHandle_t commands;
+  DeviceState current;         // Loop task's working copy
+  SnapshotBuffer<DeviceState> published;
+  uint8_t contactKnown;        // Bit per channel
+  std::atomic<uint32_t> dropped;
+
+  void apply(const DeviceCommand& command) {
+    if (command.channel >= current.doorCount) {
+      return;
+    }
+    DoorState& door = current.doors[command.channel];
+    if (command.type == DeviceCommand::CONTACT_CHANGED) {
+      bool inverted = doorChannels[command.channel].inverted();
+      door.doorOpen = inverted ? !command.level : command.level;
+      logf(LOG_INFO, "%s status: %s", doorChannels[command.channel].name, door.doorOpen ? "OPEN" : "CLOSED");
+      // The first level is the one read at boot, not a door movement
+      uint8_t bit = 1 << command.channel;
+      HistoryEvent event = !(contactKnown & bit) ? HISTORY_BOOT : door.doorOpen ? HISTORY_OPENED : HISTORY_CLOSED;
+      contactKnown |= bit;
+      recordHistory(event, SOURCE_NONE, command.channel, command.timestamp, current);
+    } else if (command.type == DeviceCommand::TRIGGERED) {
+      door.transition = door.doorOpen ? TRANSITION_CLOSING : TRANSITION_OPENING;
+      door.transitionStartMs = command.timestamp;
+      recordHistory(HISTORY_TRIGGER, command.source, command.channel, command.timestamp, current);
+    }
+  }
 
-  // Setup GPIO
-  logMessage("INFO", "Setting up GPIO...");
-  yield();
-  setupGPIO();
-  delay(100);
-  yield();
-  feedWatchdog();
-  logMessage("INFO", "GPIO setup complete");
+public:
+  DeviceStateStore() : commands(nullptr), current(), contactKnown(0), dropped(0) {}
+
+  // Call before anything can post(), after the door channels are loaded
+  bool begin() {
+    current.doorCount = doorChannels.size();
+    published.store(current);
+    if (commands == nullptr) {
+      commands = xQueueCreate(DEVICE_COMMAND_QUEUE_LENGTH, sizeof(DeviceCommand));
+    }
+    return commands != nullptr;
+  }
 
-  // Setup WiFi
-  logMessage("INFO", "Setting up WiFi...");
-  yield();
-  setupWiFi();
-  delay(100);
-  yield();
-  feedWatchdog();
-  logMessage("INFO", "WiFi setup complete");
+  // Any task except ISRs. Never blocks; false when the queue is full.
+  bool post(DeviceCommand::Type type, bool level, uint32_t timestamp, TriggerSource source = SOURCE_NONE,
+            uint8_t channel = 0) {
+    DeviceCommand command;
+    command.type = type;
+    command.channel = channel;
+    command.level = level;
+    command.source = source;
+    command.timestamp = timestamp;
+    if (commands == nullptr || xQueueSend(commands, &command, 0) != pdTRUE) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      logf(LOG_WARN, "Device command queue full - state change dropped");
+      return false;
+    }
+    wakeLoop();
+    return true;
+  }
 
-  // Setup OTA
-  logMessage("INFO", "Setting up OTA...");
-  yield();
-  setupOTA();
-  delay(100);
-  yield();
-  feedWatchdog();
-  logMessage("INFO", "OTA setup complete");
+  // Loop task. Returns the milliseconds until the active transition
+  // expires, or UINT32_MAX when there is none.
+  uint32_t run() {
+    bool changed = false;
+    bool expired = false;
+    DeviceCommand command;
+    while (commands != nullptr && xQueueReceive(commands, &command, 0) == pdTRUE) {
+      apply(command);
+      changed = true;
+    }
 
-  // Setup web server
-  logMessage("INFO", "Starting web server...");
-  yield();
-  setupWebServer();
-  delay(100);
-  yield();
-  feedWatchdog();
-  logMessage("INFO", "Web server setup complete");
+    uint32_t wait = UINT32_MAX;
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < current.doorCount; i++) {
+      DoorState& door = current.doors[i];
+      if (door.transition == TRANSITION_NONE) {
+        continue;
+      }
+      uint32_t elapsed = now - door.transitionStartMs;
+      if (elapsed >= STATUS_TRANSITION_DURATION) {
+        door.transition = TRANSITION_NONE;
+        changed = true;
+        expired = true;
+        logf(LOG_DEBUG, "Status transition cleared (%s)", doorChannels[i].name);
+      } else {
+        wait = min(wait, (uint32_t)(STATUS_TRANSITION_DURATION - elapsed));
+      }
+    }
 
-  // Initialize Device Registration
-  if (!apMode) {
-    logMessage("INFO", "Initializing device registration...");
-    deviceRegistration = new DeviceRegistration(&preferences);
-    deviceRegistration->loadSettings();
-    logMessage("INFO", "Device registration initialized");
-    
-    // Register device on startup
-    if (deviceRegistration->isEnabled()) {
-      logMessage("INFO", "Registering device with control server...");
-      deviceRegistration->registerDevice();
+    if (changed) {
+      current.version++;
+      published.store(current);
     }
+    // Commands arrive through post(), which already woke this pass; an expiry
+    // is only noticed here, so wake the readers (status push, reporter, MQTT,
+    // UDP) for a second pass instead of leaving them to their idle deadlines
+    if (expired) {
+      wakeLoop();
+    }
+    return wait;
   }
 
-  configureWatchdog(WATCHDOG_TIMEOUT_SECONDS);
-
-  logMessage("INFO", "Setup complete!");
-  // Build IP message without concatenation
-  char ipMsg[64];
-  IPAddress ip = apMode ? WiFi.softAPIP() : WiFi.localIP();
-  snprintf(ipMsg, sizeof(ipMsg), "IP Address: %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  logMessage("INFO", ipMsg);
-}
+  DeviceState get() const { return published.load(); }
+  uint32_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+};
 
-void loop() {
-  feedWatchdog();
+DeviceStateStore deviceState;
 
-  if (apMode) {
-    dnsServer.processNextRequest();
-    checkWiFiConnection();
-  } else {
-    ArduinoOTA.handle();
+// Prebuilt /api/status body.
+// Fields that only change with the Wi-Fi connection or saved config are
+// serialized once (invalidateStatic()); doors, transitions, RSSI and uptime
+// are re-rendered when the DeviceState version moves or the body is older
+// than STATUS_CACHE_MAX_AGE_MS. Responses share the rendered String, so any
+// number of pollers cost at most one render per interval.
+// get() is only called from the AsyncTCP task; the flag may be set from any task.
+class StatusCache {
+private:
+  String staticJson;                     // '{' + static fields, without the closing brace
+  std::shared_ptr<String> body;
+  unsigned long renderedAt;
+  uint32_t renderedVersion;              // DeviceState the body was rendered from
+  std::atomic<bool> staticDirty;
+
+  void renderStatic() {
+    StaticJsonDocument<768> doc;
+    doc["wifi_connected"] = linkState == LINK_ONLINE;
+    IPAddress ip = apMode ? WiFi.softAPIP() : WiFi.localIP();
+    doc["ip_address"] = ip.toString();
+    doc["ssid"] = apMode ? String(AP_SSID) : WiFi.SSID();
+    doc["saved_ssid"] = wifiSSID;  // Saved WiFi SSID for configuration form
+    doc["saved_password"] = wifiPassword;  // Saved WiFi password for configuration form
+    doc["mac_address"] = WiFi.macAddress();
+    doc["hostname"] = WiFi.getHostname();
+    doc["firmware_version"] = FIRMWARE_VERSION;
+    JsonObject startup = doc.createNestedObject("startup");
+    startup["inputs_ready_ms"] = startupMetrics.inputsReadyMs;
+    startup["web_ready_ms"] = startupMetrics.webReadyMs;
+    startup["wifi_connected_ms"] = startupMetrics.wifiConnectedMs;
+
+    staticJson = "";
+    serializeJson(doc, staticJson);
+    staticJson.remove(staticJson.length() - 1);
   }
 
-  ws.cleanupClients();
-  
-  // Aggressive WebSocket cleanup to prevent memory leaks from dead clients
-  static unsigned long lastWsCleanup = 0;
-  if (millis() - lastWsCleanup > 30000) {  // Every 30 seconds
-    ws.cleanupClients(0);  // More aggressive cleanup with 0 timeout
-    lastWsCleanup = millis();
+  void render(const DeviceState& state) {
+    StaticJsonDocument<768> doc;
+    doc["door_open"] = state.doors[0].doorOpen;
+    doc["status_transition"] = transitionName(state.doors[0].transition);
+    addDoorStatus(doc, state, doorChannels);
+    doc["rssi"] = WiFi.RSSI();
+    doc["uptime"] = millis() / 1000;
+    char volatileJson[DOOR_STATUS_JSON_MAX];
+    serializeJson(doc, volatileJson, sizeof(volatileJson));
+
+    // Responses still sending the previous body keep their own reference
+    std::shared_ptr<String> next = std::make_shared<String>();
+    next->reserve(staticJson.length() + strlen(volatileJson) + 1);
+    *next += staticJson;
+    *next += ',';
+    *next += volatileJson + 1;  // Skip '{'; its closing brace ends the object
+    body = next;
+    renderedVersion = state.version;
   }
 
-  handleButton();
-  handleRelay();
-  updateDoorStatus();
-  handleStatusTransition();
+public:
+  StatusCache() : renderedAt(0), renderedVersion(0), staticDirty(true) {}
+
+  void invalidateStatic() { staticDirty.store(true); }
 
-  // Send status update to server periodically or when state changes (only in station mode and after successful registration)
-  if (deviceRegistration != nullptr && !apMode && WiFi.status() == WL_CONNECTED && deviceRegistration->getLastSuccess()) {
-    unsigned long currentTime = millis();
-    bool stateChanged = (doorOpen != lastDoorOpenState);
-    
-    if (stateChanged || (currentTime - lastStatusUpdateTime >= STATUS_UPDATE_INTERVAL)) {
-      deviceRegistration->sendStatusUpdate(doorOpen, doorStatusTransition);
-      lastStatusUpdateTime = currentTime;
-      lastDoorOpenState = doorOpen;
+  std::shared_ptr<String> get() {
+    // Clear the flag before rendering so a change made meanwhile is picked up next time
+    bool rebuildStatic = staticDirty.load();
+    if (rebuildStatic) {
+      staticDirty.store(false);
+      renderStatic();
     }
+    unsigned long now = millis();
+    DeviceState state = deviceState.get();
+    if (rebuildStatic || !body || state.version != renderedVersion ||
+        now - renderedAt >= STATUS_CACHE_MAX_AGE_MS) {
+      render(state);
+      renderedAt = now;
+    }
+    return body;
   }
+};
+
+StatusCache statusCache;
+
+// Relay pulse timed by a one-shot esp_timer, one controller per door channel.
+// The pulse ends exactly the channel's pulse time after it starts, however busy
+// loop() is. Triggers from the web API and the button are serialized: while
+// a pulse (or the gap after it) is running, up to RELAY_MAX_PENDING more are
+// queued and each starts at least minGapMs after the previous pulse ended,
+// so the opener never sees one long press or a double press.
+// request() may be called from any task; the timer callback runs in the
+// esp_timer task. Both only touch state and GPIO under the spinlock. The
+// status LED is shared, so it stays lit while any channel is pulsing.
+class RelayController {
+public:
+  enum Result { STARTED, QUEUED, REJECTED };
 
-  // Check and perform device registration if due (every 5 minutes)
-  if (!apMode && deviceRegistration != nullptr) {
-    deviceRegistration->checkAndRegister();
+private:
+  enum State : uint8_t { IDLE, PULSING, GAP };
+
+  static std::atomic<uint8_t> activePulses;
+
+  esp_timer_handle_t timer;
+  portMUX_TYPE lock;
+  uint8_t pin;
+  uint32_t pulseMs;
+  State state;
+  uint8_t pending;
+  uint32_t minGapMs;
+  int64_t lastPulseEnd;   // esp_timer_get_time() when the last pulse ended
+  uint32_t pulses;
+  uint32_t queued;
+  uint32_t rejected;
+
+  static void onTimer(void* arg) {
+    static_cast<RelayController*>(arg)->timerFired();
   }
 
-  yield();
-  delay(10);
-}
+  // Drives the outputs for a pulse that has already been committed to under
+  // the lock (state == PULSING). Called with the lock released: GPIO writes
+  // and esp_timer calls do not belong in a critical section.
+  void beginPulse() {
+    digitalWrite(pin, HIGH);
+    activePulses.fetch_add(1);
+    digitalWrite(LED_PIN, LOW);  // LED ON (inverted)
+    esp_timer_start_once(timer, (uint64_t)pulseMs * 1000);
+  }
 
-void setupGPIO() {
-  // Contact sensor
-  pinMode(CONTACT_PIN, INPUT);
-  delay(10);
-  yield();
+  void timerFired() {
+    portENTER_CRITICAL(&lock);
+    State fired = state;
+    if (fired == GAP) {
+      pending--;
+      state = PULSING;
+      pulses++;
+    }
+    portEXIT_CRITICAL(&lock);
 
-  // Relay (active high, pulse mode)
-  pinMode(RELAY_PIN, OUTPUT);
-  delay(10);
-  digitalWrite(RELAY_PIN, LOW);
-  delay(10);
-  yield();
+    if (fired == GAP) {
+      beginPulse();
+      return;
+    }
+    if (fired != PULSING) {
+      return;
+    }
 
+    // Still PULSING until the pin is low, so request() can only queue and
+    // cannot start a new pulse that this write would cut short
+    digitalWrite(pin, LOW);
+    if (activePulses.fetch_sub(1) == 1) {
+      digitalWrite(LED_PIN, apMode ? LOW : HIGH);  // Keep LED ON in AP mode
+    }
+
+    portENTER_CRITICAL(&lock);
+    lastPulseEnd = esp_timer_get_time();
+    bool startGap = pending > 0;
+    state = startGap ? GAP : IDLE;
+    uint32_t gapMs = minGapMs;
+    portEXIT_CRITICAL(&lock);
+
+    if (startGap) {
+      esp_timer_start_once(timer, (uint64_t)gapMs * 1000);
+    }
+  }
+
+public:
+  RelayController()
+      : timer(nullptr), pin(RELAY_PIN), pulseMs(RELAY_PULSE_TIME), state(IDLE), pending(0),
+        minGapMs(DEFAULT_RELAY_GAP_MS), lastPulseEnd(0), pulses(0), queued(0), rejected(0) {
+    portMUX_INITIALIZE(&lock);
+  }
+
+  // Call after relayPin and LED_PIN are configured
+  bool begin(uint8_t relayPin, uint32_t pulseTimeMs) {
+    pin = relayPin;
+    pulseMs = pulseTimeMs;
+    esp_timer_create_args_t args = {};
+    args.callback = onTimer;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "relay";
+    return esp_timer_create(&args, &timer) == ESP_OK;
+  }
+
+  void setMinGap(uint32_t gapMs) {
+    portENTER_CRITICAL(&lock);
+    minGapMs = min(gapMs, (uint32_t)MAX_RELAY_GAP_MS);
+    portEXIT_CRITICAL(&lock);
+  }
+
+  uint32_t getMinGap() const { return minGapMs; }
+  uint32_t getPulseMs() const { return pulseMs; }
+
+  Result request() {
+    Result result;
+    bool startPulse = false;
+    uint32_t waitMs = 0;
+    portENTER_CRITICAL(&lock);
+    if (timer == nullptr) {
+      result = REJECTED;
+      rejected++;
+    } else if (state == IDLE) {
+      uint32_t sinceLastMs = (uint32_t)((esp_timer_get_time() - lastPulseEnd) / 1000);
+      if (pulses == 0 || sinceLastMs >= minGapMs) {
+        state = PULSING;
+        pulses++;
+        startPulse = true;
+        result = STARTED;
+      } else {
+        // Too soon after the previous pulse: wait out the rest of the gap
+        pending = 1;
+        state = GAP;
+        waitMs = minGapMs - sinceLastMs;
+        result = QUEUED;
+        queued++;
+      }
+    } else if (pending < RELAY_MAX_PENDING) {
+      pending++;
+      result = QUEUED;
+      queued++;
+    } else {
+      result = REJECTED;
+      rejected++;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    // The timer is idle in both cases, so nothing can race these calls
+    if (startPulse) {
+      beginPulse();
+    } else if (waitMs > 0) {
+      esp_timer_start_once(timer, (uint64_t)waitMs * 1000);
+    }
+    return result;
+  }
+
+  void getStats(JsonObject stats) {
+    portENTER_CRITICAL(&lock);
+    bool active = state == PULSING;
+    uint8_t waiting = pending;
+    uint32_t pulseCount = pulses;
+    uint32_t queuedCount = queued;
+    uint32_t rejectedCount = rejected;
+    portEXIT_CRITICAL(&lock);
+
+    stats["active"] = active;
+    stats["pending"] = waiting;
+    stats["pulses"] = pulseCount;
+    stats["queued"] = queuedCount;
+    stats["rejected"] = rejectedCount;
+  }
+};
+
+std::atomic<uint8_t> RelayController::activePulses(0);
+
+RelayController relays[DOOR_MAX_CHANNELS];  // First doorChannels.size() are in use
+
+// Counters and histograms behind /api/metrics, updated in place by the code
+// they measure. Each histogram has one writer at a time: HTTP handlers run on
+// the AsyncTCP task, UDP triggers on the AsyncUDP task, button presses on
+// the input task, loop() on its own, registration under its mutex and status
+// updates on the reporter task.
+struct Metrics {
+  LatencyHistogram loopBusy;          // loop() work per iteration, excluding the sleep
+  LatencyHistogram httpRoot;          // Request start to response fully sent, streamed bodies included
+  LatencyHistogram httpStatus;
+  LatencyHistogram httpLogs;
+  LatencyHistogram httpTrigger;
+  LatencyHistogram udpTrigger;        // Datagram in to relay queued, on the AsyncUDP task
+  LatencyHistogram buttonEdgeToRelay[POWER_PROFILE_COUNT];  // Per power profile, on the input task
+  LatencyHistogram registration;
+  uint32_t registrationFailures;
+  LatencyHistogram statusUpdate;
+  uint32_t statusUpdateFailures;
+  std::atomic<uint32_t> wsSendDrops;  // Sends from any task, including log lines
+  uint32_t wifiDisconnects;
+  uint32_t wifiReconnects;
+};
+Metrics metrics;
+
+// Records from now until the response has been sent in full. AsyncWebServer
+// tears the request down (and calls onDisconnect) only after the last chunk
+// is acknowledged or the client goes away, so streamed bodies are included.
+// Runs on the AsyncTCP task like the handler itself.
+void recordWhenSent(AsyncWebServerRequest* request, LatencyHistogram& histogram) {
+  uint32_t start = micros();
+  request->onDisconnect([&histogram, start]() { histogram.record(micros() - start); });
+}
+
+// Point-in-time door state handed from loop() to the reporter task
+struct StatusSnapshot {
+  DoorState doors[DOOR_MAX_CHANNELS];
+  uint8_t doorCount;
+  unsigned long timestamp;
+};
+
+// Background status reporter.
+// Owns one keep-alive HTTP connection to the control server and drains
+// snapshots queued by loop(), so a slow server never stalls GPIO handling.
+class StatusReporter {
+private:
+  SpscQueue<StatusSnapshot, STATUS_QUEUE_LENGTH> queue;
+  TaskHandle_t taskHandle;
+  SemaphoreHandle_t endpointMutex;
+  char statusUrl[160];
+  uint32_t endpointGeneration;
+  char macAddress[18];
+
+  // Counters. Written only by the reporter task (queue drops by the producer),
+  // read racily by the web handlers - fine for 32-bit values on this chip.
+  uint32_t sentCount;
+  uint32_t failedCount;
+  uint32_t droppedCount;
+  uint32_t coalescedCount;
+  uint32_t reconnectCount;
+  uint32_t queueHighWater;
+  uint32_t lastLatencyMs;
+  uint32_t maxLatencyMs;
+  uint32_t totalLatencyMs;
+
+  static void taskEntry(void* arg) {
+    static_cast<StatusReporter*>(arg)->run();
+  }
+
+  void run() {
+    WiFiClient client;
+    HTTPClient http;
+    http.setReuse(true);
+    http.setTimeout(5000);
+
+    uint32_t connectedGeneration = 0;
+    bool everConnected = false;
+
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+      // Only the newest state matters to the server; skip anything older
+      StatusSnapshot snapshot;
+      bool haveSnapshot = false;
+      while (queue.pop(snapshot)) {
+        if (haveSnapshot) {
+          coalescedCount++;
+        }
+        haveSnapshot = true;
+      }
+      if (!haveSnapshot || WiFi.status() != WL_CONNECTED) {
+        continue;
+      }
+
+      char url[sizeof(statusUrl)];
+      uint32_t generation;
+      xSemaphoreTake(endpointMutex, portMAX_DELAY);
+      strlcpy(url, statusUrl, sizeof(url));
+      generation = endpointGeneration;
+      xSemaphoreGive(endpointMutex);
+
+      if (url[0] == '\0') {
+        continue;
+      }
+
+      // Server changed: drop the old connection rather than reuse it
+      if (generation != connectedGeneration) {
+        client.stop();
+        connectedGeneration = generation;
+      }
+      if (!client.connected()) {
+        if (everConnected) {
+          reconnectCount++;
+        }
+        everConnected = true;
+      }
+
+      sendStatusUpdate(http, client, url, snapshot);
+    }
+  }
+
+  bool sendStatusUpdate(HTTPClient& http, WiFiClient& client, const char* url,
+                        const StatusSnapshot& snapshot) {
+    StaticJsonDocument<768> doc;
+    doc["mac"] = macAddress;
+    doc["door"] = snapshot.doors[0].doorOpen;
+    doc["door_transition"] = transitionName(snapshot.doors[0].transition);
+    doc["timestamp"] = snapshot.timestamp;
+    // Extra doors as their registered capabilities; single-door payloads are unchanged
+    if (snapshot.doorCount > 1) {
+      JsonArray doors = doc.createNestedArray("doors");
+      for (uint8_t i = 0; i < snapshot.doorCount; i++) {
+        char suffix[4];
+        char identifier[12];
+        doorChannelSuffix(i, suffix, sizeof(suffix));
+        snprintf(identifier, sizeof(identifier), "door%s", suffix);
+        JsonObject door = doors.createNestedObject();
+        door["channel"] = i;
+        door["identifier"] = identifier;
+        door["door"] = snapshot.doors[i].doorOpen;
+        door["door_transition"] = transitionName(snapshot.doors[i].transition);
+      }
+    }
+
+    char payload[STATUS_REPORT_JSON_MAX];
+    size_t payloadLen = serializeJson(doc, payload, sizeof(payload));
+
+    unsigned long start = millis();
+    uint32_t startUs = micros();
+    http.begin(client, url);
+    http.addHeader("Content-Type", "application/json");
+    int httpResponseCode = http.POST((uint8_t*)payload, payloadLen);
+    // end() keeps the socket open when the server agreed to keep-alive
+    http.end();
+    uint32_t latency = millis() - start;
+    metrics.statusUpdate.record(micros() - startUs);
+
+    if (httpResponseCode > 0) {
+      sentCount++;
+      lastLatencyMs = latency;
+      totalLatencyMs += latency;
+      if (latency > maxLatencyMs) {
+        maxLatencyMs = latency;
+      }
+      return true;
+    }
+
+    failedCount++;
+    metrics.statusUpdateFailures++;
+    client.stop();
+    return false;
+  }
+
+public:
+  StatusReporter() : taskHandle(nullptr),
+                     endpointMutex(nullptr),
+                     endpointGeneration(0),
+                     sentCount(0),
+                     failedCount(0),
+                     droppedCount(0),
+                     coalescedCount(0),
+                     reconnectCount(0),
+                     queueHighWater(0),
+                     lastLatencyMs(0),
+                     maxLatencyMs(0),
+                     totalLatencyMs(0) {
+    statusUrl[0] = '\0';
+    macAddress[0] = '\0';
+  }
+
+  bool begin() {
+    if (taskHandle != nullptr) {
+      return true;
+    }
+    if (endpointMutex == nullptr) {
+      endpointMutex = xSemaphoreCreateMutex();
+    }
+    strlcpy(macAddress, WiFi.macAddress().c_str(), sizeof(macAddress));
+    BaseType_t created = xTaskCreate(taskEntry, "status_reporter", STATUS_REPORTER_STACK_SIZE,
+                                     this, STATUS_REPORTER_PRIORITY, &taskHandle);
+    if (created != pdPASS) {
+      taskHandle = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  void setEndpoint(const String& serverUrl) {
+    if (endpointMutex == nullptr) {
+      endpointMutex = xSemaphoreCreateMutex();
+    }
+    xSemaphoreTake(endpointMutex, portMAX_DELAY);
+    const char* separator = serverUrl.endsWith("/") ? "" : "/";
+    snprintf(statusUrl, sizeof(statusUrl), "%s%sapi/smart_devices/status_update",
+             serverUrl.c_str(), separator);
+    endpointGeneration++;
+    xSemaphoreGive(endpointMutex);
+  }
+
+  // Called from loop(). Never blocks; returns false if the queue is full.
+  bool enqueue(const DeviceState& state) {
+    if (taskHandle == nullptr) {
+      return false;
+    }
+
+    StatusSnapshot snapshot;
+    memcpy(snapshot.doors, state.doors, sizeof(snapshot.doors));
+    snapshot.doorCount = state.doorCount;
+    snapshot.timestamp = millis();
+
+    if (!queue.push(snapshot)) {
+      droppedCount++;
+      xTaskNotifyGive(taskHandle);
+      return false;
+    }
+
+    uint32_t depth = queue.size();
+    if (depth > queueHighWater) {
+      queueHighWater = depth;
+    }
+    xTaskNotifyGive(taskHandle);
+    return true;
+  }
+
+  void getStats(JsonObject stats) const {
+    stats["running"] = taskHandle != nullptr;
+    stats["queue_depth"] = queue.size();
+    stats["queue_high_water"] = queueHighWater;
+    stats["sent"] = sentCount;
+    stats["failed"] = failedCount;
+    stats["dropped"] = droppedCount;
+    stats["coalesced"] = coalescedCount;
+    stats["reconnects"] = reconnectCount;
+    stats["last_latency_ms"] = lastLatencyMs;
+    stats["max_latency_ms"] = maxLatencyMs;
+    stats["avg_latency_ms"] = sentCount > 0 ? totalLatencyMs / sentCount : 0;
+  }
+};
+
+// Defined with FirmwarePull below
+void offerFirmware(const String& version, const String& url, size_t size, const String& sha256);
+
+// Device Registration class
+#define CONFIG_MAX_STAGED 24          // Distinct keys waiting for a commit
+#define CONFIG_COMMIT_DELAY_MS 500    // Quiet time before staged keys go to flash
+
+// Settings writes staged in RAM and committed in one batch off the request
+// path. put*() only stages a key when its value differs from what a read
+// would return, so re-saving a form rewrites nothing; get*() sees staged
+// values before flash. The "config" loop task commits once no key has been
+// staged for CONFIG_COMMIT_DELAY_MS, so one POST costs one short burst of
+// NVS writes on the loop task instead of a flash write per key inside the
+// AsyncTCP handler. Anything that restarts the device calls commit() first.
+// Runtime state with its own write policy (Wi-Fi cache, UDP counters) still
+// goes to Preferences directly. Safe from any task.
+class ConfigStore {
+public:
+  explicit ConfigStore(Preferences& prefs)
+      : prefs(prefs), lock(nullptr), count(0), lastStaged(0), staged(0), unchanged(0), written(0),
+        commits(0) {}
+
+  void begin() {
+    lock = xSemaphoreCreateRecursiveMutex();
+  }
+
+  String getString(const char* key, const char* defaultValue) {
+    Guard guard(lock);
+    Entry* entry = find(key);
+    if (entry != nullptr) {
+      return entry->removed ? String(defaultValue) : entry->text;
+    }
+    return prefs.getString(key, defaultValue);
+  }
+
+  bool getBool(const char* key, bool defaultValue) { return getNumber(key, BOOL, defaultValue) != 0; }
+  uint8_t getUChar(const char* key, uint8_t defaultValue) { return getNumber(key, UCHAR, defaultValue); }
+  uint16_t getUShort(const char* key, uint16_t defaultValue) { return getNumber(key, USHORT, defaultValue); }
+  uint32_t getUInt(const char* key, uint32_t defaultValue) { return getNumber(key, UINT, defaultValue); }
+
+  void putString(const char* key, const String& value) {
+    Guard guard(lock);
+    if (isKeyLocked(key) && getString(key, "") == value) {
+      unchanged++;
+      return;
+    }
+    Entry* entry = stage(key, STRING);
+    if (entry != nullptr) {
+      entry->text = value;
+    }
+  }
+
+  void putBool(const char* key, bool value) { putNumber(key, BOOL, value ? 1 : 0); }
+  void putUChar(const char* key, uint8_t value) { putNumber(key, UCHAR, value); }
+  void putUShort(const char* key, uint16_t value) { putNumber(key, USHORT, value); }
+  void putUInt(const char* key, uint32_t value) { putNumber(key, UINT, value); }
+
+  void remove(const char* key) {
+    Guard guard(lock);
+    if (!isKeyLocked(key)) {
+      unchanged++;
+      return;
+    }
+    Entry* entry = stage(key, STRING);
+    if (entry != nullptr) {
+      entry->removed = true;
+    }
+  }
+
+  // "config" scheduler task. Returns the milliseconds until the commit is
+  // due, or UINT32_MAX when nothing is staged.
+  uint32_t run(uint32_t now) {
+    Guard guard(lock);
+    if (count == 0) {
+      return UINT32_MAX;
+    }
+    uint32_t quiet = now - lastStaged;
+    if (quiet < CONFIG_COMMIT_DELAY_MS) {
+      return CONFIG_COMMIT_DELAY_MS - quiet;
+    }
+    commit();
+    return UINT32_MAX;
+  }
+
+  // Writes every staged key now
+  void commit() {
+    Guard guard(lock);
+    if (count == 0) {
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      write(entries[i]);
+    }
+    written += count;
+    commits++;
+    logf(LOG_DEBUG, "Config: committed %u keys", (unsigned)count);
+    clearLocked();
+  }
+
+  // Drops staged keys, e.g. ahead of a factory reset
+  void discard() {
+    Guard guard(lock);
+    clearLocked();
+  }
+
+  void getStats(JsonObject stats) {
+    Guard guard(lock);
+    stats["pending"] = count;
+    stats["staged"] = staged;
+    stats["unchanged"] = unchanged;
+    stats["written"] = written;
+    stats["commits"] = commits;
+  }
+
+private:
+  enum Type : uint8_t { STRING, BOOL, UCHAR, USHORT, UINT };
+
+  struct Entry {
+    const char* key;
+    Type type;
+    bool removed;
+    String text;
+    uint32_t number;
+  };
+
+  // Recursive, so put*() can read through get*() while holding it
+  class Guard {
+  public:
+    explicit Guard(SemaphoreHandle_t lock) : lock(lock) { xSemaphoreTakeRecursive(lock, portMAX_DELAY); }
+    ~Guard() { xSemaphoreGiveRecursive(lock); }
+
+  private:
+    SemaphoreHandle_t lock;
+  };
+
+  Preferences& prefs;
+  SemaphoreHandle_t lock;
+  Entry entries[CONFIG_MAX_STAGED];
+  size_t count;
+  uint32_t lastStaged;
+  uint32_t staged;
+  uint32_t unchanged;
+  uint32_t written;
+  uint32_t commits;
+
+  Entry* find(const char* key) {
+    for (size_t i = 0; i < count; i++) {
+      if (strcmp(entries[i].key, key) == 0) {
+        return &entries[i];
+      }
+    }
+    return nullptr;
+  }
+
+  bool isKeyLocked(const char* key) {
+    Entry* entry = find(key);
+    return entry != nullptr ? !entry->removed : prefs.isKey(key);
+  }
+
+  uint32_t getNumber(const char* key, Type type, uint32_t defaultValue) {
+    Guard guard(lock);
+    Entry* entry = find(key);
+    if (entry != nullptr) {
+      return entry->removed ? defaultValue : entry->number;
+    }
+    switch (type) {
+      case BOOL: return prefs.getBool(key, defaultValue != 0);
+      case UCHAR: return prefs.getUChar(key, defaultValue);
+      case USHORT: return prefs.getUShort(key, defaultValue);
+      default: return prefs.getUInt(key, defaultValue);
+    }
+  }
+
+  void putNumber(const char* key, Type type, uint32_t value) {
+    Guard guard(lock);
+    if (isKeyLocked(key) && getNumber(key, type, ~value) == value) {
+      unchanged++;
+      return;
+    }
+    Entry* entry = stage(key, type);
+    if (entry != nullptr) {
+      entry->number = value;
+    }
+  }
+
+  // Entry for key, reused if already staged. A full table is committed on
+  // the spot rather than losing a write.
+  Entry* stage(const char* key, Type type) {
+    Entry* entry = find(key);
+    if (entry == nullptr) {
+      if (count == CONFIG_MAX_STAGED) {
+        commit();
+      }
+      entry = &entries[count++];
+      entry->key = key;
+    }
+    entry->type = type;
+    entry->removed = false;
+    staged++;
+    lastStaged = millis();
+    wakeLoop();
+    return entry;
+  }
+
+  void write(const Entry& entry) {
+    if (entry.removed) {
+      prefs.remove(entry.key);
+      return;
+    }
+    switch (entry.type) {
+      case STRING: prefs.putString(entry.key, entry.text); break;
+      case BOOL: prefs.putBool(entry.key, entry.number != 0); break;
+      case UCHAR: prefs.putUChar(entry.key, entry.number); break;
+      case USHORT: prefs.putUShort(entry.key, entry.number); break;
+      case UINT: prefs.putUInt(entry.key, entry.number); break;
+    }
+  }
+
+  void clearLocked() {
+    for (size_t i = 0; i < count; i++) {
+      entries[i].text = String();   // Free the buffer, not just empty it
+    }
+    count = 0;
+  }
+};
+
+ConfigStore configStore(preferences);
+
+// Registration settings as fixed text, so they can be handed between tasks
+// by value
+struct RegistrationSettings {
+  char serverUrl[REGISTRATION_URL_MAX + 1];
+  char deviceName[REGISTRATION_TEXT_MAX + 1];
+  char deviceType[REGISTRATION_TEXT_MAX + 1];
+  char deviceDescription[REGISTRATION_TEXT_MAX + 1];
+  bool enabled;
+  uint32_t heartbeatSeconds;
+  uint32_t coalesceMs;
+};
+
+// What other tasks may read of the registration task's state
+struct RegistrationStatus {
+  RegistrationSettings settings;
+  bool lastSuccess;
+  unsigned long lastRegistrationTime;
+  char lastError[REGISTRATION_ERROR_MAX];
+  char payloadHash[REGISTRATION_HASH_BYTES * 2 + 1];
+  uint32_t fullRegistrations;
+  uint32_t heartbeats;
+};
+
+// Everything below the settings is owned by the registration task, which
+// may block for seconds in an HTTP POST. Other tasks never wait for it:
+// updateSettings() stages new settings under statusLock for the task to
+// apply, and readers get the RegistrationStatus it publishes after every
+// change.
+class DeviceRegistration {
+private:
+  ConfigStore* prefs;
+  String serverUrl;
+  String deviceName;
+  String deviceType;
+  String deviceDescription;
+  bool registrationEnabled;
+  uint32_t statusHeartbeatSeconds;
+  uint32_t statusCoalesceMs;
+  unsigned long lastRegistrationTime;
+  bool lastRegistrationSuccess;
+  String lastRegistrationError;
+  StatusReporter reporter;
+  TaskHandle_t taskHandle;
+  std::atomic<bool> registrationRequested;
+  std::atomic<bool> fullRegistrationRequested;
+
+  portMUX_TYPE statusLock;                // published, pendingSettings and settingsPending
+  RegistrationStatus published;
+  RegistrationSettings pendingSettings;
+  bool settingsPending;
+
+  // Full registration payload, rebuilt only when what it describes changes.
+  // Between changes the device sends a heartbeat with just its MAC and the
+  // payload hash; the full payload goes out again when the hash moves, the
+  // server asks for it ("register": true) or it has no heartbeat endpoint.
+  String payload;
+  char payloadHash[REGISTRATION_HASH_BYTES * 2 + 1];
+  String payloadIp;
+  bool payloadDirty;
+  String registeredHash;      // Hash the server acknowledged in a full registration
+  bool heartbeatSupported;    // Cleared when the server does not know the endpoint
+  bool fullRequested;
+  uint32_t fullRegistrations;
+  uint32_t heartbeats;
+
+  static void taskEntry(void* param) {
+    static_cast<DeviceRegistration*>(param)->run();
+  }
+
+  // Registers whenever requested or due, so neither boot nor loop() waits on the server
+  void run() {
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(REGISTRATION_CHECK_INTERVAL_MS));
+      applyPendingSettings();
+      if (WiFi.status() != WL_CONNECTED) {
+        continue;
+      }
+      if (registrationRequested.load() || isRegistrationDue()) {
+        registrationRequested.store(false);
+        registerDevice(fullRegistrationRequested.exchange(false));
+      }
+    }
+  }
+
+  // Registration task. Takes settings staged by updateSettings().
+  void applyPendingSettings() {
+    RegistrationSettings settings;
+    portENTER_CRITICAL(&statusLock);
+    bool pending = settingsPending;
+    if (pending) {
+      settings = pendingSettings;
+      settingsPending = false;
+    }
+    portEXIT_CRITICAL(&statusLock);
+    if (!pending) {
+      return;
+    }
+
+    serverUrl = settings.serverUrl;
+    deviceName = settings.deviceName;
+    deviceType = settings.deviceType;
+    deviceDescription = settings.deviceDescription;
+    registrationEnabled = settings.enabled;
+    statusHeartbeatSeconds = settings.heartbeatSeconds;
+    statusCoalesceMs = settings.coalesceMs;
+    saveSettings();
+    reporter.setEndpoint(serverUrl);
+    settingsChanged();
+    publish();
+  }
+
+  // Registration task (or begin(), before it exists). Copies the state
+  // other tasks may read into published.
+  void publish() {
+    RegistrationStatus status;
+    RegistrationSettings& settings = status.settings;
+    snprintf(settings.serverUrl, sizeof(settings.serverUrl), "%s", serverUrl.c_str());
+    snprintf(settings.deviceName, sizeof(settings.deviceName), "%s", deviceName.c_str());
+    snprintf(settings.deviceType, sizeof(settings.deviceType), "%s", deviceType.c_str());
+    snprintf(settings.deviceDescription, sizeof(settings.deviceDescription), "%s", deviceDescription.c_str());
+    settings.enabled = registrationEnabled;
+    settings.heartbeatSeconds = statusHeartbeatSeconds;
+    settings.coalesceMs = statusCoalesceMs;
+    status.lastSuccess = lastRegistrationSuccess;
+    status.lastRegistrationTime = lastRegistrationTime;
+    snprintf(status.lastError, sizeof(status.lastError), "%s", lastRegistrationError.c_str());
+    memcpy(status.payloadHash, payloadHash, sizeof(status.payloadHash));
+    status.fullRegistrations = fullRegistrations;
+    status.heartbeats = heartbeats;
+
+    portENTER_CRITICAL(&statusLock);
+    // Settings staged meanwhile stay visible until the task applies them
+    RegistrationSettings staged = pendingSettings;
+    published = status;
+    if (settingsPending) {
+      published.settings = staged;
+    }
+    portEXIT_CRITICAL(&statusLock);
+  }
+
+  // Optional {"version","url","size","sha256"} in the registration response.
+  // A different version is pulled in the background; url may be relative
+  // to the server URL.
+  void checkFirmwareOffer(JsonObjectConst firmware) {
+    if (firmware.isNull()) {
+      return;
+    }
+    String version = firmware["version"] | "";
+    String url = firmware["url"] | "";
+    String sha256 = firmware["sha256"] | "";
+    if (version.length() == 0 || url.length() == 0 || version == FIRMWARE_VERSION) {
+      return;
+    }
+    // Nothing else vouches for an unattended download
+    if (sha256.length() == 0) {
+      logf(LOG_WARN, "Firmware %s offered without sha256, ignored", version.c_str());
+      return;
+    }
+    if (url.indexOf("://") < 0) {
+      String base = serverUrl;
+      if (base.endsWith("/")) {
+        base.remove(base.length() - 1);
+      }
+      url = base + (url.startsWith("/") ? "" : "/") + url;
+    }
+    offerFirmware(version, url, firmware["size"] | 0u, sha256);
+  }
+
+public:
+  DeviceRegistration(ConfigStore* store) : prefs(store),
+                                                registrationEnabled(true),
+                                                statusHeartbeatSeconds(DEFAULT_STATUS_HEARTBEAT_S),
+                                                statusCoalesceMs(DEFAULT_STATUS_COALESCE_MS),
+                                                lastRegistrationTime(0),
+                                                lastRegistrationSuccess(false),
+                                                taskHandle(nullptr),
+                                                registrationRequested(false),
+                                                fullRegistrationRequested(false),
+                                                published(),
+                                                pendingSettings(),
+                                                settingsPending(false),
+                                                payloadDirty(true),
+                                                heartbeatSupported(true),
+                                                fullRequested(true),
+                                                fullRegistrations(0),
+                                                heartbeats(0) {
+    payloadHash[0] = '\0';
+    portMUX_INITIALIZE(&statusLock);
+  }
+
+  // Loads settings and starts the reporter and registration tasks. The first
+  // registration runs in the background as soon as Wi-Fi is connected.
+  void begin() {
+    loadSettings();
+    publish();
+    if (!reporter.begin()) {
+      Serial.println("❌ Failed to start status reporter task");
+    }
+    if (xTaskCreate(taskEntry, "registration", REGISTRATION_TASK_STACK_SIZE, this,
+                    REGISTRATION_TASK_PRIORITY, &taskHandle) != pdPASS) {
+      Serial.println("❌ Failed to start registration task");
+    }
+  }
+
+  // Asks the background task to register now (never blocks). full skips
+  // the heartbeat.
+  void requestRegistration(bool full = false) {
+    if (full) {
+      fullRegistrationRequested.store(true);
+    }
+    registrationRequested.store(true);
+    if (taskHandle != nullptr) {
+      xTaskNotifyGive(taskHandle);
+    }
+  }
+
+  static uint32_t clampHeartbeat(uint32_t seconds) {
+    return constrain(seconds, (uint32_t)MIN_STATUS_HEARTBEAT_S, (uint32_t)MAX_STATUS_HEARTBEAT_S);
+  }
+
+  static uint32_t clampCoalesce(uint32_t ms) {
+    return min(ms, (uint32_t)MAX_STATUS_COALESCE_MS);
+  }
+
+  void loadSettings() {
+    serverUrl = prefs->getString("reg_server", "http://192.168.1.225:3004");
+    deviceName = prefs->getString("reg_name", "Garage-Door");
+    deviceType = prefs->getString("reg_type", "esp32_garage_door");
+    deviceDescription = prefs->getString("reg_desc", "ESP32-C3 Garage Door Opener");
+    registrationEnabled = prefs->getBool("reg_enabled", true);
+    // Clamped like updateSettings() so a stored value from an older build
+    // cannot overflow getStatusHeartbeatMs()
+    statusHeartbeatSeconds = clampHeartbeat(prefs->getUInt("reg_hb_s", DEFAULT_STATUS_HEARTBEAT_S));
+    statusCoalesceMs = clampCoalesce(prefs->getUInt("reg_coal_ms", DEFAULT_STATUS_COALESCE_MS));
+    reporter.setEndpoint(serverUrl);
+    settingsChanged();
+  }
+
+  // Staged only; the config store writes the changed keys later
+  void saveSettings() {
+    prefs->putString("reg_server", serverUrl);
+    prefs->putString("reg_name", deviceName);
+    prefs->putString("reg_type", deviceType);
+    prefs->putString("reg_desc", deviceDescription);
+    prefs->putBool("reg_enabled", registrationEnabled);
+    prefs->putUInt("reg_hb_s", statusHeartbeatSeconds);
+    prefs->putUInt("reg_coal_ms", statusCoalesceMs);
+  }
+
+  // Any task; never blocks. The registration task applies and saves the
+  // settings on its next pass, between HTTP requests. Reads return them
+  // right away.
+  void updateSettings(const RegistrationSettings& settings) {
+    RegistrationSettings clamped = settings;
+    clamped.heartbeatSeconds = clampHeartbeat(settings.heartbeatSeconds);
+    clamped.coalesceMs = clampCoalesce(settings.coalesceMs);
+    portENTER_CRITICAL(&statusLock);
+    pendingSettings = clamped;
+    settingsPending = true;
+    published.settings = clamped;
+    portEXIT_CRITICAL(&statusLock);
+    if (taskHandle != nullptr) {
+      xTaskNotifyGive(taskHandle);
+    }
+  }
+
+  RegistrationStatus getStatus() {
+    portENTER_CRITICAL(&statusLock);
+    RegistrationStatus status = published;
+    portEXIT_CRITICAL(&statusLock);
+    return status;
+  }
+
+  void getSettings(RegistrationSettings& settings) {
+    portENTER_CRITICAL(&statusLock);
+    settings = published.settings;
+    portEXIT_CRITICAL(&statusLock);
+  }
+
+  String getSettingsJson() {
+    RegistrationStatus status = getStatus();
+    const RegistrationSettings& settings = status.settings;
+    // The status copy outlives doc, so its text is linked rather than copied
+    DynamicJsonDocument doc(1024);
+    doc["server_url"] = (const char*)settings.serverUrl;
+    doc["device_name"] = (const char*)settings.deviceName;
+    doc["device_type"] = (const char*)settings.deviceType;
+    doc["device_description"] = (const char*)settings.deviceDescription;
+    doc["enabled"] = settings.enabled;
+    doc["status_heartbeat_s"] = settings.heartbeatSeconds;
+    doc["status_coalesce_ms"] = settings.coalesceMs;
+    doc["last_success"] = status.lastSuccess;
+    doc["last_error"] = (const char*)status.lastError;
+    doc["payload_hash"] = (const char*)status.payloadHash;
+    doc["full_registrations"] = status.fullRegistrations;
+    doc["heartbeats"] = status.heartbeats;
+
+    if (status.lastRegistrationTime > 0) {
+      unsigned long secondsAgo = (millis() - status.lastRegistrationTime) / 1000;
+      doc["last_registration_seconds_ago"] = secondsAgo;
+    } else {
+      doc["last_registration_seconds_ago"] = -1;
+    }
+
+    reporter.getStats(doc.createNestedObject("status_reporter"));
+
+    String json;
+    serializeJson(doc, json);
+    return json;
+  }
+
+private:
+  // Registration task. Blocks for up to the 10 s HTTP timeout; forceFull
+  // skips the heartbeat.
+  bool registerDevice(bool forceFull) {
+    if (forceFull) {
+      fullRequested = true;
+    }
+    uint32_t startUs = micros();
+    bool success = registerDeviceLocked();
+    if (registrationEnabled) {
+      metrics.registration.record(micros() - startUs);
+      if (!success) {
+        metrics.registrationFailures++;
+      }
+    }
+    publish();
+    return success;
+  }
+
+  // New settings may change the payload or point at a server that knows
+  // nothing about us: rebuild, register in full and retry the heartbeat
+  void settingsChanged() {
+    payloadDirty = true;
+    registeredHash = "";
+    heartbeatSupported = true;
+    fullRequested = true;
+  }
+
+  // Rebuilds the payload and its hash when the settings or the IP changed
+  void refreshPayload() {
+    String ip = WiFi.localIP().toString();
+    if (!payloadDirty && ip == payloadIp && payload.length() > 0) {
+      return;
+    }
+
+    // Everything linked into doc lives until it is serialized below
+    String mac = WiFi.macAddress();
+    RegistrationInfo info = {deviceName.c_str(), ip.c_str(), mac.c_str(), deviceType.c_str(),
+                             deviceDescription.c_str(), FIRMWARE_VERSION};
+    DynamicJsonDocument doc(registrationDocumentBytes(doorChannels.size()));
+    addRegistrationFields(doc, info, doorChannels);
+
+    // The hash covers everything above; it is sent along so the server can
+    // compare heartbeats against it
+    String content;
+    serializeJson(doc, content);
+    uint8_t digest[32];
+    mbedtls_sha256_ret((const uint8_t*)content.c_str(), content.length(), digest, 0);
+    for (size_t i = 0; i < REGISTRATION_HASH_BYTES; i++) {
+      snprintf(payloadHash + 2 * i, 3, "%02x", digest[i]);
+    }
+    doc["hash"] = (const char*)payloadHash;
+
+    payload = "";
+    serializeJson(doc, payload);
+    payloadIp = ip;
+    payloadDirty = false;
+  }
+
+  String endpointUrl(const char* path) const {
+    String url = serverUrl;
+    if (!url.endsWith("/")) {
+      url += "/";
+    }
+    url += path;
+    return url;
+  }
+
+  // POSTs body and parses the JSON reply into response. Returns the HTTP
+  // status (negative for transport errors, 0 for an unusable reply) and
+  // sets lastRegistrationError on failure.
+  int post(const String& url, const String& body, uint16_t timeoutMs, JsonDocument& response) {
+    HTTPClient http;
+    http.begin(url);
+    http.addHeader("Content-Type", "application/json");
+    http.setTimeout(timeoutMs);
+    int httpResponseCode = http.POST(body);
+
+    if (httpResponseCode <= 0) {
+      // Build error message without concatenation
+      char errorBuf[64];
+      snprintf(errorBuf, sizeof(errorBuf), "HTTP error: %d", httpResponseCode);
+      lastRegistrationError = errorBuf;
+      http.end();
+      return httpResponseCode;
+    }
+
+    // Check response size to prevent memory exhaustion
+    int responseSize = http.getSize();
+    if (responseSize > 4096) {  // Maximum 4KB response
+      lastRegistrationError = "Response too large";
+      http.end();
+      return 0;
+    }
+
+    String reply = http.getString();
+    http.end();
+    if (httpResponseCode == HTTP_CODE_OK && deserializeJson(response, reply)) {
+      lastRegistrationError = "Invalid JSON response";
+      return 0;
+    }
+    return httpResponseCode;
+  }
+
+  enum HeartbeatResult { HEARTBEAT_OK, HEARTBEAT_FAILED, HEARTBEAT_REGISTER };
+
+  HeartbeatResult sendHeartbeat() {
+    StaticJsonDocument<128> doc;
+    doc["mac"] = WiFi.macAddress();
+    doc["hash"] = (const char*)payloadHash;
+    String body;
+    serializeJson(doc, body);
+
+    DynamicJsonDocument response(1024);
+    int code = post(endpointUrl("api/smart_devices/heartbeat"), body, HEARTBEAT_TIMEOUT_MS, response);
+    if (code == HTTP_CODE_NOT_FOUND || code == HTTP_CODE_METHOD_NOT_ALLOWED || code == HTTP_CODE_NOT_IMPLEMENTED) {
+      logf(LOG_INFO, "Registration: server has no heartbeat endpoint, sending full payloads");
+      heartbeatSupported = false;
+      return HEARTBEAT_REGISTER;
+    }
+    if (code != HTTP_CODE_OK) {
+      if (code > 0) {
+        char errorBuf[64];
+        snprintf(errorBuf, sizeof(errorBuf), "Heartbeat HTTP %d", code);
+        lastRegistrationError = errorBuf;
+      }
+      logf(LOG_WARN, "Registration heartbeat failed: %s", lastRegistrationError.c_str());
+      return HEARTBEAT_FAILED;
+    }
+
+    // An unknown hash (e.g. after a server restart) asks for the full payload
+    if (!(response["success"] | false) || (response["register"] | false)) {
+      logf(LOG_INFO, "Registration: server asked for the full payload");
+      return HEARTBEAT_REGISTER;
+    }
+    heartbeats++;
+    checkFirmwareOffer(response["firmware"]);
+    return HEARTBEAT_OK;
+  }
+
+  bool sendRegistration() {
+    Serial.println("📡 Attempting device registration...");
+    Serial.print("Payload size: ");
+    Serial.println(payload.length());
+
+    DynamicJsonDocument response(1024);
+    int code = post(endpointUrl("api/smart_devices/register"), payload, REGISTRATION_TIMEOUT_MS, response);
+    if (code <= 0) {
+      Serial.print("❌ Registration failed: ");
+      Serial.println(lastRegistrationError);
+      return false;
+    }
+    Serial.print("✅ HTTP Response Code: ");
+    Serial.println(code);
+
+    if (code != HTTP_CODE_OK || !(response["success"] | false)) {
+      String message = response["message"] | "";
+      if (message.length() == 0) {
+        char errorBuf[64];
+        snprintf(errorBuf, sizeof(errorBuf), "Registration HTTP %d", code);
+        message = errorBuf;
+      }
+      lastRegistrationError = message;
+      Serial.print("❌ Registration failed: ");
+      Serial.println(message);
+      return false;
+    }
+
+    Serial.println("✅ Device registered successfully!");
+    registeredHash = payloadHash;
+    fullRequested = false;
+    fullRegistrations++;
+    checkFirmwareOffer(response["firmware"]);
+    return true;
+  }
+
+  bool registerDeviceLocked() {
+    if (!registrationEnabled) {
+      return false;
+    }
+
+    if (WiFi.status() != WL_CONNECTED) {
+      lastRegistrationSuccess = false;
+      lastRegistrationError = "WiFi not connected";
+      return false;
+    }
+
+    refreshPayload();
+    bool success;
+    bool full = fullRequested || !heartbeatSupported || registeredHash != payloadHash;
+    HeartbeatResult heartbeat = full ? HEARTBEAT_REGISTER : sendHeartbeat();
+    if (heartbeat == HEARTBEAT_REGISTER) {
+      success = sendRegistration();
+    } else {
+      success = heartbeat == HEARTBEAT_OK;
+    }
+
+    lastRegistrationSuccess = success;
+    lastRegistrationTime = millis();
+    if (success) {
+      lastRegistrationError = "";
+    }
+    return success;
+  }
+
+public:
+  bool isRegistrationDue() {
+    if (!registrationEnabled) {
+      return false;
+    }
+    if (lastRegistrationTime == 0) {
+      return true;
+    }
+    unsigned long timeSinceLastRegistration = millis() - lastRegistrationTime;
+    return timeSinceLastRegistration >= REGISTRATION_INTERVAL_MS;
+  }
+
+  // Hand a status update to the background reporter (never blocks)
+  bool queueStatusUpdate(const DeviceState& state) {
+    if (!isEnabled()) {
+      return false;
+    }
+    return reporter.enqueue(state);
+  }
+
+  // Any task, from the published status
+  bool isEnabled() {
+    portENTER_CRITICAL(&statusLock);
+    bool enabled = published.settings.enabled;
+    portEXIT_CRITICAL(&statusLock);
+    return enabled;
+  }
+
+  uint32_t getStatusHeartbeatMs() {
+    portENTER_CRITICAL(&statusLock);
+    uint32_t seconds = published.settings.heartbeatSeconds;
+    portEXIT_CRITICAL(&statusLock);
+    return seconds * 1000UL;
+  }
+
+  uint32_t getStatusCoalesceMs() {
+    portENTER_CRITICAL(&statusLock);
+    uint32_t ms = published.settings.coalesceMs;
+    portEXIT_CRITICAL(&statusLock);
+    return ms;
+  }
+
+  bool getLastSuccess() {
+    portENTER_CRITICAL(&statusLock);
+    bool success = published.lastSuccess;
+    portEXIT_CRITICAL(&statusLock);
+    return success;
+  }
+};
+
+// Global registration instance
+DeviceRegistration* deviceRegistration = nullptr;
+
+// Function declarations
+void startWiFi();
+void startAccessPoint();
+void onStationConnected();
+uint32_t handleWiFi(uint32_t now);
+void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info);
+void onConnectAttemptFailed(uint32_t now);
+void beginStationConnect(bool fast);
+bool loadWiFiCache(WiFiCache& cache);
+void saveWiFiCache();
+void applyStaticIp();
+void setupWebServer();
+void setupGPIO();
+void setupOTA();
+void loadConfiguration();
+void saveConfiguration();
+void onButtonChanged(uint8_t index, bool level, uint32_t timestamp);
+void onContactChanged(uint8_t channel, bool level, uint32_t timestamp);
+bool triggerRelay(uint8_t channel);
+bool startDoorTrigger(TriggerSource source, uint8_t channel = 0);
+void prepareForRestart();
+uint32_t handleStatusReporting();
+void logLock();
+void logUnlock();
+void replayLogs(AsyncWebSocketClient* client, uint32_t sinceSeq);
+size_t fillLogStream(LogStreamState& state, uint8_t* buffer, size_t maxLen);
+size_t fillHistoryStream(HistoryStreamState& state, uint8_t* buffer, size_t maxLen);
+void addLiveStatus(JsonDocument& doc);
+void sendStatusToClient(AsyncWebSocketClient* client);
+uint32_t handleStatusPush();
+void broadcastStatusUpdate(bool full, bool checkRssi);
+void broadcastOtaProgress(const char* state, size_t received, size_t total, const char* error);
+void wsSend(AsyncWebSocketClient* client, const char* message, size_t length);
+void wsSendBinary(AsyncWebSocketClient* client, const uint8_t* frame, size_t length);
+size_t packStatus(const JsonDocument& doc, bool withClock, uint8_t* buffer, size_t capacity);
+void replayLogsBinary(AsyncWebSocketClient* client, uint32_t sinceSeq);
+void onTimeSync(struct timeval* tv);
+void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
+void configureWatchdog(uint32_t timeoutSeconds);
+inline void feedWatchdog();
+void disableWatchdog();
+void setupScheduler();
+void wakeLoop();
+
+// Cooperative scheduler that replaces the fixed loop() + delay(10)
+#define LOOP_MAX_SLEEP_MS 1000          // Wake at least this often to feed the watchdog
+#define SCHEDULER_IDLE_MS 1000          // Recheck interval for tasks with nothing pending
+#define OTA_POLL_INTERVAL_MS 50
+#define CAPTIVE_POLL_INTERVAL_MS 20
+#define WS_CLEANUP_INTERVAL_MS 1000
+
+uint32_t schedulerMillis() { return millis(); }
+uint32_t schedulerMicros() { return micros(); }
+Scheduler<SCHEDULER_MAX_TASKS> scheduler(schedulerMillis, schedulerMicros);
+TaskHandle_t loopTaskHandle = nullptr;
+
+#define INPUT_EDGE_QUEUE_LENGTH 32   // Edges buffered per pin; must be a power of two
+#define INPUT_TASK_STACK_SIZE 4096
+#define INPUT_TASK_PRIORITY 3        // Above loop() so inputs are handled while it blocks
+
+// Edge captured by the GPIO ISR
+struct PinEdge {
+  uint32_t timestamp;   // millis() at the interrupt
+  uint32_t us;          // micros() at the interrupt, for latency metrics
+  uint8_t level;
+};
+
+// Interrupt-driven contact sensors (one per door channel) and button.
+// The GPIO ISRs only timestamp each edge into a per-pin lock-free ring and
+// wake the input task, which debounces the edges and runs the door-state and
+// press-duration logic. A busy loop() therefore no longer delays or loses
+// edges, and durations come from the interrupt timestamps.
+class InputMonitor {
+private:
+  struct Channel {
+    uint8_t pin;
+    uint8_t index;       // Passed to onChange: the door channel for contacts
+    SpscQueue<PinEdge, INPUT_EDGE_QUEUE_LENGTH> edges;
+    std::atomic<bool> overflowed;
+    Debouncer debouncer;
+    uint32_t burstStartUs;   // micros() of the first edge of the current burst
+    uint32_t changeUs;       // burstStartUs of the last change passed to onChange
+    void (*onChange)(uint8_t index, bool level, uint32_t timestamp);
+    InputMonitor* owner;
+
+    // Contacts; begin() fills in the pin from the channel table
+    Channel()
+        : pin(0), index(0), overflowed(false), debouncer(CONTACT_DEBOUNCE_TIME), burstStartUs(0),
+          changeUs(0), onChange(onContactChanged), owner(nullptr) {}
+
+    Channel(uint8_t pin, uint32_t settleMs, void (*onChange)(uint8_t, bool, uint32_t))
+        : pin(pin), index(0), overflowed(false), debouncer(settleMs), burstStartUs(0), changeUs(0),
+          onChange(onChange), owner(nullptr) {}
+  };
+
+  Channel contacts[DOOR_MAX_CHANNELS];
+  uint8_t contactCount;
+  Channel button;
+  TaskHandle_t taskHandle;
+  std::atomic<bool> wakeOnLevel;
+  portMUX_TYPE wakeLock;
+
+  // Level interrupt for the level the pin is not at, which doubles as the
+  // light-sleep wake source; fires on the next change like an edge would
+  static void ARDUINO_ISR_ATTR armWake(uint8_t pin, bool level) {
+    gpio_ll_wakeup_enable(&GPIO, (gpio_num_t)pin, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  }
+
+  static void ARDUINO_ISR_ATTR onEdgeIsr(void* arg) {
+    Channel* channel = static_cast<Channel*>(arg);
+    PinEdge edge;
+    edge.timestamp = millis();
+    edge.us = micros();
+    edge.level = gpio_get_level((gpio_num_t)channel->pin);
+    if (channel->owner->wakeOnLevel.load()) {
+      armWake(channel->pin, edge.level);
+    }
+    if (!channel->edges.push(edge)) {
+      channel->overflowed.store(true);
+    }
+
+    BaseType_t higherPriorityWoken = pdFALSE;
+    if (channel->owner->taskHandle != nullptr) {
+      vTaskNotifyGiveFromISR(channel->owner->taskHandle, &higherPriorityWoken);
+    }
+    if (higherPriorityWoken) {
+      portYIELD_FROM_ISR();
+    }
+  }
+
+  static void taskEntry(void* param) {
+    static_cast<InputMonitor*>(param)->run();
+  }
+
+  void run() {
+    for (;;) {
+      uint32_t now = millis();
+      uint32_t wait = button.debouncer.timeToSettle(now);
+      for (uint8_t i = 0; i < contactCount; i++) {
+        wait = min(wait, contacts[i].debouncer.timeToSettle(now));
+      }
+      ulTaskNotifyTake(pdTRUE, wait == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait) + 1);
+
+      for (uint8_t i = 0; i < contactCount; i++) {
+        process(contacts[i]);
+      }
+      process(button);
+    }
+  }
+
+  void process(Channel& channel) {
+    PinEdge edge;
+    while (channel.edges.pop(edge)) {
+      if (!channel.debouncer.settling()) {
+        channel.burstStartUs = edge.us;
+      }
+      channel.debouncer.onEdge(edge.level != 0, edge.timestamp);
+    }
+    if (channel.overflowed.load()) {
+      // Lost edges: resynchronise from the pin itself
+      channel.overflowed.store(false);
+      if (!channel.debouncer.settling()) {
+        channel.burstStartUs = micros();
+      }
+      channel.debouncer.onEdge(digitalRead(channel.pin) == HIGH, millis());
+    }
+    if (channel.debouncer.update(millis())) {
+      channel.changeUs = channel.burstStartUs;
+      channel.onChange(channel.index, channel.debouncer.level(), channel.debouncer.lastChange());
+    }
+  }
+
+public:
+  InputMonitor()
+      : contactCount(0),
+        button(BUTTON_PIN, DEBOUNCE_TIME, onButtonChanged),
+        taskHandle(nullptr),
+        wakeOnLevel(false) {
+    for (Channel& contact : contacts) {
+      contact.owner = this;
+    }
+    button.owner = this;
+    portMUX_INITIALIZE(&wakeLock);
+  }
+
+  // Call after the pins are configured. Each contact's initial level is
+  // reported straight away so the door state is valid before the first edge.
+  void begin() {
+    uint32_t now = millis();
+    contactCount = doorChannels.size();
+    for (uint8_t i = 0; i < contactCount; i++) {
+      Channel& contact = contacts[i];
+      contact.pin = doorChannels[i].contactPin;
+      contact.index = i;
+      bool contactLevel = digitalRead(contact.pin) == HIGH;
+      contact.debouncer.reset(contactLevel, now);
+      onContactChanged(i, contactLevel, now);
+    }
+    button.debouncer.reset(digitalRead(BUTTON_PIN) == HIGH, now);
+
+    xTaskCreate(taskEntry, "inputs", INPUT_TASK_STACK_SIZE, this, INPUT_TASK_PRIORITY, &taskHandle);
+    for (uint8_t i = 0; i < contactCount; i++) {
+      attachInterruptArg(digitalPinToInterrupt(contacts[i].pin), onEdgeIsr, &contacts[i], CHANGE);
+    }
+    attachInterruptArg(digitalPinToInterrupt(BUTTON_PIN), onEdgeIsr, &button, CHANGE);
+  }
+
+  // Input task (from onButtonChanged): micros() of the interrupt that started
+  // the button's last reported change
+  uint32_t getButtonChangeUs() const { return button.changeUs; }
+
+  // Light sleep cannot wake on an edge, only on a level. With wake on, each
+  // pin's interrupt becomes a level interrupt that the ISR re-arms for the
+  // opposite level after every change, so edges still arrive one by one and
+  // also wake the chip. Off restores the plain CHANGE interrupts.
+  void setWakeOnLevel(bool enabled) {
+    portENTER_CRITICAL(&wakeLock);
+    wakeOnLevel.store(enabled);
+    for (uint8_t i = 0; i <= contactCount; i++) {
+      Channel* channel = i < contactCount ? &contacts[i] : &button;
+      if (enabled) {
+        armWake(channel->pin, gpio_get_level((gpio_num_t)channel->pin));
+      } else {
+        gpio_ll_wakeup_disable(&GPIO, (gpio_num_t)channel->pin);
+        gpio_ll_set_intr_type(&GPIO, (gpio_num_t)channel->pin, GPIO_INTR_ANYEDGE);
+      }
+    }
+    portEXIT_CRITICAL(&wakeLock);
+
+    if (enabled) {
+      esp_sleep_enable_gpio_wakeup();
+    } else {
+      esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+    }
+  }
+};
+
+InputMonitor inputMonitor;
+
+#define POWER_DEFAULT_LISTEN_INTERVAL 3   // Beacons between wakes in low_power (IDF default)
+#define POWER_MAX_LISTEN_INTERVAL 10
+
+// Power profiles, picked per site through /api/power:
+//   performance - Wi-Fi always on, CPU at full clock: lowest latency
+//   balanced    - Wi-Fi modem sleep between DTIM beacons (the Arduino default)
+//   low_power   - modem sleep for listenInterval beacons at a time, CPU
+//                 frequency scaling and automatic light sleep whenever every
+//                 task is idle; the contact and button pins wake the chip
+// The Wi-Fi and CPU settings apply at once; the listen interval at the next
+// association. Automatic light sleep needs an IDF built with
+// CONFIG_FREERTOS_USE_TICKLESS_IDLE; without it low_power falls back to
+// frequency scaling and says so in getStats().
+class PowerManager {
+public:
+  PowerManager()
+      : profile(POWER_BALANCED), listenInterval(POWER_DEFAULT_LISTEN_INTERVAL), lightSleep(false),
+        frequencyScaling(false), reloadRequested(false) {}
+
+  // Before the station starts, so the first association uses the profile.
+  // setup() runs on the loop task, like run().
+  void begin() {
+    listenInterval.store(constrain(configStore.getUChar("pwr_listen", POWER_DEFAULT_LISTEN_INTERVAL),
+                                   1, POWER_MAX_LISTEN_INTERVAL));
+    apply(savedProfile());
+  }
+
+  // Profile saved through /api/power: apply it on the loop task. WiFi.setSleep(),
+  // esp_pm_configure() and the GPIO wake setup do not belong on AsyncTCP.
+  void requestReload() {
+    reloadRequested.store(true);
+    wakeLoop();
+  }
+
+  // "power" scheduler task
+  uint32_t run(uint32_t now) {
+    if (reloadRequested.load()) {
+      reloadRequested.store(false);
+      apply(savedProfile());
+    }
+    return SCHEDULER_IDLE_MS;
+  }
+
+  void setListenInterval(int beacons) {
+    listenInterval.store(constrain(beacons, 1, POWER_MAX_LISTEN_INTERVAL));
+  }
+
+  // Call between WiFi.begin(..., false) and esp_wifi_connect(): Arduino
+  // rewrites the station config in begin() and resets the interval
+  void applyListenInterval() {
+    wifi_config_t conf;
+    if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK) {
+      return;
+    }
+    conf.sta.listen_interval = profile.load() == POWER_LOW ? listenInterval.load() : 0;  // 0: IDF default
+    esp_wifi_set_config(WIFI_IF_STA, &conf);
+  }
+
+  PowerProfile getProfile() const { return profile.load(); }
+
+  void getStats(JsonObject stats) {
+    stats["light_sleep"] = lightSleep.load();
+    stats["frequency_scaling"] = frequencyScaling.load();
+    stats["cpu_mhz"] = getCpuFrequencyMhz();
+  }
+
+  uint8_t getListenInterval() const { return listenInterval.load(); }
+
+  static const char* profileName(PowerProfile value) {
+    switch (value) {
+      case POWER_PERFORMANCE: return "performance";
+      case POWER_LOW: return "low_power";
+      default: return "balanced";
+    }
+  }
+
+  // POWER_PROFILE_COUNT when name is not a profile
+  static uint8_t parseProfile(const char* name) {
+    for (uint8_t i = 0; i < POWER_PROFILE_COUNT; i++) {
+      if (strcmp(name, profileName((PowerProfile)i)) == 0) {
+        return i;
+      }
+    }
+    return POWER_PROFILE_COUNT;
+  }
+
+private:
+  std::atomic<PowerProfile> profile;
+  std::atomic<uint8_t> listenInterval;
+  std::atomic<bool> lightSleep;
+  std::atomic<bool> frequencyScaling;
+  std::atomic<bool> reloadRequested;
+
+  PowerProfile savedProfile() {
+    uint8_t saved = configStore.getUChar("pwr_profile", POWER_BALANCED);
+    return saved < POWER_PROFILE_COUNT ? (PowerProfile)saved : POWER_BALANCED;
+  }
+
+  // Loop task only (setup() included)
+  void apply(PowerProfile next) {
+    profile.store(next);
+
+    // Wi-Fi modem sleep; Arduino re-applies it on every station start
+    WiFi.setSleep(next == POWER_PERFORMANCE ? WIFI_PS_NONE
+                  : next == POWER_LOW ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+
+    esp_pm_config_esp32c3_t pm;
+    pm.max_freq_mhz = 160;
+    pm.min_freq_mhz = next == POWER_LOW ? 40 : 160;
+    pm.light_sleep_enable = next == POWER_LOW;
+    esp_err_t err = esp_pm_configure(&pm);
+    if (err == ESP_ERR_NOT_SUPPORTED && pm.light_sleep_enable) {
+      logf(LOG_WARN, "Power: light sleep not supported by this build, scaling frequency only");
+      pm.light_sleep_enable = false;
+      err = esp_pm_configure(&pm);
+    }
+    lightSleep.store(err == ESP_OK && pm.light_sleep_enable);
+    frequencyScaling.store(err == ESP_OK && pm.min_freq_mhz < pm.max_freq_mhz);
+    if (err != ESP_OK && next == POWER_LOW) {
+      logf(LOG_WARN, "Power: frequency scaling unavailable (%s)", esp_err_to_name(err));
+    }
+
+    // GPIO wake is only needed (and only costs anything) with light sleep
+    inputMonitor.setWakeOnLevel(lightSleep.load());
+    logf(LOG_INFO, "Power profile: %s", profileName(next));
+  }
+};
+
+PowerManager powerManager;
+
+#define OTA_PROGRESS_STEP_PERCENT 2
+#define OTA_PROGRESS_INTERVAL_MS 500   // When the image size was not sent
+
+// Writes one firmware image to the OTA partition and checks it on the way,
+// so a bad image never becomes bootable:
+//   - the first byte must be the ESP image magic
+//   - a known size is reserved up front and must match at the end
+//   - a known SHA-256 (hex) is compared before Update.end()
+//   - a known version must match the image's app descriptor, so an image
+//     built without the offered FIRMWARE_VERSION is not installed (and
+//     offered again) on every boot
+// Shared by the /update upload and the pull from the control server; claim()
+// makes sure only one of them drives Update at a time. Update already stages
+// writes into whole flash sectors, so data goes straight to it. Progress goes
+// to WebSocket clients (broadcastOtaProgress()).
+class FirmwareWriter {
+public:
+  FirmwareWriter()
+      : claimed(false), state(IDLE), httpStatus(200), error(""), expectedSize(0),
+        written(0), hasExpectedHash(false), appDesc() {
+    portMUX_INITIALIZE(&claimLock);
+  }
+
+  // False while another update holds the writer
+  bool claim() {
+    portENTER_CRITICAL(&claimLock);
+    bool acquired = !claimed;
+    claimed = true;
+    portEXIT_CRITICAL(&claimLock);
+    return acquired;
+  }
+
+  void release() {
+    if (state == WRITING) {
+      fail(500, "Update abandoned");
+    }
+    if (state != IDLE) {
+      mbedtls_sha256_free(&sha);
+    }
+    state = IDLE;
+    portENTER_CRITICAL(&claimLock);
+    claimed = false;
+    portEXIT_CRITICAL(&claimLock);
+  }
+
+  bool isClaimed() const { return claimed; }
+
+  // expectedSize 0, an empty hash and an empty version mean "not known"
+  bool begin(size_t size, const String& sha256Hex, const String& version = String()) {
+    state = WRITING;
+    httpStatus = 200;
+    error = "";
+    expectedSize = size;
+    expectedVersion = version;
+    written = 0;
+    memset(&appDesc, 0, sizeof(appDesc));
+    lastPercent = 0;
+    lastProgressTime = 0;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+
+    hasExpectedHash = sha256Hex.length() > 0;
+    if (hasExpectedHash && !parseHash(sha256Hex)) {
+      fail(400, "SHA-256 must be 64 hex digits");
+      return false;
+    }
+
+    logf(LOG_INFO, "OTA Update Start: %u bytes%s", (unsigned)expectedSize,
+         hasExpectedHash ? ", SHA-256 given" : "");
+    // With a known size Update checks up front that the image fits the partition
+    if (!Update.begin(expectedSize > 0 ? expectedSize : UPDATE_SIZE_UNKNOWN)) {
+      fail(expectedSize > 0 ? 400 : 500, Update.errorString());
+      return false;
+    }
+    broadcastOtaProgress("start", 0, expectedSize, nullptr);
+    return true;
+  }
+
+  bool write(const uint8_t* data, size_t len) {
+    if (state != WRITING) {
+      return false;
+    }
+    if (written == 0 && len > 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+      fail(400, "Not an ESP32 firmware image");
+      return false;
+    }
+    if (expectedSize > 0 && written + len > expectedSize) {
+      fail(400, "Image larger than expected");
+      return false;
+    }
+    if (Update.write(const_cast<uint8_t*>(data), len) != len) {
+      fail(500, Update.errorString());
+      return false;
+    }
+    mbedtls_sha256_update_ret(&sha, data, len);
+    captureAppDesc(data, len);
+    written += len;
+    reportProgress();
+    return true;
+  }
+
+  // Verifies the image and makes it the boot partition
+  bool finish() {
+    if (state != WRITING) {
+      return false;
+    }
+    broadcastOtaProgress("verifying", written, expectedSize, nullptr);
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish_ret(&sha, digest);
+    if (expectedSize > 0 && written != expectedSize) {
+      fail(400, "Image smaller than expected");
+      return false;
+    }
+    if (hasExpectedHash && memcmp(digest, expectedHash, sizeof(digest)) != 0) {
+      fail(400, "SHA-256 mismatch");
+      return false;
+    }
+    if (expectedVersion.length() > 0) {
+      char imageVersion[sizeof(appDesc.version) + 1] = {};
+      memcpy(imageVersion, appDesc.version, sizeof(appDesc.version));
+      if (appDesc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        fail(400, "Image has no app descriptor");
+        return false;
+      }
+      if (expectedVersion != imageVersion) {
+        logf(LOG_ERROR, "Image version %s, offered %s", imageVersion, expectedVersion.c_str());
+        fail(400, "Image version does not match the offer");
+        return false;
+      }
+    }
+    if (!Update.end(true)) {
+      fail(500, Update.errorString());
+      return false;
+    }
+
+    state = DONE;
+    logf(LOG_INFO, "OTA Update Success: %u bytes", (unsigned)written);
+    broadcastOtaProgress("success", written, written, nullptr);
+    return true;
+  }
+
+  void fail(int status, const char* reason) {
+    if (Update.isRunning()) {
+      Update.abort();
+    }
+    state = FAILED;
+    httpStatus = status;
+    error = reason;
+    logf(LOG_ERROR, "OTA update failed: %s", reason);
+    broadcastOtaProgress("error", written, expectedSize, reason);
+  }
+
+  bool isWriting() const { return state == WRITING; }
+  bool isDone() const { return state == DONE; }
+  int getHttpStatus() const { return httpStatus; }
+  const char* getError() const { return error; }
+
+private:
+  enum State : uint8_t { IDLE, WRITING, DONE, FAILED };
+
+  portMUX_TYPE claimLock;
+  volatile bool claimed;
+  State state;
+  int httpStatus;
+  const char* error;     // Static string, or Update.errorString()
+  size_t expectedSize;
+  size_t written;
+  bool hasExpectedHash;
+  uint8_t expectedHash[32];
+  String expectedVersion;
+  esp_app_desc_t appDesc;   // Copied from the image as it streams past
+  mbedtls_sha256_context sha;
+  uint8_t lastPercent;
+  unsigned long lastProgressTime;
+
+  // Every OTA_PROGRESS_STEP_PERCENT, or OTA_PROGRESS_INTERVAL_MS when the size is unknown
+  void reportProgress() {
+    unsigned long now = millis();
+    if (expectedSize > 0) {
+      uint8_t percent = (uint8_t)((uint64_t)written * 100 / expectedSize);
+      if (percent < lastPercent + OTA_PROGRESS_STEP_PERCENT) {
+        return;
+      }
+      lastPercent = percent;
+    } else if (now - lastProgressTime < OTA_PROGRESS_INTERVAL_MS) {
+      return;
+    }
+    lastProgressTime = now;
+    broadcastOtaProgress("progress", written, expectedSize, nullptr);
+  }
+
+  // The app descriptor follows the image header and the first segment
+  // header; a block may hold any part of it
+  void captureAppDesc(const uint8_t* data, size_t len) {
+    const size_t descStart = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+    const size_t descEnd = descStart + sizeof(appDesc);
+    size_t from = max(written, descStart);
+    size_t to = min(written + len, descEnd);
+    if (from < to) {
+      memcpy(reinterpret_cast<uint8_t*>(&appDesc) + (from - descStart), data + (from - written), to - from);
+    }
+  }
+
+  bool parseHash(const String& hex) {
+    if (hex.length() != 64) {
+      return false;
+    }
+    for (size_t i = 0; i < 32; i++) {
+      int high = hexValue(hex[i * 2]);
+      int low = hexValue(hex[i * 2 + 1]);
+      if (high < 0 || low < 0) {
+        return false;
+      }
+      expectedHash[i] = (uint8_t)(high << 4 | low);
+    }
+    return true;
+  }
+
+  static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+};
+
+FirmwareWriter firmwareWriter;
+
+// Firmware upload through /update, on the AsyncTCP task. Optional
+// X-Firmware-Size and X-Firmware-SHA256 headers are handed to the writer;
+// once anything fails the rest of the body is dropped.
+class FirmwareUpload {
+public:
+  FirmwareUpload() : owner(nullptr) {}
+
+  // Upload handler callback for one multipart chunk
+  void onChunk(AsyncWebServerRequest* request, size_t index, uint8_t* data, size_t len, bool final) {
+    if (index == 0) {
+      if (owner != nullptr || !firmwareWriter.claim()) {
+        return;  // Another update is in progress
+      }
+      owner = request;
+      request->onDisconnect([this, request]() { onDisconnect(request); });
+
+      size_t expectedSize = 0;
+      if (request->hasHeader("X-Firmware-Size")) {
+        expectedSize = strtoul(request->getHeader("X-Firmware-Size")->value().c_str(), nullptr, 10);
+      }
+      String sha256;
+      if (request->hasHeader("X-Firmware-SHA256")) {
+        sha256 = request->getHeader("X-Firmware-SHA256")->value();
+      }
+      firmwareWriter.begin(expectedSize, sha256);
+    }
+    if (request != owner || !firmwareWriter.write(data, len)) {
+      return;
+    }
+    if (final) {
+      firmwareWriter.finish();
+    }
+  }
+
+  // Request handler callback: sends the result and releases the writer.
+  // Returns true when the new image is in place and the device should restart.
+  bool respond(AsyncWebServerRequest* request) {
+    if (request != owner) {
+      bool busy = firmwareWriter.isClaimed();
+      request->send(busy ? 409 : 400, "text/plain", busy ? "Update already in progress" : "No firmware received");
+      return false;
+    }
+
+    if (firmwareWriter.isWriting()) {
+      firmwareWriter.fail(400, "Upload incomplete");
+    }
+    bool success = firmwareWriter.isDone();
+    AsyncWebServerResponse* response = request->beginResponse(
+      success ? 200 : firmwareWriter.getHttpStatus(), "text/plain", success ? "OK" : firmwareWriter.getError());
+    response->addHeader("Connection", "close");
+    request->send(response);
+    owner = nullptr;
+    firmwareWriter.release();
+    return success;
+  }
+
+private:
+  AsyncWebServerRequest* owner;
+
+  // The client went away mid-upload
+  void onDisconnect(AsyncWebServerRequest* request) {
+    if (request != owner) {
+      return;
+    }
+    if (firmwareWriter.isWriting()) {
+      firmwareWriter.fail(400, "Connection closed");
+    }
+    owner = nullptr;
+    firmwareWriter.release();
+  }
+};
+
+FirmwareUpload firmwareUpload;
+
+#define FIRMWARE_PULL_TASK_STACK_SIZE 8192
+#define FIRMWARE_PULL_TASK_PRIORITY 1
+#define FIRMWARE_PULL_TIMEOUT_MS 15000
+#define FIRMWARE_PULL_MAX_ATTEMPTS 3      // Per advertised version, until the next boot
+
+// Pulls an image advertised by the control server (see offerFirmware()) on
+// a short-lived task and feeds it to firmwareWriter. gzip images are
+// inflated on the fly with the ROM's tinfl, so the server can store them
+// compressed; the size and SHA-256 in the offer always describe the raw
+// image that ends up in flash. HTTPClient::writeToStream() handles chunked
+// responses and calls write() below with each block.
+class FirmwarePull : public Stream {
+public:
+  FirmwarePull()
+      : running(false), attempts(0), inflator(nullptr), dictionary(nullptr), dictionaryOffset(0),
+        headerChecked(false), compressed(false) {}
+
+  // Starts a pull unless one is running or this version has failed too often
+  // since boot. Offers come from registration responses, which are serialized
+  // by the registration task.
+  void offer(const String& offeredVersion, const String& offeredUrl, size_t offeredSize,
+             const String& offeredSha256) {
+    if (running) {
+      return;
+    }
+    if (offeredVersion != version) {
+      attempts = 0;
+    }
+    if (attempts >= FIRMWARE_PULL_MAX_ATTEMPTS) {
+      return;
+    }
+    attempts++;
+    running = true;
+
+    version = offeredVersion;
+    url = offeredUrl;
+    size = offeredSize;
+    sha256 = offeredSha256;
+    logf(LOG_INFO, "Firmware %s available (running %s), attempt %u", version.c_str(), FIRMWARE_VERSION,
+         (unsigned)attempts);
+    if (xTaskCreate(taskEntry, "fw_pull", FIRMWARE_PULL_TASK_STACK_SIZE, this,
+                    FIRMWARE_PULL_TASK_PRIORITY, nullptr) != pdPASS) {
+      logf(LOG_ERROR, "Failed to start firmware pull task");
+      running = false;
+    }
+  }
+
+  // Stream interface: only the write side is used
+  size_t write(const uint8_t* data, size_t len) override {
+    size_t accepted = len;
+    if (!headerChecked && !checkHeader(data, len)) {
+      return 0;
+    }
+    bool ok = compressed ? inflate(data, len) : firmwareWriter.write(data, len);
+    return ok ? accepted : 0;
+  }
+  size_t write(uint8_t value) override { return write(&value, 1); }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+
+private:
+  volatile bool running;
+  uint8_t attempts;
+  String version;
+  String url;
+  size_t size;
+  String sha256;
+  tinfl_decompressor* inflator;
+  uint8_t* dictionary;          // TINFL_LZ_DICT_SIZE ring the output is written into
+  size_t dictionaryOffset;
+  tinfl_status inflateStatus;
+  size_t gzipHeaderRemaining;   // Header bytes still to skip
+  bool headerChecked;
+  bool compressed;
+
+  static void taskEntry(void* param) {
+    FirmwarePull* pull = static_cast<FirmwarePull*>(param);
+    if (pull->run()) {
+      logf(LOG_INFO, "Firmware %s installed, restarting...", pull->version.c_str());
+      prepareForRestart();
+      delay(1000);
+      ESP.restart();
+    }
+    pull->running = false;
+    vTaskDelete(nullptr);
+  }
+
+  bool run() {
+    if (!firmwareWriter.claim()) {
+      logf(LOG_WARN, "Firmware pull skipped: another update is in progress");
+      attempts--;   // Try again with the next offer
+      return false;
+    }
+
+    HTTPClient http;
+    http.begin(url);
+    http.setTimeout(FIRMWARE_PULL_TIMEOUT_MS);
+    int httpResponseCode = http.GET();
+    if (httpResponseCode != HTTP_CODE_OK) {
+      logf(LOG_ERROR, "Firmware download failed: HTTP %d", httpResponseCode);
+      http.end();
+      firmwareWriter.release();
+      return false;
+    }
+
+    headerChecked = false;
+    compressed = false;
+    bool success = firmwareWriter.begin(size, sha256, version) && http.writeToStream(this) > 0;
+    if (success && compressed && inflateStatus != TINFL_STATUS_DONE) {
+      firmwareWriter.fail(400, "Truncated gzip stream");
+      success = false;
+    }
+    success = success && firmwareWriter.finish();
+    if (!success && firmwareWriter.isWriting()) {
+      firmwareWriter.fail(500, "Download interrupted");
+    }
+
+    http.end();
+    freeInflator();
+    firmwareWriter.release();
+    return success;
+  }
+
+  // First block: decide between a raw image and gzip, and skip the gzip header
+  bool checkHeader(const uint8_t*& data, size_t& len) {
+    headerChecked = true;
+    if (len < 2 || data[0] != 0x1f || data[1] != 0x8b) {
+      return true;
+    }
+
+    size_t headerLength = gzipHeaderLength(data, len);
+    if (headerLength == 0) {
+      firmwareWriter.fail(400, "Unsupported gzip header");
+      return false;
+    }
+    inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    dictionary = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+    if (inflator == nullptr || dictionary == nullptr) {
+      freeInflator();
+      firmwareWriter.fail(500, "Not enough memory to inflate");
+      return false;
+    }
+    tinfl_init(inflator);
+    dictionaryOffset = 0;
+    inflateStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+    compressed = true;
+    logf(LOG_INFO, "Firmware image is gzip compressed");
+
+    data += headerLength;
+    len -= headerLength;
+    return true;
+  }
+
+  // Length of the gzip header (RFC 1952) at the start of the first block, or
+  // 0 when it is malformed or does not fit in that block
+  static size_t gzipHeaderLength(const uint8_t* data, size_t len) {
+    const uint8_t flagHeaderCrc = 0x02, flagExtra = 0x04, flagName = 0x08, flagComment = 0x10;
+    if (len < 10 || data[2] != 8) {   // Deflate is the only defined method
+      return 0;
+    }
+    uint8_t flags = data[3];
+    size_t offset = 10;
+    if (flags & flagExtra) {
+      if (offset + 2 > len) {
+        return 0;
+      }
+      offset += 2 + (data[offset] | data[offset + 1] << 8);
+    }
+    for (uint8_t field : {flagName, flagComment}) {
+      if (flags & field) {
+        while (offset < len && data[offset] != 0) {
+          offset++;
+        }
+        offset++;   // Terminator
+      }
+    }
+    if (flags & flagHeaderCrc) {
+      offset += 2;
+    }
+    return offset <= len ? offset : 0;
+  }
+
+  bool inflate(const uint8_t* data, size_t len) {
+    while (len > 0 || inflateStatus == TINFL_STATUS_HAS_MORE_OUTPUT) {
+      if (inflateStatus == TINFL_STATUS_DONE) {
+        return true;   // Only the trailer is left; its CRC32 adds nothing to the SHA-256 check
+      }
+      size_t inBytes = len;
+      size_t outBytes = TINFL_LZ_DICT_SIZE - dictionaryOffset;
+      inflateStatus = tinfl_decompress(inflator, data, &inBytes, dictionary, dictionary + dictionaryOffset,
+                                       &outBytes, TINFL_FLAG_HAS_MORE_INPUT);
+      data += inBytes;
+      len -= inBytes;
+
+      if (outBytes > 0) {
+        if (!firmwareWriter.write(dictionary + dictionaryOffset, outBytes)) {
+          return false;
+        }
+        dictionaryOffset = (dictionaryOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+      }
+      if (inflateStatus < TINFL_STATUS_DONE) {
+        firmwareWriter.fail(400, "Corrupt gzip stream");
+        return false;
+      }
+      if (inflateStatus == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  void freeInflator() {
+    free(inflator);
+    free(dictionary);
+    inflator = nullptr;
+    dictionary = nullptr;
+  }
+};
+
+FirmwarePull firmwarePull;
+
+void offerFirmware(const String& version, const String& url, size_t size, const String& sha256) {
+  firmwarePull.offer(version, url, size, sha256);
+}
+
+#define MQTT_DEFAULT_PORT 1883
+#define MQTT_KEEPALIVE_S 30
+#define MQTT_CONNECT_TIMEOUT_MS 10000
+#define MQTT_BACKOFF_INITIAL_MS 1000
+#define MQTT_BACKOFF_MAX_MS 60000
+#define MQTT_STALE_COMMAND_MS 2000        // Commands the broker queued while we were away arrive right after connect
+#define MQTT_DISCOVERY_PREFIX "homeassistant"
+
+// MQTT transport for the same capabilities registerDevice() describes: a
+// door binary_sensor and a trigger per door channel, on <base>/door,
+// <base>/transition and <base>/trigger/set for channel 0 and with the
+// channel suffix ("door2", "trigger2/set") for the others. One persistent
+// session (clean session off, QoS 1) carries retained door state on change
+// and trigger commands the other way, with an "offline" last will for
+// availability. Home Assistant discovery is published on every connect.
+//
+// While MQTT is connected it replaces the HTTP status POSTs; registration
+// still goes over HTTP. Connection handling and publishing run on the loop
+// task (handleMqtt); AsyncMqttClient's callbacks run on the AsyncTCP task
+// and only set flags, except commands, which trigger the relay directly
+// like /api/trigger does.
+class MqttTransport {
+public:
+  MqttTransport()
+      : enabled(false), port(MQTT_DEFAULT_PORT), discovery(true), connecting(false), attemptStart(0),
+        retryAt(0), connectedAt(0), publishedDoors(),
+        backoff(MQTT_BACKOFF_INITIAL_MS, MQTT_BACKOFF_MAX_MS), connectEvent(false), disconnectEvent(false),
+        reloadRequested(false), live(false), sessionPresent(false), connects(0), publishes(0),
+        commands(0), staleCommands(0) {}
+
+  void begin() {
+    client.onConnect([this](bool present) {
+      connectedAt = millis();
+      sessionPresent.store(present);
+      connectEvent.store(true);
+      wakeLoop();
+    });
+    client.onDisconnect([this](AsyncMqttClientDisconnectReason reason) {
+      live.store(false);
+      disconnectEvent.store(true);
+      wakeLoop();
+    });
+    client.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties,
+                            size_t len, size_t index, size_t total) {
+      onMessage(topic, properties, index);
+    });
+    load();
+  }
+
+  // Settings changed through /api/mqtt: reconnect with them on the loop task
+  void requestReload() {
+    reloadRequested.store(true);
+    wakeLoop();
+  }
+
+  // "mqtt" scheduler task
+  uint32_t run(uint32_t now) {
+    if (reloadRequested.load()) {
+      reloadRequested.store(false);
+      if (client.connected() || connecting) {
+        client.disconnect(true);
+      }
+      live.store(false);
+      connecting = false;
+      load();
+      backoff.reset();
+      retryAt = now;
+    }
+    if (connectEvent.load()) {
+      connectEvent.store(false);
+      onConnected();
+    }
+    if (disconnectEvent.load()) {
+      disconnectEvent.store(false);
+      if (enabled) {
+        uint32_t delayMs = backoff.next(esp_random());
+        retryAt = now + delayMs;
+        logf(LOG_WARN, "MQTT disconnected, retry in %lu ms", (unsigned long)delayMs);
+      }
+      connecting = false;
+    }
+
+    if (!enabled || linkState != LINK_ONLINE) {
+      return SCHEDULER_IDLE_MS;
+    }
+
+    if (!live.load()) {
+      if (connecting) {
+        if (now - attemptStart < MQTT_CONNECT_TIMEOUT_MS) {
+          return MQTT_CONNECT_TIMEOUT_MS - (now - attemptStart);
+        }
+        client.disconnect(true);   // Reported as a disconnect, which schedules the retry
+        return SCHEDULER_IDLE_MS;
+      }
+      if ((int32_t)(now - retryAt) < 0) {
+        return retryAt - now;
+      }
+      logf(LOG_INFO, "MQTT connecting to %s:%u", host.c_str(), (unsigned)port);
+      connecting = true;
+      attemptStart = now;
+      client.connect();
+      return MQTT_CONNECT_TIMEOUT_MS;
+    }
+
+    publishState(false);
+    return SCHEDULER_IDLE_MS;
+  }
+
+  bool isConnected() const { return live.load(); }
+
+  void getStats(JsonObject stats) const {
+    stats["connected"] = live.load();
+    stats["connects"] = connects;
+    stats["publishes"] = publishes;
+    stats["commands"] = commands;
+    stats["stale_commands"] = staleCommands;
+  }
+
+private:
+  AsyncMqttClient client;
+  // AsyncMqttClient keeps pointers to these; they only change while disconnected
+  bool enabled;
+  String host;
+  uint16_t port;
+  String username;
+  String password;
+  String clientId;
+  String baseTopic;
+  String availabilityTopic;
+  String doorTopics[DOOR_MAX_CHANNELS];
+  String transitionTopics[DOOR_MAX_CHANNELS];
+  String commandTopics[DOOR_MAX_CHANNELS];
+  bool discovery;
+
+  bool connecting;
+  uint32_t attemptStart;
+  uint32_t retryAt;
+  volatile uint32_t connectedAt;   // Set by the connect callback, before any queued command arrives
+  DoorState publishedDoors[DOOR_MAX_CHANNELS];
+  Backoff backoff;
+
+  std::atomic<bool> connectEvent;
+  std::atomic<bool> disconnectEvent;
+  std::atomic<bool> reloadRequested;
+  std::atomic<bool> live;
+  std::atomic<bool> sessionPresent;
+  uint32_t connects;
+  uint32_t publishes;
+  volatile uint32_t commands;
+  volatile uint32_t staleCommands;
+
+  void load() {
+    enabled = configStore.getBool("mqtt_enabled", false);
+    host = configStore.getString("mqtt_host", "");
+    port = configStore.getUShort("mqtt_port", MQTT_DEFAULT_PORT);
+    username = configStore.getString("mqtt_user", "");
+    password = configStore.getString("mqtt_pass", "");
+    discovery = configStore.getBool("mqtt_disc", true);
+
+    String mac = WiFi.macAddress();
+    mac.replace(":", "");
+    mac.toLowerCase();
+    clientId = String(WiFi.getHostname()) + "-" + mac.substring(6);
+    baseTopic = configStore.getString("mqtt_base", "");
+    if (baseTopic.length() == 0) {
+      baseTopic = "garage/" + String(WiFi.getHostname());
+    }
+    availabilityTopic = baseTopic + "/availability";
+    for (size_t i = 0; i < doorChannels.size(); i++) {
+      char suffix[4];
+      doorChannelSuffix(i, suffix, sizeof(suffix));
+      doorTopics[i] = baseTopic + "/door" + suffix;
+      transitionTopics[i] = baseTopic + "/transition" + suffix;
+      commandTopics[i] = baseTopic + "/trigger" + suffix + "/set";
+    }
+
+    if (host.length() == 0) {
+      enabled = false;
+    }
+    client.setServer(host.c_str(), port);
+    client.setClientId(clientId.c_str());
+    client.setCredentials(username.length() > 0 ? username.c_str() : nullptr,
+                          password.length() > 0 ? password.c_str() : nullptr);
+    client.setKeepAlive(MQTT_KEEPALIVE_S);
+    client.setCleanSession(false);
+    client.setWill(availabilityTopic.c_str(), 1, true, "offline");
+  }
+
+  void onConnected() {
+    connecting = false;
+    connects++;
+    backoff.reset();
+    logf(LOG_INFO, "MQTT connected (%s session)", sessionPresent.load() ? "resumed" : "new");
+
+    for (size_t i = 0; i < doorChannels.size(); i++) {
+      client.subscribe(commandTopics[i].c_str(), 1);
+    }
+    publish(availabilityTopic, "online");
+    if (discovery) {
+      publishDiscovery();
+    }
+    live.store(true);
+    publishState(true);
+  }
+
+  void publish(const String& topic, const char* payload) {
+    if (client.publish(topic.c_str(), 1, true, payload) != 0) {
+      publishes++;
+    }
+  }
+
+  // Retained, QoS 1, only when something changed (or after every connect)
+  void publishState(bool force) {
+    DeviceState state = deviceState.get();
+    for (uint8_t i = 0; i < state.doorCount; i++) {
+      const DoorState& door = state.doors[i];
+      if (force || door.doorOpen != publishedDoors[i].doorOpen) {
+        publish(doorTopics[i], door.doorOpen ? "open" : "closed");
+        publishedDoors[i].doorOpen = door.doorOpen;
+      }
+      if (force || door.transition != publishedDoors[i].transition) {
+        publish(transitionTopics[i], door.transition != TRANSITION_NONE ? transitionName(door.transition) : "none");
+        publishedDoors[i].transition = door.transition;
+      }
+    }
+  }
+
+  void publishDiscovery() {
+    String mac = WiFi.macAddress();
+    mac.replace(":", "");
+    String nodeId = String(WiFi.getHostname());
+    String deviceName = configStore.getString("reg_name", "Garage-Door");
+
+    DynamicJsonDocument doc(768);
+    for (size_t i = 0; i < doorChannels.size(); i++) {
+      const DoorChannel& channel = doorChannels[i];
+      char suffix[4];
+      doorChannelSuffix(i, suffix, sizeof(suffix));
+      String doorId = String("door") + suffix;
+      String triggerId = String("trigger") + suffix;
+      String payload;
+
+      doc.clear();
+      addDiscoveryCommon(doc, mac, deviceName, channel.name, doorId.c_str());
+      doc["state_topic"] = doorTopics[i];
+      doc["payload_on"] = "open";
+      doc["payload_off"] = "closed";
+      doc["device_class"] = "garage_door";
+      serializeJson(doc, payload);
+      client.publish((String(MQTT_DISCOVERY_PREFIX) + "/binary_sensor/" + nodeId + "/" + doorId + "/config").c_str(),
+                     1, true, payload.c_str(), payload.length());
+
+      // A press-only action maps to a Home Assistant button, not a stateful switch
+      doc.clear();
+      payload = "";
+      String triggerName = i == 0 ? String("Trigger") : String("Trigger ") + channel.name;
+      addDiscoveryCommon(doc, mac, deviceName, triggerName.c_str(), triggerId.c_str());
+      doc["command_topic"] = commandTopics[i];
+      doc["payload_press"] = "PRESS";
+      serializeJson(doc, payload);
+      client.publish((String(MQTT_DISCOVERY_PREFIX) + "/button/" + nodeId + "/" + triggerId + "/config").c_str(),
+                     1, true, payload.c_str(), payload.length());
+    }
+  }
+
+  void addDiscoveryCommon(JsonDocument& doc, const String& mac, const String& deviceName,
+                          const char* name, const char* identifier) {
+    doc["name"] = name;
+    doc["unique_id"] = mac + "_" + identifier;
+    doc["availability_topic"] = availabilityTopic;
+    JsonObject device = doc.createNestedObject("device");
+    device.createNestedArray("identifiers").add(mac);
+    device["name"] = deviceName;
+    device["model"] = "ESP32-C3 Garage Door Opener";
+    device["sw_version"] = FIRMWARE_VERSION;
+  }
+
+  // AsyncTCP task. Retained commands and ones the broker held for us while
+  // we were offline are dropped: the door must not move on a stale press.
+  void onMessage(const char* topic, AsyncMqttClientMessageProperties properties, size_t index) {
+    int channel = -1;
+    for (size_t i = 0; i < doorChannels.size() && channel < 0; i++) {
+      if (commandTopics[i] == topic) {
+        channel = (int)i;
+      }
+    }
+    if (index != 0 || channel < 0) {
+      return;
+    }
+    if (properties.retain || (sessionPresent.load() && millis() - connectedAt < MQTT_STALE_COMMAND_MS)) {
+      staleCommands++;
+      logf(LOG_WARN, "MQTT: ignored stale trigger command");
+      return;
+    }
+    commands++;
+    logf(LOG_INFO, "MQTT: trigger command (%s)", doorChannels[channel].name);
+    startDoorTrigger(SOURCE_MQTT, channel);
+  }
+};
+
+MqttTransport mqtt;
+
+#define UDP_DEFAULT_PORT 4210
+#define UDP_MIN_KEY_LENGTH 16
+#define UDP_MAX_KEY_LENGTH 64
+#define UDP_TX_RESERVE 1024          // Device counters reserved in flash per write
+
+// Last trigger counter seen from each remote; ConfigStore keeps the pointers
+static const char* const UDP_RX_KEYS[UDP_MAX_SENDERS] = {
+  "udp_rx0", "udp_rx1", "udp_rx2", "udp_rx3", "udp_rx4", "udp_rx5", "udp_rx6", "udp_rx7"
+};
+
+// Low-latency local trigger and status channel: single authenticated UDP
+// datagrams (see udp_frame.h) carry a trigger from a remote or keypad
+// straight to the relay, with no TCP handshake or HTTP parse.
+//
+// Frames arrive on the AsyncUDP task. Those with a valid HMAC-SHA256 tag and
+// a fresh counter call startDoorTrigger() right there and are answered with
+// an ACK; everything else is dropped without a reply. A TRIGGER or QUERY
+// body may hold a door channel byte (none means channel 0), which the ACK
+// echoes. Door state changes are broadcast as one STATUS frame per changed
+// channel from the loop task. The key and the counters are shared between
+// the two under a mutex; received counters are saved by the loop task, and
+// the device's own counter is reserved ahead in flash so it never repeats
+// across reboots.
+class UdpChannel {
+public:
+  UdpChannel()
+      : lock(nullptr), loaded(false), enabled(false), listening(false), port(UDP_DEFAULT_PORT), keyLength(0),
+        txCounter(0), txReserved(0), publishedDoors(), published(false), reloadRequested(false),
+        countersDirty(false), triggers(0), queries(0), repeats(0), malformed(0), badTag(0), replayed(0), broadcasts(0) {
+    key[0] = '\0';
+    for (size_t i = 0; i < UDP_MAX_SENDERS; i++) {
+      lastResult[i] = 0;
+    }
+  }
+
+  void begin() {
+    lock = xSemaphoreCreateMutex();
+    // Continue above anything sent before the last reboot
+    txCounter.store(configStore.getUInt("udp_tx", 0));
+    reserveCounters();
+    udp.onPacket([this](AsyncUDPPacket& packet) {
+      onPacket(packet);
+    });
+    load();
+  }
+
+  // Settings changed through /api/udp: reopen with them on the loop task
+  void requestReload() {
+    reloadRequested.store(true);
+    wakeLoop();
+  }
+
+  // "udp" scheduler task
+  uint32_t run(uint32_t now) {
+    if (reloadRequested.load()) {
+      reloadRequested.store(false);
+      load();
+    }
+    // Staged like any setting; ConfigStore skips remotes whose counter did
+    // not move and writes the rest in one batch
+    if (countersDirty.exchange(false)) {
+      uint32_t counters[UDP_MAX_SENDERS];
+      xSemaphoreTake(lock, portMAX_DELAY);
+      memcpy(counters, replay.data(), sizeof(counters));
+      xSemaphoreGive(lock);
+      for (size_t i = 0; i < UDP_MAX_SENDERS; i++) {
+        configStore.putUInt(UDP_RX_KEYS[i], counters[i]);
+      }
+    }
+    if ((int32_t)(txReserved - txCounter.load()) < UDP_TX_RESERVE / 2) {
+      reserveCounters();
+    }
+
+    if (listening && (linkState == LINK_ONLINE || apMode)) {
+      DeviceState state = deviceState.get();
+      for (uint8_t i = 0; i < state.doorCount; i++) {
+        if (!published || doorsChanged(&state.doors[i], &publishedDoors[i], 1)) {
+          publishedDoors[i] = state.doors[i];
+          broadcastStatus(state, i);
+        }
+      }
+      published = true;
+    }
+    return SCHEDULER_IDLE_MS;
+  }
+
+  void getStats(JsonObject stats) {
+    stats["listening"] = listening;
+    stats["triggers"] = triggers.load();
+    stats["queries"] = queries.load();
+    stats["repeats"] = repeats.load();
+    stats["malformed"] = malformed.load();
+    stats["bad_tag"] = badTag.load();
+    stats["replayed"] = replayed.load();
+    stats["broadcasts"] = broadcasts;
+  }
+
+  uint32_t getRejected() const { return malformed.load() + badTag.load() + replayed.load(); }
+
+private:
+  AsyncUDP udp;
+  SemaphoreHandle_t lock;        // Guards the key, replay and listening
+  bool loaded;
+  bool enabled;
+  bool listening;
+  uint16_t port;
+  char key[UDP_MAX_KEY_LENGTH + 1];
+  size_t keyLength;
+  ReplayGuard<UDP_MAX_SENDERS> replay;
+  uint8_t lastResult[UDP_MAX_SENDERS];   // ACK result of each sender's last frame (AsyncUDP task only)
+  std::atomic<uint32_t> txCounter;
+  uint32_t txReserved;
+  DoorState publishedDoors[DOOR_MAX_CHANNELS];
+  bool published;
+  std::atomic<bool> reloadRequested;
+  std::atomic<bool> countersDirty;  // A trigger moved a receive counter
+  std::atomic<uint32_t> triggers;
+  std::atomic<uint32_t> queries;
+  std::atomic<uint32_t> repeats;
+  std::atomic<uint32_t> malformed;
+  std::atomic<uint32_t> badTag;
+  std::atomic<uint32_t> replayed;
+  uint32_t broadcasts;
+
+  void load() {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (listening) {
+      udp.close();
+      listening = false;
+    }
+    enabled = configStore.getBool("udp_enabled", false);
+    port = configStore.getUShort("udp_port", UDP_DEFAULT_PORT);
+    String stored = configStore.getString("udp_key", "");
+    bool keyChanged = stored != key;
+    keyLength = min((size_t)stored.length(), (size_t)UDP_MAX_KEY_LENGTH);
+    memcpy(key, stored.c_str(), keyLength);
+    key[keyLength] = '\0';
+
+    // Counters belong to a key: with a new one every remote starts over
+    replay.reset();
+    if (keyChanged && loaded) {
+      countersDirty.store(true);
+    } else {
+      for (size_t i = 0; i < UDP_MAX_SENDERS; i++) {
+        replay.data()[i] = configStore.getUInt(UDP_RX_KEYS[i], 0);
+      }
+    }
+    loaded = true;
+
+    if (enabled && keyLength < UDP_MIN_KEY_LENGTH) {
+      logf(LOG_WARN, "UDP: key shorter than %d characters, channel disabled", UDP_MIN_KEY_LENGTH);
+    } else if (enabled) {
+      listening = udp.listen(port);
+      if (listening) {
+        logf(LOG_INFO, "UDP: listening on port %u", (unsigned)port);
+      } else {
+        logf(LOG_ERROR, "UDP: could not listen on port %u", (unsigned)port);
+      }
+    }
+    published = false;   // Announce the current state on (re)open
+    xSemaphoreGive(lock);
+  }
+
+  // Writes the next reservation before the counter can reach it. Committed
+  // straight away, not after the quiet time: a reboot must never reuse one.
+  void reserveCounters() {
+    txReserved = txCounter.load() + UDP_TX_RESERVE;
+    configStore.putUInt("udp_tx", txReserved);
+    configStore.commit();
+  }
+
+  // Caller holds lock
+  void computeTag(const uint8_t* data, size_t length, uint8_t* tag) {
+    uint8_t digest[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)key, keyLength,
+                    data, length, digest);
+    memcpy(tag, digest, UdpFrame::TAG_BYTES);
+  }
+
+  // Caller holds lock. Appends the tag to a frame of length bytes and
+  // returns the full length.
+  size_t seal(uint8_t* frame, size_t length) {
+    computeTag(frame, length, frame + length);
+    return length + UdpFrame::TAG_BYTES;
+  }
+
+  size_t buildFrame(uint8_t* frame, uint8_t type, const uint8_t* body, size_t bodyLength) {
+    size_t length = UdpFrame::writeHeader(frame, type, UdpFrame::DEVICE_SENDER, txCounter.fetch_add(1) + 1);
+    memcpy(frame + length, body, bodyLength);
+    return length + bodyLength;
+  }
+
+  // AsyncUDP task
+  void onPacket(AsyncUDPPacket& packet) {
+    uint32_t startUs = micros();
+    UdpFrame::Header header;
+    const uint8_t* body;
+    size_t bodyLength;
+    if (!UdpFrame::parse(packet.data(), packet.length(), header, body, bodyLength) ||
+        (header.type != UdpFrame::TRIGGER && header.type != UdpFrame::QUERY)) {
+      malformed++;
+      return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint8_t tag[UdpFrame::TAG_BYTES];
+    size_t signedLength = packet.length() - UdpFrame::TAG_BYTES;
+    computeTag(packet.data(), signedLength, tag);
+    if (!listening || !UdpFrame::tagEquals(tag, packet.data() + signedLength)) {
+      xSemaphoreGive(lock);
+      badTag++;
+      return;
+    }
+    ReplayGuard<UDP_MAX_SENDERS>::Verdict verdict = replay.check(header.sender, header.counter);
+    xSemaphoreGive(lock);
+
+    if (verdict == ReplayGuard<UDP_MAX_SENDERS>::STALE) {
+      replayed++;
+      return;
+    }
+
+    uint8_t channel = bodyLength > 0 ? body[0] : 0;
+    uint8_t result = channel < doorChannels.size() ? 1 : 0;
+    if (verdict == ReplayGuard<UDP_MAX_SENDERS>::REPEAT) {
+      // The remote missed our ACK and resent the same frame
+      repeats++;
+      result = lastResult[header.sender];
+    } else {
+      if (header.type == UdpFrame::TRIGGER) {
+        // Only triggers are persisted: a query replayed after a reboot just
+        // reads the door state, but a trigger must never pulse twice. This
+        // also keeps polling remotes from wearing the NVS sector.
+        countersDirty.store(true);
+        result = startDoorTrigger(SOURCE_UDP, channel) ? 1 : 0;
+        metrics.udpTrigger.record(micros() - startUs);
+        triggers++;
+        logf(LOG_INFO, "UDP: trigger from remote %u, channel %u", (unsigned)header.sender, (unsigned)channel);
+      } else {
+        queries++;
+      }
+      lastResult[header.sender] = result;
+    }
+    sendAck(packet, header.counter, result, channel);
+  }
+
+  // ACK body: echoed counter(4) result door transition channel; door and
+  // transition are 0 for a channel that does not exist
+  void sendAck(AsyncUDPPacket& packet, uint32_t counter, uint8_t result, uint8_t channel) {
+    DeviceState state = deviceState.get();
+    bool known = channel < state.doorCount;
+    uint8_t body[8];
+    UdpFrame::putUint32(body, counter);
+    body[4] = result;
+    body[5] = known && state.doors[channel].doorOpen ? 1 : 0;
+    body[6] = known ? state.doors[channel].transition : TRANSITION_NONE;
+    body[7] = channel;
+
+    uint8_t frame[UdpFrame::MAX_BYTES];
+    size_t length = buildFrame(frame, UdpFrame::ACK, body, sizeof(body));
+    xSemaphoreTake(lock, portMAX_DELAY);
+    length = seal(frame, length);
+    xSemaphoreGive(lock);
+    packet.write(frame, length);
+  }
+
+  // STATUS body: door transition channel
+  void broadcastStatus(const DeviceState& state, uint8_t channel) {
+    const DoorState& door = state.doors[channel];
+    uint8_t body[3] = {(uint8_t)(door.doorOpen ? 1 : 0), (uint8_t)door.transition, channel};
+    uint8_t frame[UdpFrame::MAX_BYTES];
+    size_t length = buildFrame(frame, UdpFrame::STATUS, body, sizeof(body));
+    xSemaphoreTake(lock, portMAX_DELAY);
+    length = seal(frame, length);
+    xSemaphoreGive(lock);
+    if (udp.broadcastTo(frame, length, port) == length) {
+      broadcasts++;
+    }
+  }
+};
+
+UdpChannel udpChannel;
+
+#define HISTORY_DIR "/history"
+#define HISTORY_INDEX_PATH "/history/index"
+#define HISTORY_BUFFER_RECORDS 32          // RAM write-back buffer
+#define HISTORY_FLUSH_INTERVAL_MS 30000
+
+// Append-only door event journal on LittleFS (see event_journal.h).
+// record() may be called from any task: it only copies the event into a RAM
+// buffer under a spinlock. The "history" loop task writes the buffer out
+// every HISTORY_FLUSH_INTERVAL_MS, or sooner when it is half full, filling
+// in wall-clock time for events recorded before the first SNTP sync of this
+// boot; ones already on flash by then are stamped in place after it. Reads
+// (the /api/history stream on the AsyncTCP task) and flushes are serialized
+// by a mutex and see buffered events too. Segment files are named by their
+// number; the oldest is deleted when a new one would exceed
+// HISTORY_MAX_SEGMENTS, and the time index is trimmed with it.
+class EventHistory {
+public:
+  EventHistory()
+      : available(false), fileLock(nullptr), firstSeq(0), flushedSeq(0), nextSeq(0), pendingCount(0),
+        lastFlush(0), unstampedFrom(0), unstampedTo(0), index(HISTORY_INDEX_STRIDE), dropped(0), flushes(0) {
+    portMUX_INITIALIZE(&pendingLock);
+  }
+
+  // Mounts the filesystem (formatting it if it has never been used) and
+  // finds where the journal left off
+  void begin() {
+    fileLock = xSemaphoreCreateMutex();
+    if (!LittleFS.begin(true)) {
+      logf(LOG_ERROR, "History: LittleFS mount failed, events are not kept");
+      return;
+    }
+    if (!LittleFS.exists(HISTORY_DIR)) {
+      LittleFS.mkdir(HISTORY_DIR);
+    }
+
+    uint32_t oldest = UINT32_MAX;
+    uint32_t newest = 0;
+    bool any = false;
+    File dir = LittleFS.open(HISTORY_DIR);
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+      uint32_t segment;
+      if (parseSegment(file.name(), segment)) {
+        any = true;
+        oldest = min(oldest, segment);
+        if (segment >= newest) {
+          newest = segment;
+          nextSeq = segment * HISTORY_RECORDS_PER_SEGMENT + file.size() / sizeof(HistoryRecord);
+          // A write cut short by a reset: appending would misalign every
+          // later record, so carry on in a fresh segment
+          if (file.size() % sizeof(HistoryRecord) != 0) {
+            nextSeq = (segment + 1) * HISTORY_RECORDS_PER_SEGMENT;
+          }
+        }
+      }
+    }
+    firstSeq = any ? oldest * HISTORY_RECORDS_PER_SEGMENT : 0;
+    flushedSeq = nextSeq;
+    loadIndex();
+    available = true;
+    logf(LOG_INFO, "History: %lu events on flash", (unsigned long)(nextSeq - firstSeq));
+  }
+
+  // Any task. Never touches flash. source is packed with its door channel
+  // (packHistorySource()).
+  void record(HistoryEvent event, uint8_t source, uint32_t timestamp, bool doorOpen,
+              DoorTransition transition) {
+    if (!available) {
+      return;
+    }
+    portENTER_CRITICAL(&pendingLock);
+    bool stored = pendingCount < HISTORY_BUFFER_RECORDS;
+    if (stored) {
+      HistoryRecord& record = pending[pendingCount++];
+      record.seq = nextSeq++;
+      record.epoch = 0;
+      record.uptimeMs = timestamp;
+      record.event = event;
+      record.source = source;
+      record.doorOpen = doorOpen ? 1 : 0;
+      record.transition = transition;
+    }
+    bool halfFull = pendingCount >= HISTORY_BUFFER_RECORDS / 2;
+    portEXIT_CRITICAL(&pendingLock);
+
+    if (!stored) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (halfFull) {
+      wakeLoop();
+    }
+  }
+
+  // "history" scheduler task. Returns the milliseconds until the next
+  // periodic flush, or UINT32_MAX when nothing is buffered and every event
+  // on flash has its wall-clock time.
+  uint32_t run(uint32_t now) {
+    uint32_t idle = stampFlushed() ? HISTORY_FLUSH_INTERVAL_MS : UINT32_MAX;
+    portENTER_CRITICAL(&pendingLock);
+    size_t buffered = pendingCount;
+    portEXIT_CRITICAL(&pendingLock);
+    if (buffered == 0) {
+      lastFlush = now;
+      return idle;
+    }
+    uint32_t elapsed = now - lastFlush;
+    if (elapsed < HISTORY_FLUSH_INTERVAL_MS && buffered < HISTORY_BUFFER_RECORDS / 2) {
+      return HISTORY_FLUSH_INTERVAL_MS - elapsed;
+    }
+    flush();
+    lastFlush = now;
+    // Until the first SNTP sync, check back for it to stamp what was just written
+    return timebase.isSynced() ? UINT32_MAX : HISTORY_FLUSH_INTERVAL_MS;
+  }
+
+  // Writes the buffered events now; also called ahead of a restart
+  void flush() {
+    if (!available) {
+      return;
+    }
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    stampFlushedLocked();
+    HistoryRecord batch[HISTORY_BUFFER_RECORDS];
+    portENTER_CRITICAL(&pendingLock);
+    size_t count = pendingCount;
+    memcpy(batch, pending, count * sizeof(HistoryRecord));
+    pendingCount = 0;
+    portEXIT_CRITICAL(&pendingLock);
+
+    bool indexChanged = false;
+    size_t i = 0;
+    while (i < count) {
+      uint32_t segment = batch[i].seq / HISTORY_RECORDS_PER_SEGMENT;
+      if (batch[i].seq % HISTORY_RECORDS_PER_SEGMENT == 0) {
+        indexChanged |= rotate(segment);
+      }
+      // Everything up to the end of this segment in one write
+      size_t run = 1;
+      while (i + run < count && batch[i + run].seq / HISTORY_RECORDS_PER_SEGMENT == segment) {
+        run++;
+      }
+      for (size_t j = i; j < i + run; j++) {
+        if (batch[j].epoch == 0) {
+          batch[j].epoch = timebase.toEpoch(batch[j].uptimeMs);
+        }
+        if (batch[j].epoch == 0) {
+          if (unstampedFrom == unstampedTo) {
+            unstampedFrom = batch[j].seq;
+          }
+          unstampedTo = batch[j].seq + 1;
+        }
+        if (index.add(batch[j].epoch, batch[j].seq)) {
+          appendIndex(index.data()[index.size() - 1]);
+        }
+      }
+
+      char path[32];
+      segmentPath(segment, path, sizeof(path));
+      File file = LittleFS.open(path, "a");
+      size_t bytes = run * sizeof(HistoryRecord);
+      if (!file || file.write((const uint8_t*)&batch[i], bytes) != bytes) {
+        logf(LOG_ERROR, "History: write to %s failed", path);
+      }
+      file.close();
+      i += run;
+    }
+    if (indexChanged) {
+      saveIndex();
+    }
+    flushedSeq += count;
+    flushes++;
+    xSemaphoreGive(fileLock);
+  }
+
+  // Copies up to maxCount events starting at seq (or the oldest one kept, if
+  // seq was deleted) into out, stopping at a segment boundary. Returns how
+  // many were copied; 0 means there is nothing at or after seq.
+  size_t read(uint32_t seq, HistoryRecord* out, size_t maxCount) {
+    if (!available) {
+      return 0;
+    }
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    seq = max(seq, firstSeq);
+    size_t count = 0;
+    // A short segment (see begin()) leaves a gap up to the next one
+    while (seq < flushedSeq && count == 0) {
+      uint32_t segment = seq / HISTORY_RECORDS_PER_SEGMENT;
+      uint32_t segmentEnd = min((segment + 1) * HISTORY_RECORDS_PER_SEGMENT, flushedSeq);
+      size_t wanted = min((size_t)(segmentEnd - seq), maxCount);
+      char path[32];
+      segmentPath(segment, path, sizeof(path));
+      File file = LittleFS.open(path, "r");
+      if (file && file.seek((seq % HISTORY_RECORDS_PER_SEGMENT) * sizeof(HistoryRecord))) {
+        count = file.read((uint8_t*)out, wanted * sizeof(HistoryRecord)) / sizeof(HistoryRecord);
+      }
+      file.close();
+      seq = segmentEnd;
+    }
+    if (count == 0) {
+      portENTER_CRITICAL(&pendingLock);
+      size_t offset = seq - flushedSeq;
+      if (offset < pendingCount) {
+        count = min(pendingCount - offset, maxCount);
+        memcpy(out, pending + offset, count * sizeof(HistoryRecord));
+      }
+      portEXIT_CRITICAL(&pendingLock);
+      // Buffered events are from this boot, so the clock applies to them as it will at flush
+      for (size_t i = 0; i < count; i++) {
+        if (out[i].epoch == 0) {
+          out[i].epoch = timebase.toEpoch(out[i].uptimeMs);
+        }
+      }
+    }
+    xSemaphoreGive(fileLock);
+    return count;
+  }
+
+  // Sequence range a query should scan; to is exclusive
+  void seek(bool hasFrom, uint32_t from, bool hasTo, uint32_t to, uint32_t& start, uint32_t& end) {
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    start = hasFrom ? index.seekFrom(from, firstSeq) : firstSeq;
+    end = getNextSeq();
+    if (hasTo) {
+      end = min(end, index.seekTo(to));
+    }
+    xSemaphoreGive(fileLock);
+  }
+
+  uint32_t getFirstSeq() const { return firstSeq; }
+
+  uint32_t getNextSeq() {
+    portENTER_CRITICAL(&pendingLock);
+    uint32_t seq = nextSeq;
+    portEXIT_CRITICAL(&pendingLock);
+    return seq;
+  }
+
+  void getStats(JsonObject stats) {
+    stats["available"] = available;
+    stats["first"] = firstSeq;
+    stats["next"] = getNextSeq();
+    stats["index_entries"] = index.size();
+    stats["flushes"] = flushes;
+    stats["dropped"] = dropped.load(std::memory_order_relaxed);
+    if (available) {
+      stats["fs_used"] = LittleFS.usedBytes();
+      stats["fs_total"] = LittleFS.totalBytes();
+    }
+  }
+
+private:
+  bool available;
+  SemaphoreHandle_t fileLock;      // Files, index, firstSeq and flushedSeq
+  portMUX_TYPE pendingLock;        // pending, pendingCount and nextSeq
+  uint32_t firstSeq;
+  uint32_t flushedSeq;
+  uint32_t nextSeq;
+  HistoryRecord pending[HISTORY_BUFFER_RECORDS];
+  size_t pendingCount;
+  uint32_t lastFlush;
+  uint32_t unstampedFrom;          // Flushed this boot before the clock was known; to is exclusive
+  uint32_t unstampedTo;
+  HistoryIndex<HISTORY_INDEX_CAPACITY> index;
+  std::atomic<uint32_t> dropped;
+  uint32_t flushes;
+
+  static void segmentPath(uint32_t segment, char* buffer, size_t size) {
+    snprintf(buffer, size, HISTORY_DIR "/%08lu.bin", (unsigned long)segment);
+  }
+
+  // Accepts "00000012.bin" with or without the directory in front
+  static bool parseSegment(const char* name, uint32_t& segment) {
+    const char* base = strrchr(name, '/');
+    base = base != nullptr ? base + 1 : name;
+    char* end;
+    unsigned long value = strtoul(base, &end, 10);
+    if (end == base || strcmp(end, ".bin") != 0) {
+      return false;
+    }
+    segment = value;
+    return true;
+  }
+
+  // True while events flushed this boot still have no wall-clock time
+  bool stampFlushed() {
+    xSemaphoreTake(fileLock, portMAX_DELAY);
+    stampFlushedLocked();
+    bool waiting = unstampedFrom != unstampedTo;
+    xSemaphoreGive(fileLock);
+    return waiting;
+  }
+
+  // Caller holds fileLock. Events flushed before the first SNTP sync of this
+  // boot went to flash with epoch 0; once the clock is known they are
+  // rewritten in place, since their uptimeMs is from this boot.
+  void stampFlushedLocked() {
+    if (unstampedFrom == unstampedTo || !timebase.isSynced()) {
+      return;
+    }
+    uint32_t seq = max(unstampedFrom, firstSeq);
+    while (seq < unstampedTo) {
+      uint32_t segment = seq / HISTORY_RECORDS_PER_SEGMENT;
+      uint32_t segmentEnd = min((segment + 1) * HISTORY_RECORDS_PER_SEGMENT, unstampedTo);
+      char path[32];
+      segmentPath(segment, path, sizeof(path));
+      File file = LittleFS.open(path, "r+");
+      while (file && seq < segmentEnd) {
+        HistoryRecord batch[HISTORY_QUERY_BATCH];
+        size_t count = min((size_t)(segmentEnd - seq), (size_t)HISTORY_QUERY_BATCH);
+        size_t offset = (seq % HISTORY_RECORDS_PER_SEGMENT) * sizeof(HistoryRecord);
+        size_t bytes = count * sizeof(HistoryRecord);
+        if (!file.seek(offset) || file.read((uint8_t*)batch, bytes) != bytes) {
+          break;
+        }
+        for (size_t i = 0; i < count; i++) {
+          if (batch[i].epoch == 0) {
+            batch[i].epoch = timebase.toEpoch(batch[i].uptimeMs);
+          }
+          if (index.add(batch[i].epoch, batch[i].seq)) {
+            appendIndex(index.data()[index.size() - 1]);
+          }
+        }
+        if (!file.seek(offset) || file.write((const uint8_t*)batch, bytes) != bytes) {
+          break;
+        }
+        seq += count;
+      }
+      if (seq < segmentEnd) {
+        logf(LOG_ERROR, "History: stamping times in %s failed", path);
+      }
+      file.close();
+      seq = segmentEnd;
+    }
+    unstampedFrom = unstampedTo;
+  }
+
+  // Caller holds fileLock. Makes room for a new segment; true when the
+  // index lost entries and must be rewritten.
+  bool rotate(uint32_t segment) {
+    uint32_t kept = segment - firstSeq / HISTORY_RECORDS_PER_SEGMENT;
+    if (kept < HISTORY_MAX_SEGMENTS) {
+      return false;
+    }
+    char path[32];
+    segmentPath(firstSeq / HISTORY_RECORDS_PER_SEGMENT, path, sizeof(path));
+    LittleFS.remove(path);
+    firstSeq += HISTORY_RECORDS_PER_SEGMENT;
+    index.dropBefore(firstSeq);
+    return true;
+  }
+
+  void loadIndex() {
+    index.clear();
+    File file = LittleFS.open(HISTORY_INDEX_PATH, "r");
+    if (!file) {
+      return;
+    }
+    HistoryIndexEntry entry;
+    while (file.read((uint8_t*)&entry, sizeof(entry)) == sizeof(entry)) {
+      if (entry.seq >= firstSeq && entry.seq < nextSeq) {
+        index.add(entry.epoch, entry.seq);
+      }
+    }
+    file.close();
+  }
+
+  void appendIndex(const HistoryIndexEntry& entry) {
+    File file = LittleFS.open(HISTORY_INDEX_PATH, "a");
+    if (file) {
+      file.write((const uint8_t*)&entry, sizeof(entry));
+      file.close();
+    }
+  }
+
+  void saveIndex() {
+    File file = LittleFS.open(HISTORY_INDEX_PATH, "w");
+    if (file) {
+      file.write((const uint8_t*)index.data(), index.size() * sizeof(HistoryIndexEntry));
+      file.close();
+    }
+  }
+};
+
+EventHistory eventHistory;
+
+// Writes everything still held in RAM; call before ESP.restart()
+void prepareForRestart() {
+  configStore.commit();
+  eventHistory.flush();
+}
+
+// Door events from the state store (loop task)
+void recordHistory(HistoryEvent event, TriggerSource source, uint8_t channel, uint32_t timestamp,
+                   const DeviceState& state) {
+  const DoorState& door = state.doors[channel];
+  eventHistory.record(event, packHistorySource(source, channel), timestamp, door.doorOpen, door.transition);
+}
+
+void setup() {
+  logMutex = xSemaphoreCreateMutexStatic(&logMutexBuffer);
+  disableWatchdog();
+  bootId = esp_random();
+  loopTaskHandle = xTaskGetCurrentTaskHandle();  // setup() and loop() share this task
+  Serial.begin(115200);
+
+  logf(LOG_INFO, "=== Athom Garage Door Opener ===");
+  logf(LOG_INFO, "Version: %s", FIRMWARE_VERSION);
+  logf(LOG_INFO, "Starting initialization...");
+
+  sntp_set_time_sync_notification_cb(onTimeSync);
+
+  preferences.begin(CONFIG_NAMESPACE, false);
+  configStore.begin();
+  loadConfiguration();
+  deviceState.begin();  // The input monitor posts the initial contact level
+
+  // Inputs and the relay first: they must work even if the network never comes up
+  setupGPIO();
+  powerManager.begin();
+  startupMetrics.inputsReadyMs = millis();
+  logf(LOG_INFO, "Startup: button and relay live after %lu ms", (unsigned long)startupMetrics.inputsReadyMs);
+
+  // The station connect runs in the background (handleWiFi); the web server
+  // only needs the network stack, which WiFi.mode() has brought up by now
+  startWiFi();
+  wsBroadcaster.begin();
+  setupWebServer();
+  mqtt.begin();
+  udpChannel.begin();
+  startupMetrics.webReadyMs = millis();
+  logf(LOG_INFO, "Startup: web server up after %lu ms", (unsigned long)startupMetrics.webReadyMs);
+
+  // After the web server: the first mount formats the partition, which takes a while
+  eventHistory.begin();
+
+  setupScheduler();
+  configureWatchdog(WATCHDOG_TIMEOUT_SECONDS);
+
+  logf(LOG_INFO, "Setup complete!");
+}
+
+void loop() {
+  static bool woken = false;
+  feedWatchdog();
+
+  uint32_t start = micros();
+  uint32_t wait = min(scheduler.runDue(woken), (uint32_t)LOOP_MAX_SLEEP_MS);
+  metrics.loopBusy.record(micros() - start);
+  // Sleep until the next deadline, or until another task calls wakeLoop()
+  woken = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait)) > 0;
+}
+
+// Registers loop()'s subsystems. Each task returns the milliseconds until it
+// next needs to run; "wake" tasks also run as soon as wakeLoop() is called.
+void setupScheduler() {
+  scheduler.add("wifi", handleWiFi, true);
+
+  scheduler.add("ota", [](uint32_t now) -> uint32_t {
+    if (linkState != LINK_ONLINE) {
+      return SCHEDULER_IDLE_MS;
+    }
+    ArduinoOTA.handle();
+    return OTA_POLL_INTERVAL_MS;
+  }, false);
+
+  scheduler.add("captive_portal", [](uint32_t now) -> uint32_t {
+    if (!apMode) {
+      return SCHEDULER_IDLE_MS;
+    }
+    dnsServer.processNextRequest();
+    return CAPTIVE_POLL_INTERVAL_MS;
+  }, false);
+
+  // Live log lines and owed status/OTA frames, paced by each client's queue
+  scheduler.add("ws", [](uint32_t now) -> uint32_t {
+    static uint32_t lastCleanup = 0;
+    if (now - lastCleanup >= WS_CLEANUP_INTERVAL_MS) {
+      ws.cleanupClients();
+      lastCleanup = now;
+    }
+    if (wsBroadcaster.flush()) {
+      return WS_FLUSH_RETRY_MS;
+    }
+    return WS_CLEANUP_INTERVAL_MS - (now - lastCleanup);
+  }, true);
+
+  // Ahead of its readers, so a change goes out in the pass that applied it
+  scheduler.add("state", [](uint32_t now) -> uint32_t {
+    return min(deviceState.run(), (uint32_t)SCHEDULER_IDLE_MS);
+  }, true);
+
+  scheduler.add("status_push", [](uint32_t now) -> uint32_t {
+    return handleStatusPush();
+  }, true);
+
+  scheduler.add("status_report", [](uint32_t now) -> uint32_t {
+    return handleStatusReporting();
+  }, true);
+
+  scheduler.add("mqtt", [](uint32_t now) -> uint32_t {
+    return mqtt.run(now);
+  }, true);
+
+  scheduler.add("udp", [](uint32_t now) -> uint32_t {
+    return udpChannel.run(now);
+  }, true);
+
+  scheduler.add("power", [](uint32_t now) -> uint32_t {
+    return powerManager.run(now);
+  }, true);
+
+  scheduler.add("history", [](uint32_t now) -> uint32_t {
+    return min(eventHistory.run(now), (uint32_t)SCHEDULER_IDLE_MS);
+  }, true);
+
+  // Settings staged by the API handlers, written once they stop changing
+  scheduler.add("config", [](uint32_t now) -> uint32_t {
+    return min(configStore.run(now), (uint32_t)SCHEDULER_IDLE_MS);
+  }, true);
+}
+
+// Cuts the loop's sleep short; call after changing state a "wake" task reacts to
+void wakeLoop() {
+  if (loopTaskHandle != nullptr) {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+void setupGPIO() {
   // Status LED (inverted - LOW = ON)
   pinMode(LED_PIN, OUTPUT);
-  delay(10);
   digitalWrite(LED_PIN, HIGH);  // OFF initially
-  delay(10);
-  yield();
+
+  for (size_t i = 0; i < doorChannels.size(); i++) {
+    const DoorChannel& channel = doorChannels[i];
+
+    // Contact sensor; the board's own has an external pull, added reed switches may not
+    pinMode(channel.contactPin, channel.pullup() ? INPUT_PULLUP : INPUT);
+
+    // Relay (active high, pulse mode)
+    pinMode(channel.relayPin, OUTPUT);
+    digitalWrite(channel.relayPin, LOW);
+
+    if (!relays[i].begin(channel.relayPin, channel.pulseMs())) {
+      logf(LOG_ERROR, "Failed to create relay timer (%s)", channel.name);
+    }
+
+    // Keep the pins as configured through light sleep (power profile low_power)
+    gpio_sleep_sel_dis((gpio_num_t)channel.contactPin);
+    gpio_sleep_sel_dis((gpio_num_t)channel.relayPin);
+  }
 
   // Button (internal pullup)
   pinMode(BUTTON_PIN, INPUT_PULLUP);
-  delay(10);
-  yield();
 
-  logMessage("INFO", "GPIO initialized");
+  for (gpio_num_t pin : {(gpio_num_t)BUTTON_PIN, (gpio_num_t)LED_PIN}) {
+    gpio_sleep_sel_dis(pin);
+  }
+
+  // Contact and button edges are handled by interrupts from here on
+  inputMonitor.begin();
+
+  logf(LOG_INFO, "GPIO initialized");
+}
+
+// Preferences keys per door channel; ConfigStore keeps the pointers
+static const char* const DOOR_CHANNEL_KEYS[DOOR_MAX_CHANNELS] = {"door0", "door1", "door2", "door3"};
+static const char* const DOOR_NAME_KEYS[DOOR_MAX_CHANNELS] = {"door0_name", "door1_name", "door2_name",
+                                                              "door3_name"};
+
+// Pins a door channel may not use: the SPI flash (GPIO11-17), the LED and
+// the button. Relays also stay off the strapping pins (GPIO2/8/9, sampled at
+// reset) and USB/UART0 (GPIO18-21), which leaves GPIO0, 1, 5, 6, 7 and 10;
+// contacts may use any pin left over.
+bool validateDoorChannels(const DoorChannelTable& table, const char*& error) {
+  static const uint8_t reserved[] = {11, 12, 13, 14, 15, 16, 17, LED_PIN, BUTTON_PIN};
+  static const uint8_t inputOnly[] = {2, 8, 9, 18, 19, 20, 21};
+  return table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error);
+}
+
+// The saved channel table, or the board's own door when none is saved or
+// the saved one is no longer valid
+void loadDoorChannels() {
+  doorChannels.clear();
+  uint8_t count = configStore.getUChar("door_count", 0);
+  for (uint8_t i = 0; i < count && i < DOOR_MAX_CHANNELS; i++) {
+    String name = configStore.getString(DOOR_NAME_KEYS[i], DEFAULT_DOOR_NAME);
+    doorChannels.addPacked(configStore.getUInt(DOOR_CHANNEL_KEYS[i], 0), name.c_str());
+  }
+
+  const char* error = "";
+  if (count == 0 || !validateDoorChannels(doorChannels, error)) {
+    if (count > 0) {
+      logf(LOG_WARN, "Saved door channels rejected (%s), using the built-in door", error);
+    }
+    doorChannels.clear();
+    doorChannels.add(CONTACT_PIN, RELAY_PIN, DEFAULT_DOOR_FLAGS, RELAY_PULSE_TIME, DEFAULT_DOOR_NAME);
+  }
+  for (size_t i = 0; i < doorChannels.size(); i++) {
+    const DoorChannel& channel = doorChannels[i];
+    logf(LOG_INFO, "Door %u \"%s\": contact GPIO%u, relay GPIO%u, %lu ms pulse", (unsigned)i, channel.name,
+         (unsigned)channel.contactPin, (unsigned)channel.relayPin, (unsigned long)channel.pulseMs());
+  }
+}
+
+// Takes effect at the next boot; the caller restarts
+void saveDoorChannels(const DoorChannelTable& table) {
+  configStore.putUChar("door_count", table.size());
+  for (size_t i = 0; i < DOOR_MAX_CHANNELS; i++) {
+    if (i < table.size()) {
+      configStore.putUInt(DOOR_CHANNEL_KEYS[i], packDoorChannel(table[i]));
+      configStore.putString(DOOR_NAME_KEYS[i], table[i].name);
+    } else {
+      configStore.remove(DOOR_CHANNEL_KEYS[i]);
+      configStore.remove(DOOR_NAME_KEYS[i]);
+    }
+  }
 }
 
 void loadConfiguration() {
-  wifiSSID = preferences.getString("ssid", "");
-  wifiPassword = preferences.getString("password", "");
+  wifiSSID = configStore.getString("ssid", "");
+  wifiPassword = configStore.getString("password", "");
+  loadDoorChannels();
+  for (RelayController& relay : relays) {
+    relay.setMinGap(configStore.getUInt("relay_gap", DEFAULT_RELAY_GAP_MS));
+  }
 
-  logMessage("INFO", "Configuration loaded");
+  logf(LOG_INFO, "Configuration loaded");
   if (wifiSSID.length() > 0) {
-    // Build message without concatenation
-    char ssidMsg[128];
-    snprintf(ssidMsg, sizeof(ssidMsg), "Saved SSID: %s", wifiSSID.c_str());
-    logMessage("INFO", ssidMsg);
+    logf(LOG_INFO, "Saved SSID: %s", wifiSSID.c_str());
   } else {
-    logMessage("WARN", "No WiFi credentials saved");
+    logf(LOG_WARN, "No WiFi credentials saved");
   }
 }
 
 void saveConfiguration() {
-  preferences.putString("ssid", wifiSSID);
-  preferences.putString("password", wifiPassword);
-  logMessage("INFO", "Configuration saved");
+  configStore.putString("ssid", wifiSSID);
+  configStore.putString("password", wifiPassword);
+  logf(LOG_INFO, "Configuration saved");
 }
 
-void setupWiFi() {
+// Starts the station connection and returns at once. handleWiFi() blinks
+// the LED while it runs and falls back to AP mode after the timeouts.
+void startWiFi() {
   // Load device name from preferences for hostname
-  String savedDeviceName = preferences.getString("reg_name", "Garage-Door");
+  String savedDeviceName = configStore.getString("reg_name", "Garage-Door");
   
   // Sanitize device name for hostname (remove spaces and special chars)
   String sanitizedHostname = savedDeviceName;
@@ -559,50 +4232,238 @@ void setupWiFi() {
   WiFi.mode(WIFI_STA);
   WiFi.setHostname(sanitizedHostname.c_str());
 
-  if (wifiSSID.length() > 0) {
-    char connectMsg[128];
-    snprintf(connectMsg, sizeof(connectMsg), "Connecting to WiFi: %s", wifiSSID.c_str());
-    logMessage("INFO", connectMsg);
-
-    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
-
-    // Try to connect for 10 seconds (reduced from 20)
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      yield();
-      feedWatchdog();
-      Serial.print(".");
-      digitalWrite(LED_PIN, !digitalRead(LED_PIN));  // Blink LED
-      attempts++;
-    }
-    Serial.println();
-
-    if (WiFi.status() == WL_CONNECTED) {
-      logMessage("INFO", "WiFi connected!");
-      // Build messages without concatenation
-      char ipMsg[64];
-      IPAddress ip = WiFi.localIP();
-      snprintf(ipMsg, sizeof(ipMsg), "IP: %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-      logMessage("INFO", ipMsg);
-      
-      char rssiMsg[64];
-      snprintf(rssiMsg, sizeof(rssiMsg), "Signal: %d dBm", WiFi.RSSI());
-      logMessage("INFO", rssiMsg);
-      digitalWrite(LED_PIN, HIGH);  // LED OFF (inverted)
-      apMode = false;
-      
-      // Init time
-      configTzTime(TIMEZONE, NTP_SERVER);
-      
-      return;
-    } else {
-      logMessage("ERROR", "WiFi connection failed");
-    }
+  if (wifiSSID.length() == 0) {
+    startAccessPoint();
+    return;
+  }
+
+  WiFi.setAutoReconnect(false);  // Retries are paced by handleWiFi()
+  WiFi.onEvent(onWiFiEvent);
+  wifiConnectStartTime = millis();
+  beginStationConnect(true);
+}
+
+// Runs on the WiFi event task: note what happened and let handleWiFi() act
+void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      wifiGotIp.store(true);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      // Our own disconnect() ahead of a retry or a mode change
+      if (info.wifi_sta_disconnected.reason == WIFI_REASON_ASSOC_LEAVE) {
+        return;
+      }
+      wifiDisconnectReason.store(info.wifi_sta_disconnected.reason);
+      wifiDisconnected.store(true);
+      break;
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+      wifiDisconnectReason.store(0);
+      wifiDisconnected.store(true);
+      break;
+    default:
+      return;
+  }
+  wakeLoop();
+}
+
+// Fast: associate straight to the cached BSSID on its channel, which skips
+// the all-channel scan. Otherwise a normal scan-and-connect.
+void beginStationConnect(bool fast) {
+  // Keep the setup AP alive while the station retries
+  if (apMode && WiFi.getMode() != WIFI_AP_STA) {
+    WiFi.mode(WIFI_AP_STA);
+  }
+  applyStaticIp();
+
+  WiFiCache cache;
+  if (fast && loadWiFiCache(cache)) {
+    logf(LOG_INFO, "Connecting to WiFi: %s (cached %02X:%02X:%02X:%02X:%02X:%02X, channel %u)",
+         wifiSSID.c_str(), cache.bssid[0], cache.bssid[1], cache.bssid[2],
+         cache.bssid[3], cache.bssid[4], cache.bssid[5], cache.channel);
+    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str(), cache.channel, cache.bssid, false);
+    linkState = LINK_FAST_CONNECT;
+  } else {
+    logf(LOG_INFO, "Connecting to WiFi: %s", wifiSSID.c_str());
+    WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str(), 0, nullptr, false);
+    linkState = LINK_CONNECTING;
+  }
+  powerManager.applyListenInterval();
+  esp_wifi_connect();
+  wifiAttemptStartTime = millis();
+}
+
+bool loadWiFiCache(WiFiCache& cache) {
+  cache.channel = preferences.getUChar("wifi_chan", 0);
+  return cache.channel != 0 &&
+         preferences.getBytes("wifi_bssid", cache.bssid, sizeof(cache.bssid)) == sizeof(cache.bssid);
+}
+
+// Remembers the current association; only writes flash when it changed
+void saveWiFiCache() {
+  uint8_t* bssid = WiFi.BSSID();
+  uint8_t channel = (uint8_t)WiFi.channel();
+  if (bssid == nullptr || channel == 0) {
+    return;
+  }
+  WiFiCache cached;
+  if (loadWiFiCache(cached) && cached.channel == channel && memcmp(cached.bssid, bssid, 6) == 0) {
+    return;
+  }
+  preferences.putBytes("wifi_bssid", bssid, 6);
+  preferences.putUChar("wifi_chan", channel);
+}
+
+// Optional static address (set via /api/config); skips DHCP on every connect
+void applyStaticIp() {
+  IPAddress ip;
+  IPAddress gateway;
+  IPAddress subnet;
+  IPAddress dns;
+  if (!ip.fromString(configStore.getString("static_ip", "")) ||
+      !gateway.fromString(configStore.getString("static_gw", "")) ||
+      !subnet.fromString(configStore.getString("static_mask", "255.255.255.0"))) {
+    return;
+  }
+  if (!dns.fromString(configStore.getString("static_dns", ""))) {
+    dns = gateway;
+  }
+  if (WiFi.config(ip, gateway, subnet, dns)) {
+    logf(LOG_DEBUG, "Using static IP %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  } else {
+    logf(LOG_WARN, "Failed to apply static IP, using DHCP");
+  }
+}
+
+// "wifi" scheduler task: drives the station link. Each round tries the
+// cached access point, then a scan. A failed round on first boot opens the
+// setup AP; after that - and whenever an established link drops - rounds
+// repeat with exponential backoff and jitter until the link is back.
+uint32_t handleWiFi(uint32_t now) {
+  bool gotIp = wifiGotIp.load();
+  if (gotIp) {
+    wifiGotIp.store(false);
+  }
+  bool dropped = wifiDisconnected.load();
+  if (dropped) {
+    wifiDisconnected.store(false);
+  }
+
+  switch (linkState) {
+    case LINK_IDLE:
+      return SCHEDULER_IDLE_MS;
+
+    case LINK_ONLINE:
+      if (dropped) {
+        logf(LOG_WARN, "WiFi connection lost (reason %u)", (unsigned)wifiDisconnectReason.load());
+        metrics.wifiDisconnects++;
+        statusCache.invalidateStatic();
+        wifiConnectStartTime = now;
+        wifiBackoff.reset();
+        // A rebooted router usually comes back on the same BSSID and channel
+        beginStationConnect(true);
+        return WIFI_CONNECT_POLL_MS;
+      }
+      if (gotIp) {
+        statusCache.invalidateStatic();  // DHCP handed out a new address
+      }
+      return SCHEDULER_IDLE_MS;
+
+    case LINK_FAST_CONNECT:
+    case LINK_CONNECTING: {
+      if (gotIp || WiFi.status() == WL_CONNECTED) {
+        logf(LOG_INFO, "WiFi connected in %lu ms (%s)", now - wifiConnectStartTime,
+             linkState == LINK_FAST_CONNECT ? "cached BSSID" : "scan");
+        onStationConnected();
+        return SCHEDULER_IDLE_MS;
+      }
+      uint32_t timeout = linkState == LINK_FAST_CONNECT ? WIFI_FAST_CONNECT_TIMEOUT_MS : WIFI_CONNECT_TIMEOUT_MS;
+      if (dropped || now - wifiAttemptStartTime >= timeout) {
+        onConnectAttemptFailed(now);
+        return linkState == LINK_BACKOFF ? wifiRetryAt - now : WIFI_CONNECT_POLL_MS;
+      }
+      if (!apMode) {
+        digitalWrite(LED_PIN, (now / WIFI_BLINK_INTERVAL_MS) % 2 ? HIGH : LOW);  // Blink LED
+      }
+      return WIFI_CONNECT_POLL_MS;
+    }
+
+    case LINK_BACKOFF:
+      if ((int32_t)(now - wifiRetryAt) < 0) {
+        return wifiRetryAt - now;
+      }
+      beginStationConnect(true);
+      return WIFI_CONNECT_POLL_MS;
+  }
+  return SCHEDULER_IDLE_MS;
+}
+
+// A connect attempt timed out or was refused: cached access point -> scan ->
+// setup AP (first boot, or a long outage) -> backoff
+void onConnectAttemptFailed(uint32_t now) {
+  WiFi.disconnect();
+
+  if (linkState == LINK_FAST_CONNECT) {
+    logf(LOG_WARN, "Fast connect failed, scanning");
+    beginStationConnect(false);
+    return;
+  }
+
+  if (!apMode && (!everOnline || now - wifiConnectStartTime >= WIFI_AP_FALLBACK_MS)) {
+    logf(LOG_ERROR, "WiFi connection failed");
+    startAccessPoint();
+  }
+
+  uint32_t delayMs = wifiBackoff.next(esp_random());
+  wifiRetryAt = now + delayMs;
+  linkState = LINK_BACKOFF;
+  logf(LOG_INFO, "WiFi retry %lu in %lu ms", (unsigned long)wifiBackoff.getAttempts(), (unsigned long)delayMs);
+}
+
+// Station link is up (first boot, after an outage, or from AP mode): bring
+// up the services that need it. Registration runs on its own task.
+void onStationConnected() {
+  if (apMode) {
+    // Switch to STA mode (disable AP)
+    WiFi.mode(WIFI_STA);
+    dnsServer.stop();
+    apMode = false;
+  }
+
+  IPAddress ip = WiFi.localIP();
+  logf(LOG_INFO, "IP: %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  logf(LOG_INFO, "Signal: %d dBm", WiFi.RSSI());
+  digitalWrite(LED_PIN, HIGH);  // LED OFF (inverted)
+  linkState = LINK_ONLINE;
+  if (everOnline) {
+    metrics.wifiReconnects++;
+  }
+  everOnline = true;
+  wifiBackoff.reset();
+  saveWiFiCache();
+
+  if (startupMetrics.wifiConnectedMs == 0) {
+    startupMetrics.wifiConnectedMs = millis();
+    logf(LOG_INFO, "Startup: WiFi connected after %lu ms", (unsigned long)startupMetrics.wifiConnectedMs);
+  }
+  statusCache.invalidateStatic();
+
+  // Init time
+  configTzTime(TIMEZONE, NTP_SERVER);
+
+  setupOTA();
+
+  if (deviceRegistration == nullptr) {
+    logf(LOG_INFO, "Initializing device registration...");
+    deviceRegistration = new DeviceRegistration(&configStore);
+    deviceRegistration->begin();
+  } else {
+    deviceRegistration->requestRegistration();
   }
+}
 
-  // Start AP mode
-  logMessage("INFO", "Starting AP mode...");
+void startAccessPoint() {
+  logf(LOG_INFO, "Starting AP mode...");
   
   // Ensure we are disconnected from any previous STA connection attempt
   WiFi.disconnect(); 
@@ -619,24 +4480,18 @@ void setupWiFi() {
   String dynamicSSID = "HarryGarage-" + mac.substring(mac.length() - 6); // Last 6 chars
 
   if (WiFi.softAP(dynamicSSID.c_str(), AP_PASSWORD)) {
-    logMessage("INFO", "AP Started successfully");
+    logf(LOG_INFO, "AP Started successfully");
   } else {
-    logMessage("ERROR", "AP Start Failed");
+    logf(LOG_ERROR, "AP Start Failed");
   }
   
   delay(500);  // Wait for AP to stabilize
   yield();
   feedWatchdog();
 
-  // Build messages without concatenation
-  char apIpMsg[64];
   IPAddress apIp = WiFi.softAPIP();
-  snprintf(apIpMsg, sizeof(apIpMsg), "AP IP: %d.%d.%d.%d", apIp[0], apIp[1], apIp[2], apIp[3]);
-  logMessage("INFO", apIpMsg);
-  
-  char ssidMsg[128];
-  snprintf(ssidMsg, sizeof(ssidMsg), "AP SSID: %s", dynamicSSID.c_str());
-  logMessage("INFO", ssidMsg);
+  logf(LOG_INFO, "AP IP: %d.%d.%d.%d", apIp[0], apIp[1], apIp[2], apIp[3]);
+  logf(LOG_INFO, "AP SSID: %s", dynamicSSID.c_str());
 
   // Start DNS server for captive portal
   dnsServer.start(53, "*", WiFi.softAPIP());
@@ -645,1193 +4500,729 @@ void setupWiFi() {
   feedWatchdog();
 
   apMode = true;
+  statusCache.invalidateStatic();
   digitalWrite(LED_PIN, LOW);  // LED ON (inverted) to indicate AP mode
-  logMessage("INFO", "AP mode ready");
+  logf(LOG_INFO, "AP mode ready");
 }
 
+// Called on every (re)connect. The first call installs the handlers; later
+// ones restart ArduinoOTA so its mDNS record and listener follow the new link.
 void setupOTA() {
+  static bool otaStarted = false;
   if (apMode) {
-    logMessage("INFO", "OTA disabled in AP mode");
+    logf(LOG_INFO, "OTA disabled in AP mode");
     return;
   }
+  if (otaStarted) {
+    ArduinoOTA.end();
+    ArduinoOTA.begin();
+    return;
+  }
+  otaStarted = true;
 
   // Use WiFi hostname for OTA
   ArduinoOTA.setHostname(WiFi.getHostname());
 
   ArduinoOTA.onStart([]() {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH) {
-      type = "sketch";
-    } else {
-      type = "filesystem";
-    }
-    logMessage("INFO", "OTA Update Start: " + type);
+    const char* type = ArduinoOTA.getCommand() == U_FLASH ? "sketch" : "filesystem";
+    logf(LOG_INFO, "OTA Update Start: %s", type);
+    broadcastOtaProgress("start", 0, 0, nullptr);
   });
 
   ArduinoOTA.onEnd([]() {
-    logMessage("INFO", "OTA Update Complete");
+    logf(LOG_INFO, "OTA Update Complete");
+    prepareForRestart();   // ArduinoOTA restarts on its own
+    broadcastOtaProgress("success", 0, 0, nullptr);
   });
 
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
     static unsigned int lastPercent = 0;
     unsigned int percent = (progress / (total / 100));
-    if (percent != lastPercent && percent % 10 == 0) {
-      logMessage("INFO", "OTA Progress: " + String(percent) + "%");
+    if (percent != lastPercent && percent % OTA_PROGRESS_STEP_PERCENT == 0) {
+      if (percent % 10 == 0) {
+        logf(LOG_INFO, "OTA Progress: %u%%", percent);
+      }
+      broadcastOtaProgress("progress", progress, total, nullptr);
       lastPercent = percent;
     }
   });
 
   ArduinoOTA.onError([](ota_error_t error) {
-    String errorMsg = "OTA Error[" + String(error) + "]: ";
-    if (error == OTA_AUTH_ERROR) errorMsg += "Auth Failed";
-    else if (error == OTA_BEGIN_ERROR) errorMsg += "Begin Failed";
-    else if (error == OTA_CONNECT_ERROR) errorMsg += "Connect Failed";
-    else if (error == OTA_RECEIVE_ERROR) errorMsg += "Receive Failed";
-    else if (error == OTA_END_ERROR) errorMsg += "End Failed";
-    logMessage("ERROR", errorMsg);
+    const char* reason = "";
+    if (error == OTA_AUTH_ERROR) reason = "Auth Failed";
+    else if (error == OTA_BEGIN_ERROR) reason = "Begin Failed";
+    else if (error == OTA_CONNECT_ERROR) reason = "Connect Failed";
+    else if (error == OTA_RECEIVE_ERROR) reason = "Receive Failed";
+    else if (error == OTA_END_ERROR) reason = "End Failed";
+    logf(LOG_ERROR, "OTA Error[%u]: %s", (unsigned)error, reason);
+    broadcastOtaProgress("error", 0, 0, reason);
   });
 
   ArduinoOTA.begin();
-  logMessage("INFO", "ArduinoOTA ready");
+  logf(LOG_INFO, "ArduinoOTA ready");
 }
 
-void setupWebServer() {
-  // WebSocket event handler
-  ws.onEvent(onWsEvent);
-  server.addHandler(&ws);
+// Prometheus histogram series; labels is either "" or 'name="value",'
+void printHistogram(Print& out, const char* name, const char* labels, const LatencyHistogram& histogram) {
+  uint32_t cumulative = 0;
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+    cumulative += histogram.bucketCount(i);
+    out.printf("%s_bucket{%sle=\"%g\"} %u\n", name, labels,
+               LatencyHistogram::bound(i) / 1e6, (unsigned)cumulative);
+  }
+  cumulative += histogram.bucketCount(LatencyHistogram::BUCKETS);
+  out.printf("%s_bucket{%sle=\"+Inf\"} %u\n", name, labels, (unsigned)cumulative);
+
+  // Strip the trailing comma for the plain series
+  size_t labelsLength = strlen(labels);
+  int shown = labelsLength > 0 ? (int)labelsLength - 1 : 0;
+  const char* open = labelsLength > 0 ? "{" : "";
+  const char* close = labelsLength > 0 ? "}" : "";
+  out.printf("%s_sum%s%.*s%s %.6f\n", name, open, shown, labels, close, histogram.getSumUs() / 1e6);
+  out.printf("%s_count%s%.*s%s %u\n", name, open, shown, labels, close, (unsigned)histogram.getCount());
+}
 
-  // Serve root page with enhanced UI
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String html = R"rawliteral(
-<!DOCTYPE html>
-<html>
-<head>
-    <meta charset="UTF-8">
-    <meta name="viewport" content="width=device-width, initial-scale=1.0">
-    <title>Garage Door Opener</title>
-    <style>
-        * { margin: 0; padding: 0; box-sizing: border-box; }
-        body {
-            font-family: -apple-system, BlinkMacSystemFont, "Segoe UI", Roboto, "Helvetica Neue", Arial, sans-serif;
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            min-height: 100vh;
-            padding: 20px;
-        }
-        .container {
-            background: white;
-            border-radius: 20px;
-            box-shadow: 0 20px 60px rgba(0,0,0,0.3);
-            padding: 0;
-            max-width: 800px;
-            margin: 0 auto;
-            overflow: hidden;
-        }
-        .header {
-            padding: 30px 40px;
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            color: white;
-        }
-        h1 {
-            font-size: 28px;
-            margin-bottom: 5px;
-        }
-        .subtitle {
-            opacity: 0.9;
-            font-size: 14px;
-        }
-        .tabs {
-            display: flex;
-            background: #f8f9fa;
-            border-bottom: 2px solid #dee2e6;
-        }
-        .tab {
-            flex: 1;
-            padding: 15px;
-            text-align: center;
-            cursor: pointer;
-            font-weight: 600;
-            color: #666;
-            transition: all 0.3s;
-            border: none;
-            background: none;
-        }
-        .tab:hover {
-            background: #e9ecef;
-        }
-        .tab.active {
-            color: #667eea;
-            border-bottom: 3px solid #667eea;
-            margin-bottom: -2px;
-        }
-        .tab-content {
-            display: none;
-            padding: 30px 40px;
-        }
-        .tab-content.active {
-            display: block;
-        }
-        .status-card {
-            background: #f8f9fa;
-            border-radius: 15px;
-            padding: 25px;
-            margin-bottom: 25px;
-            text-align: center;
-        }
-        .door-status {
-            font-size: 96px;
-            margin-bottom: 10px;
-            transition: transform 0.3s ease;
-        }
-        .status-text {
-            font-size: 48px;
-            font-weight: 600;
-            margin-bottom: 5px;
-            transition: all 0.3s ease;
-        }
-        .status-open { color: #e74c3c; }
-        .status-closed { color: #27ae60; }
-        .status-transitioning {
-            animation: pulse 1.5s ease-in-out infinite;
-        }
-        .status-text-transitioning {
-            animation: colorPulse 1.5s ease-in-out infinite;
-        }
-        @keyframes pulse {
-            0%, 100% {
-                transform: scale(1);
-                opacity: 1;
-            }
-            50% {
-                transform: scale(1.2);
-                opacity: 0.8;
-            }
-        }
-        @keyframes colorPulse {
-            0%, 100% {
-                opacity: 1;
-                transform: scale(1);
-            }
-            50% {
-                opacity: 0.7;
-                transform: scale(1.05);
-            }
-        }
-        .info-grid {
-            display: grid;
-            grid-template-columns: repeat(auto-fit, minmax(200px, 1fr));
-            gap: 15px;
-            margin-bottom: 25px;
-        }
-        .info-item {
-            background: #f8f9fa;
-            padding: 15px;
-            border-radius: 10px;
-        }
-        .info-label {
-            color: #666;
-            font-size: 12px;
-            margin-bottom: 5px;
-        }
-        .info-value {
-            color: #333;
-            font-weight: 600;
-            font-size: 16px;
-        }
-        .btn {
-            width: 100%;
-            padding: 15px;
-            border: none;
-            border-radius: 10px;
-            font-size: 16px;
-            font-weight: 600;
-            cursor: pointer;
-            transition: all 0.3s;
-            margin-bottom: 10px;
-        }
-        .btn-primary {
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            color: white;
-        }
-        .btn-primary:hover:not(:disabled) {
-            transform: translateY(-2px);
-            box-shadow: 0 5px 20px rgba(102, 126, 234, 0.4);
-        }
-        .btn-secondary {
-            background: #6c757d;
-            color: white;
-        }
-        .btn-secondary:hover {
-            background: #5a6268;
-        }
-        .btn-danger {
-            background: #dc3545;
-            color: white;
-        }
-        .btn-danger:hover {
-            background: #c82333;
-        }
-        .btn:disabled {
-            opacity: 0.6;
-            cursor: not-allowed;
-        }
-        #triggerBtn {
-            font-size: 32px;
-            padding: 25px;
-        }
-        .wifi-config {
-            display: none;
-            margin-top: 20px;
-        }
-        .wifi-config.show {
-            display: block;
-        }
-        .form-group {
-            margin-bottom: 20px;
-        }
-        .form-group label {
-            display: block;
-            margin-bottom: 8px;
-            color: #333;
-            font-weight: 600;
-            font-size: 14px;
-        }
-        .form-group input,
-        .form-group textarea {
-            width: 100%;
-            padding: 12px;
-            border: 2px solid #e0e0e0;
-            border-radius: 8px;
-            font-size: 14px;
-            transition: border-color 0.3s;
-            font-family: inherit;
-        }
-        .form-group input:focus,
-        .form-group textarea:focus {
-            outline: none;
-            border-color: #667eea;
-        }
-        .form-group textarea {
-            resize: vertical;
-            min-height: 80px;
-        }
-        .message {
-            padding: 12px;
-            border-radius: 8px;
-            margin-bottom: 15px;
-            display: none;
-        }
-        .message.show {
-            display: block;
-        }
-        .message.success {
-            background: #d4edda;
-            color: #155724;
-            border: 1px solid #c3e6cb;
-        }
-        .message.error {
-            background: #f8d7da;
-            color: #721c24;
-            border: 1px solid #f5c6cb;
-        }
-        .status-box {
-            padding: 15px;
-            border-radius: 8px;
-            margin-bottom: 20px;
-            font-size: 14px;
-        }
-        .status-success {
-            background: #d4edda;
-            color: #155724;
-            border: 1px solid #c3e6cb;
-        }
-        .status-error {
-            background: #f8d7da;
-            color: #721c24;
-            border: 1px solid #f5c6cb;
-        }
-        .status-info {
-            background: #d1ecf1;
-            color: #0c5460;
-            border: 1px solid #bee5eb;
-        }
-        .btn-warning {
-            background: #ffc107;
-            color: #333;
-        }
-        .btn-warning:hover {
-            background: #e0a800;
-        }
-        .btn-success {
-            background: #28a745;
-            color: white;
-        }
-        .btn-success:hover {
-            background: #218838;
-        }
-        .helper-text {
-            font-size: 12px;
-            color: #6c757d;
-            margin-top: 5px;
-        }
-        h3 {
-            color: #333;
-            margin-bottom: 15px;
-            font-size: 18px;
-        }
-        .log-container {
-            background: #1e1e1e;
-            border-radius: 10px;
-            padding: 15px;
-            height: 400px;
-            overflow-y: auto;
-            font-family: 'Courier New', monospace;
-            font-size: 12px;
-        }
-        .log-entry {
-            margin-bottom: 5px;
-            word-wrap: break-word;
-        }
-        .log-timestamp {
-            color: #888;
-            margin-right: 10px;
-        }
-        .log-level {
-            font-weight: bold;
-            margin-right: 10px;
-        }
-        .log-level-INFO { color: #4CAF50; }
-        .log-level-WARN { color: #FF9800; }
-        .log-level-ERROR { color: #f44336; }
-        .log-level-DEBUG { color: #2196F3; }
-        .log-message {
-            color: #e0e0e0;
-        }
-        .log-controls {
-            margin-bottom: 15px;
-            display: flex;
-            gap: 10px;
-        }
-        .log-controls button {
-            flex: 1;
-        }
-        .upload-area {
-            border: 2px dashed #667eea;
-            border-radius: 10px;
-            padding: 40px;
-            text-align: center;
-            cursor: pointer;
-            transition: all 0.3s;
-            margin-bottom: 20px;
-        }
-        .upload-area:hover {
-            background: #f8f9fa;
-        }
-        .upload-area.dragover {
-            background: #e7e9fd;
-            border-color: #764ba2;
-        }
-        .file-input {
-            display: none;
-        }
-        .progress-bar {
-            width: 100%;
-            height: 30px;
-            background: #e0e0e0;
-            border-radius: 15px;
-            overflow: hidden;
-            margin-top: 20px;
-            display: none;
-        }
-        .progress-fill {
-            height: 100%;
-            background: linear-gradient(135deg, #667eea 0%, #764ba2 100%);
-            width: 0%;
-            transition: width 0.3s;
-            display: flex;
-            align-items: center;
-            justify-content: center;
-            color: white;
-            font-weight: bold;
-            font-size: 14px;
-        }
-    </style>
-</head>
-<body>
-    <div class="container">
-        <div class="header">
-            <h1>🚪 Garage Door Opener</h1>
-        </div>
-
-        <div class="tabs">
-            <button class="tab active" onclick="switchTab('control')">Control</button>
-            <button class="tab" onclick="switchTab('logs')">Logs</button>
-            <button class="tab" onclick="switchTab('ota')">OTA Update</button>
-            <button class="tab" onclick="switchTab('settings')">Settings</button>
-            <button class="tab" onclick="switchTab('registration')">Device Registration</button>
-        </div>
-
-        <!-- Control Tab -->
-        <div id="control-tab" class="tab-content active">
-            <div id="message" class="message"></div>
-
-            <div class="status-card">
-                <div class="door-status" id="doorIcon">🚪</div>
-                <div class="status-text" id="doorStatus">Loading...</div>
-                <div class="info-label" id="lastUpdate">Checking status...</div>
-            </div>
-
-            <button id="triggerBtn" class="btn btn-primary" onclick="triggerDoor()">Trigger Door</button>
-
-            <div class="info-grid">
-                <div class="info-item">
-                    <div class="info-label">WiFi Status</div>
-                    <div class="info-value" id="wifiStatus">Loading...</div>
-                </div>
-                <div class="info-item">
-                    <div class="info-label">IP Address</div>
-                    <div class="info-value" id="ipAddress">Loading...</div>
-                </div>
-                <div class="info-item">
-                    <div class="info-label">Signal Strength</div>
-                    <div class="info-value" id="rssi">Loading...</div>
-                </div>
-                <div class="info-item">
-                    <div class="info-label">Uptime</div>
-                    <div class="info-value" id="uptime">Loading...</div>
-                </div>
-            </div>
-        </div>
-
-        <!-- Logs Tab -->
-        <div id="logs-tab" class="tab-content">
-            <div class="log-controls">
-                <button class="btn btn-secondary" onclick="clearLogs()">Clear Display</button>
-                <button class="btn btn-secondary" onclick="downloadLogs()">Download Logs</button>
-            </div>
-            <div class="log-container" id="logContainer">
-                <div class="log-entry">
-                    <span class="log-timestamp">--:--:--</span>
-                    <span class="log-level log-level-INFO">INFO</span>
-                    <span class="log-message">Connecting to log stream...</span>
-                </div>
-            </div>
-        </div>
-
-        <!-- OTA Update Tab -->
-        <div id="ota-tab" class="tab-content">
-            <div id="ota-message" class="message"></div>
-
-            <div class="upload-area" id="uploadArea" onclick="document.getElementById('firmwareFile').click()">
-                <div style="font-size: 48px; margin-bottom: 15px;">📦</div>
-                <div style="font-size: 18px; font-weight: 600; margin-bottom: 10px;">Upload Firmware</div>
-                <div style="color: #666;">Click to select or drag and drop .bin file</div>
-                <input type="file" id="firmwareFile" class="file-input" accept=".bin" onchange="uploadFirmware(this.files[0])">
-            </div>
-
-            <div class="progress-bar" id="progressBar">
-                <div class="progress-fill" id="progressFill">0%</div>
-            </div>
-
-            <div style="background: #fff3cd; padding: 15px; border-radius: 10px; border-left: 4px solid #ffc107; margin-top: 20px;">
-                <strong>⚠️ Warning:</strong> Device will restart after successful upload. Make sure you have the correct firmware file (.bin).
-            </div>
-        </div>
-
-        <!-- Settings Tab -->
-        <div id="settings-tab" class="tab-content">
-            <div id="settings-message" class="message"></div>
-
-            <button class="btn btn-secondary" onclick="toggleWifiConfig()">Configure WiFi</button>
-
-            <div id="wifiConfig" class="wifi-config">
-                <div class="form-group">
-                    <label>WiFi Network (SSID)</label>
-                    <input type="text" id="ssid" placeholder="Enter WiFi network name">
-                </div>
-                <div class="form-group">
-                    <label>WiFi Password</label>
-                    <input type="password" id="password" placeholder="Enter WiFi password">
-                </div>
-                <button class="btn btn-primary" onclick="saveWifi()">Save & Restart</button>
-                <button class="btn btn-secondary" onclick="toggleWifiConfig()">Cancel</button>
-            </div>
-
-            <button class="btn btn-danger" onclick="restart()" style="margin-top: 20px;">Restart Device</button>
-        </div>
-
-        <!-- Device Registration Tab -->
-        <div id="registration-tab" class="tab-content">
-            <div id="registration-message" class="message"></div>
-
-            <div class="status-card">
-                <h3 style="margin-bottom: 15px;">Registration Status</h3>
-                <div id="registrationStatusBox" class="status-box status-info">
-                    Loading registration status...
-                </div>
-                <button class="btn btn-warning" onclick="forceRegister()" style="background: #ffc107; color: #333;">Register Now</button>
-            </div>
-
-            <div class="status-card">
-                <h3 style="margin-bottom: 15px;">Registration Settings</h3>
-                <form id="registrationForm">
-                    <div class="checkbox-wrapper" style="display: flex; align-items: center; margin-bottom: 20px;">
-                        <input type="checkbox" id="regEnabled" checked style="width: 18px; height: 18px; margin-right: 10px;">
-                        <label for="regEnabled" style="font-weight: 600; cursor: pointer;">Enable automatic registration</label>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="regServerUrl">Control Server URL</label>
-                        <input type="text" id="regServerUrl" placeholder="http://192.168.1.225:3000" required>
-                        <div class="helper-text">URL of your control server (including http:// or https://)</div>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="regDeviceName">Device Name</label>
-                        <input type="text" id="regDeviceName" placeholder="Garage-Door" required>
-                        <div class="helper-text">Friendly name for this device</div>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="regDeviceType">Device Type</label>
-                        <input type="text" id="regDeviceType" placeholder="esp32_garage_door" required>
-                        <div class="helper-text">Device type identifier</div>
-                    </div>
-
-                    <div class="form-group">
-                        <label for="regDeviceDescription">Description</label>
-                        <textarea id="regDeviceDescription" placeholder="ESP32-C3 Garage Door Opener"></textarea>
-                        <div class="helper-text">Optional description of this device</div>
-                    </div>
-
-                    <button type="submit" class="btn btn-success" style="background: #28a745; color: white;">Save Settings</button>
-                </form>
-            </div>
-
-            <div class="status-card">
-                <h3 style="margin-bottom: 15px;">Current Device Information</h3>
-                <div class="info-grid">
-                    <div class="info-label">IP Address:</div>
-                    <div class="info-value" id="regDeviceIp">-</div>
-                    <div class="info-label">MAC Address:</div>
-                    <div class="info-value" id="regDeviceMac">-</div>
-                    <div class="info-label">Hostname:</div>
-                    <div class="info-value" id="regDeviceHostname">-</div>
-                </div>
-            </div>
-        </div>
-    </div>
-
-    <script>
-        let statusInterval;
-        let ws;
-        let logs = [];
-
-        // WebSocket for real-time logs
-        function connectWebSocket() {
-            const protocol = window.location.protocol === 'https:' ? 'wss:' : 'ws:';
-            ws = new WebSocket(protocol + '//' + window.location.host + '/ws');
-
-            ws.onopen = function() {
-                console.log('WebSocket connected');
-                addLogEntry('INFO', 'WebSocket connected', getCurrentTime());
-            };
-
-            ws.onmessage = function(event) {
-                try {
-                    const data = JSON.parse(event.data);
-                    if (data.type === 'log') {
-                        addLogEntry(data.level, data.message, data.timestamp);
-                    } else if (data.type === 'status') {
-                        // Update status immediately when received via WebSocket
-                        updateStatus();
-                    }
-                } catch (e) {
-                    console.error('Error parsing WebSocket message:', e);
-                }
-            };
-
-            ws.onclose = function() {
-                console.log('WebSocket disconnected');
-                addLogEntry('WARN', 'WebSocket disconnected. Reconnecting...', getCurrentTime());
-                setTimeout(connectWebSocket, 3000);
-            };
-
-            ws.onerror = function(error) {
-                console.error('WebSocket error:', error);
-            };
-        }
+void printMetricHeader(Print& out, const char* name, const char* type, const char* help) {
+  out.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
 
-        function getCurrentTime() {
-            const now = new Date();
-            return now.toLocaleTimeString();
-        }
+void addHistogramJson(JsonObject parent, const char* key, const LatencyHistogram& histogram) {
+  JsonObject object = parent.createNestedObject(key);
+  object["count"] = histogram.getCount();
+  object["sum_us"] = histogram.getSumUs();
+  object["max_us"] = histogram.getMaxUs();
+  JsonArray buckets = object.createNestedArray("buckets");
+  for (size_t i = 0; i <= LatencyHistogram::BUCKETS; i++) {
+    buckets.add(histogram.bucketCount(i));
+  }
+}
 
-        function addLogEntry(level, message, timestamp) {
-            logs.push({level, message, timestamp});
-            if (logs.length > 200) {
-                logs.shift();
-            }
+void sendMetricsJson(AsyncWebServerRequest *request) {
+  DynamicJsonDocument doc(4096);
+  JsonObject root = doc.to<JsonObject>();
+  root["uptime_ms"] = millis();
 
-            const container = document.getElementById('logContainer');
-            const entry = document.createElement('div');
-            entry.className = 'log-entry';
-            entry.innerHTML = `
-                <span class="log-timestamp">${timestamp}</span>
-                <span class="log-level log-level-${level}">${level}</span>
-                <span class="log-message">${message}</span>
-            `;
-            container.appendChild(entry);
-            container.scrollTop = container.scrollHeight;
-        }
+  JsonObject heap = root.createNestedObject("heap");
+  heap["free"] = ESP.getFreeHeap();
+  heap["min_free"] = ESP.getMinFreeHeap();
+  heap["largest_block"] = ESP.getMaxAllocHeap();
 
-        function clearLogs() {
-            document.getElementById('logContainer').innerHTML = '';
-            logs = [];
-        }
+  JsonArray bounds = root.createNestedArray("bucket_bounds_us");
+  for (size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+    bounds.add(LatencyHistogram::bound(i));
+  }
 
-        function downloadLogs() {
-            const logText = logs.map(log => `[${log.timestamp}] [${log.level}] ${log.message}`).join('\n');
-            const blob = new Blob([logText], { type: 'text/plain' });
-            const url = URL.createObjectURL(blob);
-            const a = document.createElement('a');
-            a.href = url;
-            a.download = 'garage-door-logs-' + new Date().toISOString() + '.txt';
-            a.click();
-            URL.revokeObjectURL(url);
-        }
+  addHistogramJson(root, "loop", metrics.loopBusy);
 
-        let registrationTabLoaded = false;
-        function switchTab(tabName) {
-            // Update tab buttons
-            document.querySelectorAll('.tab').forEach(tab => tab.classList.remove('active'));
-            event.target.classList.add('active');
-
-            // Update tab content
-            document.querySelectorAll('.tab-content').forEach(content => content.classList.remove('active'));
-            document.getElementById(tabName + '-tab').classList.add('active');
-            
-            // Load registration data if registration tab is shown
-            if (tabName === 'registration' && !registrationTabLoaded) {
-                loadRegistrationSettings();
-                loadDeviceInfo();
-                registrationTabLoaded = true;
-                // Refresh status every 30 seconds
-                setInterval(() => {
-                    if (document.getElementById('registration-tab').classList.contains('active')) {
-                        loadRegistrationSettings();
-                    }
-                }, 30000);
-            }
-        }
+  JsonObject http = root.createNestedObject("http");
+  addHistogramJson(http, "/", metrics.httpRoot);
+  addHistogramJson(http, "/api/status", metrics.httpStatus);
+  addHistogramJson(http, "/api/logs", metrics.httpLogs);
+  addHistogramJson(http, "/api/trigger", metrics.httpTrigger);
 
-        function showMessage(msg, isError = false, targetId = 'message') {
-            const msgEl = document.getElementById(targetId);
-            msgEl.textContent = msg;
-            msgEl.className = 'message show ' + (isError ? 'error' : 'success');
-            setTimeout(() => {
-                msgEl.className = 'message';
-            }, 5000);
-        }
+  addHistogramJson(root, "udp_trigger", metrics.udpTrigger);
+  root["udp_trigger"]["rejected"] = udpChannel.getRejected();
 
-        async function updateStatus() {
-            try {
-                const response = await fetch('/api/status');
-                const data = await response.json();
-
-                const isOpen = data.door_open;
-                const statusTransition = data.status_transition || "";
-                
-                const doorIcon = document.getElementById('doorIcon');
-                const doorStatus = document.getElementById('doorStatus');
-                
-                // Check if we're in transition status mode (from backend)
-                if (statusTransition && statusTransition.length > 0) {
-                    // Show temporary status with animation
-                    if (statusTransition === 'opening') {
-                        doorIcon.textContent = '🟡';
-                        doorIcon.className = 'door-status status-transitioning';
-                        doorStatus.textContent = 'OPENING';
-                        doorStatus.className = 'status-text status-open status-text-transitioning';
-                    } else if (statusTransition === 'closing') {
-                        doorIcon.textContent = '🟡';
-                        doorIcon.className = 'door-status status-transitioning';
-                        doorStatus.textContent = 'CLOSING';
-                        doorStatus.className = 'status-text status-closed status-text-transitioning';
-                    }
-                } else {
-                    // Show actual status (remove animations)
-                    doorIcon.textContent = isOpen ? '🟢' : '🔴';
-                    doorIcon.className = 'door-status';
-                    doorStatus.textContent = isOpen ? 'OPEN' : 'CLOSED';
-                    doorStatus.className = 'status-text ' + (isOpen ? 'status-open' : 'status-closed');
-                }
-                
-                document.getElementById('lastUpdate').textContent = 'Last update: ' + new Date().toLocaleTimeString();
-
-                document.getElementById('wifiStatus').textContent = data.wifi_connected ? 'Connected' : 'AP Mode';
-                document.getElementById('ipAddress').textContent = data.ip_address;
-                document.getElementById('rssi').textContent = data.wifi_connected ? data.rssi + ' dBm' : 'N/A';
-                document.getElementById('uptime').textContent = formatUptime(data.uptime);
-            } catch (error) {
-                console.error('Failed to update status:', error);
-            }
-        }
+  JsonObject buttonEdgeToRelay = root.createNestedObject("button_edge_to_relay");
+  for (uint8_t i = 0; i < POWER_PROFILE_COUNT; i++) {
+    addHistogramJson(buttonEdgeToRelay, PowerManager::profileName((PowerProfile)i), metrics.buttonEdgeToRelay[i]);
+  }
 
-        function formatUptime(seconds) {
-            const days = Math.floor(seconds / 86400);
-            const hours = Math.floor((seconds % 86400) / 3600);
-            const minutes = Math.floor((seconds % 3600) / 60);
-            const secs = seconds % 60;
+  addHistogramJson(root, "registration", metrics.registration);
+  root["registration"]["failures"] = metrics.registrationFailures;
+  addHistogramJson(root, "status_update", metrics.statusUpdate);
+  root["status_update"]["failures"] = metrics.statusUpdateFailures;
+
+  root["state_command_drops"] = deviceState.getDropped();
+  configStore.getStats(root.createNestedObject("config"));
+  eventHistory.getStats(root.createNestedObject("history"));
+
+  JsonObject websocket = root.createNestedObject("websocket");
+  websocket["clients"] = ws.count();
+  websocket["send_drops"] = metrics.wsSendDrops.load(std::memory_order_relaxed);
+  websocket["dropped_debug"] = wsBroadcaster.getDroppedDebug();
+  websocket["dropped_logs"] = wsBroadcaster.getDroppedLogs();
+  websocket["coalesced_status"] = wsBroadcaster.getCoalescedStatus();
+  websocket["coalesced_ota"] = wsBroadcaster.getCoalescedOta();
+
+  JsonObject wifi = root.createNestedObject("wifi");
+  wifi["reconnects"] = metrics.wifiReconnects;
+  wifi["disconnects"] = metrics.wifiDisconnects;
+  if (linkState == LINK_ONLINE) {
+    wifi["rssi"] = WiFi.RSSI();
+  }
 
-            if (days > 0) return `${days}d ${hours}h ${minutes}m`;
-            if (hours > 0) return `${hours}h ${minutes}m ${secs}s`;
-            if (minutes > 0) return `${minutes}m ${secs}s`;
-            return `${secs}s`;
-        }
+  String json;
+  serializeJson(doc, json);
+  request->send(200, "application/json", json);
+}
 
-        async function triggerDoor() {
-            try {
-                const response = await fetch('/api/trigger', { method: 'POST' });
-                const data = await response.json();
-                
-                // Update display immediately to show transition status
-                updateStatus();
-            } catch (error) {
-                showMessage('Failed to trigger door', true);
-            }
-        }
+void sendMetricsPrometheus(AsyncWebServerRequest *request) {
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+
+  printMetricHeader(*response, "garage_uptime_seconds", "gauge", "Time since boot");
+  response->printf("garage_uptime_seconds %u\n", (unsigned)(millis() / 1000));
+
+  printMetricHeader(*response, "garage_heap_free_bytes", "gauge", "Free heap");
+  response->printf("garage_heap_free_bytes %u\n", (unsigned)ESP.getFreeHeap());
+  printMetricHeader(*response, "garage_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+  response->printf("garage_heap_min_free_bytes %u\n", (unsigned)ESP.getMinFreeHeap());
+  printMetricHeader(*response, "garage_heap_largest_free_block_bytes", "gauge", "Largest allocatable block");
+  response->printf("garage_heap_largest_free_block_bytes %u\n", (unsigned)ESP.getMaxAllocHeap());
+
+  printMetricHeader(*response, "garage_loop_busy_seconds", "histogram", "Work done per loop() iteration");
+  printHistogram(*response, "garage_loop_busy_seconds", "", metrics.loopBusy);
+
+  printMetricHeader(*response, "garage_http_request_duration_seconds", "histogram", "HTTP request start to response fully sent");
+  printHistogram(*response, "garage_http_request_duration_seconds", "handler=\"/\",", metrics.httpRoot);
+  printHistogram(*response, "garage_http_request_duration_seconds", "handler=\"/api/status\",", metrics.httpStatus);
+  printHistogram(*response, "garage_http_request_duration_seconds", "handler=\"/api/logs\",", metrics.httpLogs);
+  printHistogram(*response, "garage_http_request_duration_seconds", "handler=\"/api/trigger\",", metrics.httpTrigger);
+
+  printMetricHeader(*response, "garage_udp_trigger_duration_seconds", "histogram", "UDP trigger datagram to relay queued");
+  printHistogram(*response, "garage_udp_trigger_duration_seconds", "", metrics.udpTrigger);
+  printMetricHeader(*response, "garage_udp_rejected_total", "counter", "UDP frames dropped as malformed, forged or replayed");
+  response->printf("garage_udp_rejected_total %u\n", (unsigned)udpChannel.getRejected());
+
+  printMetricHeader(*response, "garage_button_edge_to_relay_seconds", "histogram",
+                    "Button release interrupt to relay pulse, debounce included, per power profile");
+  for (uint8_t i = 0; i < POWER_PROFILE_COUNT; i++) {
+    char labels[32];
+    snprintf(labels, sizeof(labels), "profile=\"%s\",", PowerManager::profileName((PowerProfile)i));
+    printHistogram(*response, "garage_button_edge_to_relay_seconds", labels, metrics.buttonEdgeToRelay[i]);
+  }
 
-        async function toggleWifiConfig() {
-            const configDiv = document.getElementById('wifiConfig');
-            const isShowing = configDiv.classList.toggle('show');
-            
-            // If showing the config form, populate it with saved values
-            if (isShowing) {
-                try {
-                    const response = await fetch('/api/status');
-                    const data = await response.json();
-                    
-                    // Populate SSID field if saved SSID exists
-                    if (data.saved_ssid && data.saved_ssid.length > 0) {
-                        document.getElementById('ssid').value = data.saved_ssid;
-                    } else {
-                        document.getElementById('ssid').value = '';
-                    }
-                    
-                    // Populate password field if saved password exists
-                    if (data.saved_password && data.saved_password.length > 0) {
-                        document.getElementById('password').value = data.saved_password;
-                    } else {
-                        document.getElementById('password').value = '';
-                    }
-                } catch (error) {
-                    console.error('Failed to load WiFi config:', error);
-                }
-            }
-        }
+  printMetricHeader(*response, "garage_registration_duration_seconds", "histogram", "Control server registration time");
+  printHistogram(*response, "garage_registration_duration_seconds", "", metrics.registration);
+  printMetricHeader(*response, "garage_registration_failures_total", "counter", "Failed registrations");
+  response->printf("garage_registration_failures_total %u\n", (unsigned)metrics.registrationFailures);
+
+  printMetricHeader(*response, "garage_status_update_duration_seconds", "histogram", "Status report POST time");
+  printHistogram(*response, "garage_status_update_duration_seconds", "", metrics.statusUpdate);
+  printMetricHeader(*response, "garage_status_update_failures_total", "counter", "Failed status reports");
+  response->printf("garage_status_update_failures_total %u\n", (unsigned)metrics.statusUpdateFailures);
+
+  printMetricHeader(*response, "garage_state_command_drops_total", "counter", "Door state changes lost on a full command queue");
+  response->printf("garage_state_command_drops_total %u\n", (unsigned)deviceState.getDropped());
+
+  printMetricHeader(*response, "garage_websocket_clients", "gauge", "Connected WebSocket clients");
+  response->printf("garage_websocket_clients %u\n", (unsigned)ws.count());
+  printMetricHeader(*response, "garage_websocket_send_drops_total", "counter", "Messages dropped on a full client queue");
+  response->printf("garage_websocket_send_drops_total %u\n",
+                   (unsigned)metrics.wsSendDrops.load(std::memory_order_relaxed));
+  printMetricHeader(*response, "garage_websocket_skipped_logs_total", "counter", "Log lines not sent to a lagging client");
+  response->printf("garage_websocket_skipped_logs_total{level=\"debug\"} %u\n", (unsigned)wsBroadcaster.getDroppedDebug());
+  response->printf("garage_websocket_skipped_logs_total{level=\"any\"} %u\n", (unsigned)wsBroadcaster.getDroppedLogs());
+  printMetricHeader(*response, "garage_websocket_coalesced_total", "counter", "Updates superseded before a client could take them");
+  response->printf("garage_websocket_coalesced_total{kind=\"status\"} %u\n", (unsigned)wsBroadcaster.getCoalescedStatus());
+  response->printf("garage_websocket_coalesced_total{kind=\"ota\"} %u\n", (unsigned)wsBroadcaster.getCoalescedOta());
+
+  printMetricHeader(*response, "garage_wifi_reconnects_total", "counter", "Station reconnects after the first");
+  response->printf("garage_wifi_reconnects_total %u\n", (unsigned)metrics.wifiReconnects);
+  printMetricHeader(*response, "garage_wifi_disconnects_total", "counter", "Station links lost");
+  response->printf("garage_wifi_disconnects_total %u\n", (unsigned)metrics.wifiDisconnects);
+  if (linkState == LINK_ONLINE) {
+    printMetricHeader(*response, "garage_wifi_rssi_dbm", "gauge", "Signal strength");
+    response->printf("garage_wifi_rssi_dbm %d\n", (int)WiFi.RSSI());
+  }
 
-        async function saveWifi() {
-            const ssid = document.getElementById('ssid').value;
-            const password = document.getElementById('password').value;
+  request->send(response);
+}
 
-            if (!ssid) {
-                showMessage('Please enter WiFi SSID', true, 'settings-message');
-                return;
-            }
+void setupWebServer() {
+  // WebSocket event handler
+  ws.onEvent(onWsEvent);
+  server.addHandler(&ws);
 
-            try {
-                const response = await fetch('/api/config', {
-                    method: 'POST',
-                    headers: { 'Content-Type': 'application/json' },
-                    body: JSON.stringify({ ssid, password })
-                });
-
-                const data = await response.json();
-                showMessage('WiFi configured! Restarting...', false, 'settings-message');
-                setTimeout(() => {
-                    window.location.href = '/';
-                }, 3000);
-            } catch (error) {
-                showMessage('Failed to save configuration', true, 'settings-message');
-            }
-        }
+  // Serve root page from flash. The page lives in web/index.html and is
+  // gzipped into web_index.h at build time by tools/embed_web.py.
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+    recordWhenSent(request, metrics.httpRoot);
+    if (request->hasHeader("If-None-Match") &&
+        request->getHeader("If-None-Match")->value().indexOf(INDEX_HTML_ETAG) >= 0) {
+      AsyncWebServerResponse *response = request->beginResponse(304);
+      response->addHeader("ETag", INDEX_HTML_ETAG);
+      request->send(response);
+      return;
+    }
 
-        async function restart() {
-            if (confirm('Are you sure you want to restart the device?')) {
-                try {
-                    await fetch('/api/restart', { method: 'POST' });
-                    showMessage('Device restarting...', false, 'settings-message');
-                } catch (error) {
-                    showMessage('Restart initiated', false, 'settings-message');
-                }
-            }
-        }
+    AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html",
+      INDEX_HTML_GZ, INDEX_HTML_GZ_LEN);
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("ETag", INDEX_HTML_ETAG);
+    // Let browsers keep the page but revalidate it, so a firmware update shows up immediately
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
+  });
 
-        // OTA Upload functionality
-        const uploadArea = document.getElementById('uploadArea');
+  // API: Get status (served from the shared snapshot in statusCache)
+  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    recordWhenSent(request, metrics.httpStatus);
+    std::shared_ptr<String> body = statusCache.get();
+    AsyncWebServerResponse *response = request->beginResponse("application/json", body->length(),
+      [body](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        size_t chunk = min(maxLen, body->length() - index);
+        memcpy(buffer, body->c_str() + index, chunk);
+        return chunk;
+      });
+    request->send(response);
+  });
 
-        ['dragenter', 'dragover', 'dragleave', 'drop'].forEach(eventName => {
-            uploadArea.addEventListener(eventName, preventDefaults, false);
-        });
+  // API: Get logs, streamed in chunks straight from the log arena
+  //   ?since=<seq>  only lines newer than seq (use "last" from the previous response)
+  //   ?limit=<n>    at most n lines; without since, the newest n
+  server.on("/api/logs", HTTP_GET, [](AsyncWebServerRequest *request) {
+    recordWhenSent(request, metrics.httpLogs);
+    std::shared_ptr<LogStreamState> state = std::make_shared<LogStreamState>();
+    state->phase = LogStreamState::HEADER;
+    state->entries = 0;
+    state->pendingLength = 0;
+    state->pendingOffset = 0;
+
+    long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 0;
+    state->remaining = limit > 0 ? (uint32_t)limit : UINT32_MAX;
+
+    if (request->hasParam("since")) {
+      state->cursor.seq = nextAfter(strtoul(request->getParam("since")->value().c_str(), nullptr, 10));
+    } else if (limit > 0) {
+      logLock();
+      uint32_t newest = logStore.newestSeq();
+      logUnlock();
+      state->cursor.seq = newest >= (uint32_t)limit ? newest - limit + 1 : 0;
+    } else {
+      state->cursor.seq = 0;
+    }
+    state->cursor.offset = 0;
 
-        function preventDefaults(e) {
-            e.preventDefault();
-            e.stopPropagation();
-        }
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+      [state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return fillLogStream(*state, buffer, maxLen);
+      });
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
 
-        ['dragenter', 'dragover'].forEach(eventName => {
-            uploadArea.addEventListener(eventName, () => {
-                uploadArea.classList.add('dragover');
-            });
-        });
-
-        ['dragleave', 'drop'].forEach(eventName => {
-            uploadArea.addEventListener(eventName, () => {
-                uploadArea.classList.remove('dragover');
-            });
-        });
-
-        uploadArea.addEventListener('drop', (e) => {
-            const files = e.dataTransfer.files;
-            if (files.length > 0) {
-                uploadFirmware(files[0]);
-            }
-        });
+  // API: Door event journal. ?from=&to= (epoch seconds) seek through the time
+  // index; ?since=<seq> continues a previous page; without either the newest
+  // ?limit events (default 100) are returned.
+  server.on("/api/history", HTTP_GET, [](AsyncWebServerRequest *request) {
+    std::shared_ptr<HistoryStreamState> state = std::make_shared<HistoryStreamState>();
+    state->phase = HistoryStreamState::HEADER;
+    state->entries = 0;
+    state->batchCount = 0;
+    state->batchIndex = 0;
+    state->pendingLength = 0;
+    state->pendingOffset = 0;
+
+    long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : 0;
+    state->remaining = limit > 0 ? (uint32_t)limit : HISTORY_QUERY_DEFAULT_LIMIT;
+    state->hasFrom = request->hasParam("from");
+    state->hasTo = request->hasParam("to");
+    state->from = state->hasFrom ? strtoul(request->getParam("from")->value().c_str(), nullptr, 10) : 0;
+    state->to = state->hasTo ? strtoul(request->getParam("to")->value().c_str(), nullptr, 10) : 0;
+
+    uint32_t start;
+    eventHistory.seek(state->hasFrom, state->from, state->hasTo, state->to, start, state->end);
+    if (request->hasParam("since")) {
+      start = max(start, nextAfter(strtoul(request->getParam("since")->value().c_str(), nullptr, 10)));
+    } else if (!state->hasFrom && !state->hasTo) {
+      start = state->end - min(state->end - start, state->remaining);
+    }
+    state->seq = start;
 
-        async function uploadFirmware(file) {
-            if (!file) return;
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+      [state](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        return fillHistoryStream(*state, buffer, maxLen);
+      });
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
 
-            if (!file.name.endsWith('.bin')) {
-                showMessage('Please select a .bin file', true, 'ota-message');
-                return;
-            }
+  // API: Trigger door; ?channel=n picks a door other than channel 0
+  server.on("/api/trigger", HTTP_POST, [](AsyncWebServerRequest *request) {
+    recordWhenSent(request, metrics.httpTrigger);
+    long channel = request->hasParam("channel") ? request->getParam("channel")->value().toInt() : 0;
+    if (channel < 0 || channel >= (long)doorChannels.size()) {
+      request->send(404, "application/json", "{\"success\":false,\"message\":\"No such door channel\"}");
+      return;
+    }
+    if (!startDoorTrigger(SOURCE_API, channel)) {
+      request->send(429, "application/json", "{\"success\":false,\"message\":\"Trigger queue full\"}");
+      return;
+    }
 
-            const progressBar = document.getElementById('progressBar');
-            const progressFill = document.getElementById('progressFill');
-
-            progressBar.style.display = 'block';
-            progressFill.style.width = '0%';
-            progressFill.textContent = '0%';
-
-            const formData = new FormData();
-            formData.append('firmware', file);
-
-            try {
-                const xhr = new XMLHttpRequest();
-
-                xhr.upload.addEventListener('progress', (e) => {
-                    if (e.lengthComputable) {
-                        const percent = Math.round((e.loaded / e.total) * 100);
-                        progressFill.style.width = percent + '%';
-                        progressFill.textContent = percent + '%';
-                    }
-                });
-
-                xhr.addEventListener('load', () => {
-                    if (xhr.status === 200) {
-                        showMessage('Firmware uploaded successfully! Device is restarting...', false, 'ota-message');
-                        progressFill.style.width = '100%';
-                        progressFill.textContent = 'Complete!';
-                        setTimeout(() => {
-                            window.location.reload();
-                        }, 5000);
-                    } else {
-                        showMessage('Upload failed: ' + xhr.responseText, true, 'ota-message');
-                        progressBar.style.display = 'none';
-                    }
-                });
-
-                xhr.addEventListener('error', () => {
-                    showMessage('Upload error occurred', true, 'ota-message');
-                    progressBar.style.display = 'none';
-                });
-
-                xhr.open('POST', '/update');
-                xhr.send(formData);
-
-            } catch (error) {
-                showMessage('Upload failed: ' + error.message, true, 'ota-message');
-                progressBar.style.display = 'none';
-            }
-        }
+    StaticJsonDocument<128> doc;
+    doc["success"] = true;
+    doc["message"] = "Door triggered";
 
-        // Device Registration functions
-        async function loadRegistrationSettings() {
-            try {
-                const response = await fetch('/api/registration');
-                const data = await response.json();
-
-                document.getElementById('regEnabled').checked = data.enabled;
-                document.getElementById('regServerUrl').value = data.server_url || '';
-                document.getElementById('regDeviceName').value = data.device_name || '';
-                document.getElementById('regDeviceType').value = data.device_type || '';
-                document.getElementById('regDeviceDescription').value = data.device_description || '';
-
-                updateRegistrationStatus(data);
-            } catch (error) {
-                console.error('Error loading registration settings:', error);
-                showMessage('Error loading registration settings', true, 'registration-message');
-            }
-        }
+    String response;
+    serializeJson(doc, response);
+    request->send(200, "application/json", response);
+  });
 
-        async function loadDeviceInfo() {
-            try {
-                const response = await fetch('/api/status');
-                const data = await response.json();
-
-                // Debug: log the data to see what we're getting
-                console.log('Device info data:', data);
-                console.log('IP:', data.ip_address, 'MAC:', data.mac_address, 'Hostname:', data.hostname);
-
-                // Ensure we're using the correct field names
-                const ipAddr = data.ip_address || '-';
-                const macAddr = data.mac_address || '-';
-                const hostname = data.hostname || '-';
-
-                document.getElementById('regDeviceIp').textContent = ipAddr;
-                document.getElementById('regDeviceMac').textContent = macAddr;
-                document.getElementById('regDeviceHostname').textContent = hostname;
-            } catch (error) {
-                console.error('Error loading device info:', error);
-            }
-        }
+  // API: Door channel table
+  server.on("/api/config", HTTP_GET, [](AsyncWebServerRequest *request) {
+    StaticJsonDocument<1024> doc;
+    doc["max_channels"] = DOOR_MAX_CHANNELS;
+    JsonArray channels = doc.createNestedArray("channels");
+    for (size_t i = 0; i < doorChannels.size(); i++) {
+      const DoorChannel& channel = doorChannels[i];
+      JsonObject entry = channels.createNestedObject();
+      entry["name"] = (const char*)channel.name;
+      entry["contact_pin"] = channel.contactPin;
+      entry["relay_pin"] = channel.relayPin;
+      entry["contact_inverted"] = channel.inverted();
+      entry["contact_pullup"] = channel.pullup();
+      entry["pulse_ms"] = channel.pulseMs();
+    }
 
-        function updateRegistrationStatus(data) {
-            const statusBox = document.getElementById('registrationStatusBox');
+    String json;
+    serializeJson(doc, json);
+    request->send(200, "application/json", json);
+  });
 
-            if (!data.enabled) {
-                statusBox.className = 'status-box status-info';
-                statusBox.innerHTML = '<strong>Registration Disabled</strong><br>Automatic registration is turned off.';
-                return;
-            }
+  // API: Save WiFi config and/or the door channel table; restarts to apply
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      StaticJsonDocument<1536> doc;
+      DeserializationError error = deserializeJson(doc, data, len);
 
-            if (data.last_success) {
-                const secondsAgo = data.last_registration_seconds_ago || 0;
-                const minutesAgo = Math.floor(secondsAgo / 60);
-                const timeStr = minutesAgo > 0 ? `${minutesAgo} minute(s) ago` : `${secondsAgo} second(s) ago`;
-
-                statusBox.className = 'status-box status-success';
-                statusBox.style.background = '#d4edda';
-                statusBox.style.color = '#155724';
-                statusBox.style.border = '1px solid #c3e6cb';
-                statusBox.innerHTML = `
-                    <strong>Last Registration: Successful</strong><br>
-                    Registered ${timeStr}<br>
-                    Next registration in ${Math.max(0, 5 - minutesAgo)} minute(s)
-                `;
-            } else {
-                statusBox.className = 'status-box status-error';
-                statusBox.style.background = '#f8d7da';
-                statusBox.style.color = '#721c24';
-                statusBox.style.border = '1px solid #f5c6cb';
-                const errorMsg = data.last_error || 'Unknown error';
-                statusBox.innerHTML = `
-                    <strong>Last Registration: Failed</strong><br>
-                    Error: ${errorMsg}<br>
-                    Will retry automatically
-                `;
-            }
-        }
+      if (error) {
+        request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+        return;
+      }
 
-        document.getElementById('registrationForm').addEventListener('submit', async (e) => {
-            e.preventDefault();
-
-            const settings = {
-                enabled: document.getElementById('regEnabled').checked,
-                server_url: document.getElementById('regServerUrl').value,
-                device_name: document.getElementById('regDeviceName').value,
-                device_type: document.getElementById('regDeviceType').value,
-                device_description: document.getElementById('regDeviceDescription').value
-            };
-
-            try {
-                const response = await fetch('/api/registration', {
-                    method: 'POST',
-                    headers: { 'Content-Type': 'application/json' },
-                    body: JSON.stringify(settings)
-                });
-
-                const data = await response.json();
-
-                if (data.success) {
-                    showMessage('Settings saved successfully!', false, 'registration-message');
-                    setTimeout(() => loadRegistrationSettings(), 1000);
-                } else {
-                    showMessage('Error saving settings', true, 'registration-message');
-                }
-            } catch (error) {
-                showMessage('Error: ' + error.message, true, 'registration-message');
-            }
-        });
-
-        async function forceRegister() {
-            try {
-                const response = await fetch('/api/registration/register', { method: 'POST' });
-                const data = await response.json();
-
-                if (data.success) {
-                    showMessage('Device registered successfully!', false, 'registration-message');
-                    setTimeout(() => loadRegistrationSettings(), 1000);
-                } else {
-                    showMessage('Registration failed: ' + (data.error || 'Unknown error'), true, 'registration-message');
-                }
-            } catch (error) {
-                showMessage('Error: ' + error.message, true, 'registration-message');
-            }
+      // Checked before anything is saved, so a bad table changes nothing
+      if (doc.containsKey("channels")) {
+        DoorChannelTable table;
+        for (JsonObject entry : doc["channels"].as<JsonArray>()) {
+          // Missing or out-of-range pins become 0xff, which validation rejects
+          int contactPin = entry["contact_pin"] | -1;
+          int relayPin = entry["relay_pin"] | -1;
+          uint8_t flags = (entry["contact_inverted"] | true) ? DOOR_CONTACT_INVERTED : 0;
+          // Doors after the board's own are usually bare switches, so they default to the pull-up
+          if (entry["contact_pullup"] | (table.size() > 0)) {
+            flags |= DOOR_CONTACT_PULLUP;
+          }
+          if (!table.add(contactPin >= 0 && contactPin < 0xff ? contactPin : 0xff,
+                         relayPin >= 0 && relayPin < 0xff ? relayPin : 0xff, flags,
+                         entry["pulse_ms"] | (uint32_t)RELAY_PULSE_TIME, entry["name"] | DEFAULT_DOOR_NAME)) {
+            request->send(400, "application/json", "{\"error\":\"Too many channels\"}");
+            return;
+          }
+        }
+        const char* problem;
+        if (!validateDoorChannels(table, problem)) {
+          StaticJsonDocument<128> reply;
+          reply["error"] = problem;
+          String json;
+          serializeJson(reply, json);
+          request->send(400, "application/json", json);
+          return;
         }
+        saveDoorChannels(table);
+        logf(LOG_INFO, "Door channels updated (%u)", (unsigned)table.size());
+      }
+
+      if (doc.containsKey("ssid")) {
+        wifiSSID = doc["ssid"].as<String>();
+        wifiPassword = doc["password"].as<String>();
+        saveConfiguration();
+        // New network: the cached access point no longer applies
+        preferences.remove("wifi_chan");
+      }
+
+      // Optional static address; an empty static_ip switches back to DHCP
+      if (doc.containsKey("static_ip")) {
+        configStore.putString("static_ip", doc["static_ip"] | "");
+        configStore.putString("static_gw", doc["gateway"] | "");
+        configStore.putString("static_mask", doc["subnet"] | "255.255.255.0");
+        configStore.putString("static_dns", doc["dns"] | "");
+      }
+
+      request->send(200, "application/json", "{\"success\":true}");
+
+      logf(LOG_INFO, "Config updated, restarting...");
+      prepareForRestart();
+      delay(1000);
+      ESP.restart();
+    });
+
+  // API: Restart
+  server.on("/api/restart", HTTP_POST, [](AsyncWebServerRequest *request) {
+    request->send(200, "application/json", "{\"success\":true}");
+    logf(LOG_INFO, "Restart requested");
+    prepareForRestart();
+    delay(1000);
+    ESP.restart();
+  });
 
+  // API: Relay timing and counters
+  // (top-level pulse_ms and stats are channel 0's)
+  server.on("/api/relay", HTTP_GET, [](AsyncWebServerRequest *request) {
+    StaticJsonDocument<1024> doc;
+    doc["pulse_ms"] = relays[0].getPulseMs();
+    doc["min_gap_ms"] = relays[0].getMinGap();
+    relays[0].getStats(doc.createNestedObject("stats"));
+    JsonArray channels = doc.createNestedArray("channels");
+    for (size_t i = 0; i < doorChannels.size(); i++) {
+      JsonObject entry = channels.createNestedObject();
+      entry["channel"] = i;
+      entry["name"] = (const char*)doorChannels[i].name;
+      entry["pulse_ms"] = relays[i].getPulseMs();
+      relays[i].getStats(entry.createNestedObject("stats"));
+    }
 
-        // Initialize
-        connectWebSocket();
-        updateStatus();
-        statusInterval = setInterval(updateStatus, 2000);
-    </script>
-</body>
-</html>
-)rawliteral";
-    request->send(200, "text/html", html);
+    String json;
+    serializeJson(doc, json);
+    request->send(200, "application/json", json);
   });
 
-  // API: Get status
-  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+  // API: Set minimum gap between relay pulses (every channel)
+  server.on("/api/relay", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      StaticJsonDocument<128> doc;
+      DeserializationError error = deserializeJson(doc, data, len);
+
+      if (error || !doc["min_gap_ms"].is<uint32_t>()) {
+        request->send(400, "application/json", "{\"error\":\"Expected min_gap_ms\"}");
+        return;
+      }
+
+      for (RelayController& relay : relays) {
+        relay.setMinGap(doc["min_gap_ms"].as<uint32_t>());
+      }
+      configStore.putUInt("relay_gap", relays[0].getMinGap());
+      logf(LOG_INFO, "Relay minimum gap set to %lu ms", (unsigned long)relays[0].getMinGap());
+
+      request->send(200, "application/json", "{\"success\":true}");
+    });
+
+  // API: Scheduler run-time stats per loop() task
+  server.on("/api/scheduler", HTTP_GET, [](AsyncWebServerRequest *request) {
     StaticJsonDocument<1024> doc;
+    doc["passes"] = scheduler.getPasses();
+    doc["wakeups"] = scheduler.getWakeups();
+    JsonArray tasks = doc.createNestedArray("tasks");
+    for (size_t i = 0; i < scheduler.size(); i++) {
+      const Scheduler<SCHEDULER_MAX_TASKS>::TaskStats& stats = scheduler.stats(i);
+      JsonObject task = tasks.createNestedObject();
+      task["name"] = stats.name;
+      task["runs"] = stats.runs;
+      task["avg_us"] = stats.runs > 0 ? (uint32_t)(stats.totalUs / stats.runs) : 0;
+      task["max_us"] = stats.maxUs;
+      task["last_us"] = stats.lastUs;
+    }
 
-    doc["door_open"] = doorOpen;
-    doc["wifi_connected"] = !apMode;
-    
-    // Get IP address
-    IPAddress ip = apMode ? WiFi.softAPIP() : WiFi.localIP();
-    doc["ip_address"] = ip.toString();
-    
-    doc["rssi"] = WiFi.RSSI();
-    doc["uptime"] = millis() / 1000;
-    doc["ssid"] = apMode ? AP_SSID : WiFi.SSID();
-    doc["saved_ssid"] = wifiSSID;  // Saved WiFi SSID for configuration form
-    doc["saved_password"] = wifiPassword;  // Saved WiFi password for configuration form
-    
-    // Get MAC address
-    doc["mac_address"] = WiFi.macAddress();
-    
-    // Get hostname
-    doc["hostname"] = WiFi.getHostname();
-    
-    // Include transition status if active
-    if (doorStatusTransition.length() > 0) {
-      doc["status_transition"] = doorStatusTransition;
+    String json;
+    serializeJson(doc, json);
+    request->send(200, "application/json", json);
+  });
+
+  // API: Metrics, Prometheus text format unless ?format=json
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (request->hasParam("format") && request->getParam("format")->value() == "json") {
+      sendMetricsJson(request);
     } else {
-      doc["status_transition"] = "";
+      sendMetricsPrometheus(request);
     }
+  });
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+  // API: Get registration settings
+  server.on("/api/registration", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (deviceRegistration == nullptr) {
+      request->send(503, "application/json", "{\"error\":\"Registration manager not available\"}");
+      return;
+    }
+
+    String json = deviceRegistration->getSettingsJson();
+    request->send(200, "application/json", json);
   });
 
-  // API: Get all logs
-  server.on("/api/logs", HTTP_GET, [](AsyncWebServerRequest *request) {
-    DynamicJsonDocument doc(8192);
-    JsonArray logsArray = doc.createNestedArray("logs");
+  // API: Set registration settings
+  server.on("/api/registration", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      if (deviceRegistration == nullptr) {
+        request->send(503, "application/json", "{\"error\":\"Registration manager not available\"}");
+        return;
+      }
+
+      StaticJsonDocument<512> doc;
+      DeserializationError error = deserializeJson(doc, data);
 
-    int count = min(logCount, LOG_BUFFER_SIZE);
-    int startIdx = (logIndex - count + LOG_BUFFER_SIZE) % LOG_BUFFER_SIZE;
+      if (error) {
+        request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+        return;
+      }
 
-    for (int i = 0; i < count; i++) {
-      int idx = (startIdx + i) % LOG_BUFFER_SIZE;
-      JsonObject logObj = logsArray.createNestedObject();
-      logObj["timestamp"] = logBuffer[idx].timestamp;
-      logObj["level"] = logBuffer[idx].level;
-      logObj["message"] = logBuffer[idx].message;
-    }
+      RegistrationSettings settings;
+      deviceRegistration->getSettings(settings);
+      struct {
+        const char* key;
+        char* value;
+        size_t size;
+      } texts[] = {
+        {"server_url", settings.serverUrl, sizeof(settings.serverUrl)},
+        {"device_name", settings.deviceName, sizeof(settings.deviceName)},
+        {"device_type", settings.deviceType, sizeof(settings.deviceType)},
+        {"device_description", settings.deviceDescription, sizeof(settings.deviceDescription)},
+      };
+      for (const auto& text : texts) {
+        const char* value = doc[text.key].as<const char*>();
+        if (value == nullptr) {
+          continue;
+        }
+        if (strlen(value) >= text.size) {
+          request->send(400, "application/json", "{\"error\":\"Setting too long\"}");
+          return;
+        }
+        strcpy(text.value, value);
+      }
+      settings.enabled = doc["enabled"] | settings.enabled;
+      settings.heartbeatSeconds = doc["status_heartbeat_s"] | settings.heartbeatSeconds;
+      settings.coalesceMs = doc["status_coalesce_ms"] | settings.coalesceMs;
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
-  });
+      deviceRegistration->updateSettings(settings);
 
-  // API: Trigger door
-  server.on("/api/trigger", HTTP_POST, [](AsyncWebServerRequest *request) {
-    triggerRelay();
-    
-    // Set transition status based on current door state
-    doorStatusTransition = doorOpen ? "closing" : "opening";
-    statusTransitionStartTime = millis();
-    
-    // Broadcast status update to all WebSocket clients
-    broadcastStatusUpdate();
+      request->send(200, "application/json", "{\"success\":true}");
+    });
 
-    StaticJsonDocument<128> doc;
-    doc["success"] = true;
-    doc["message"] = "Door triggered";
+  // API: MQTT settings and connection counters
+  server.on("/api/mqtt", HTTP_GET, [](AsyncWebServerRequest *request) {
+    StaticJsonDocument<512> doc;
+    doc["enabled"] = configStore.getBool("mqtt_enabled", false);
+    doc["host"] = configStore.getString("mqtt_host", "");
+    doc["port"] = configStore.getUShort("mqtt_port", MQTT_DEFAULT_PORT);
+    doc["username"] = configStore.getString("mqtt_user", "");
+    doc["password_set"] = configStore.getString("mqtt_pass", "").length() > 0;
+    doc["base_topic"] = configStore.getString("mqtt_base", "");
+    doc["discovery"] = configStore.getBool("mqtt_disc", true);
+    mqtt.getStats(doc.createNestedObject("stats"));
 
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+    String json;
+    serializeJson(doc, json);
+    request->send(200, "application/json", json);
   });
 
-  // API: Save WiFi config
-  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+  // API: Set MQTT settings; omitted fields keep their value
+  server.on("/api/mqtt", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
     [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
-      StaticJsonDocument<256> doc;
-      DeserializationError error = deserializeJson(doc, data);
+      StaticJsonDocument<512> doc;
+      DeserializationError error = deserializeJson(doc, data, len);
 
       if (error) {
         request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
         return;
       }
 
-      wifiSSID = doc["ssid"].as<String>();
-      wifiPassword = doc["password"].as<String>();
-      saveConfiguration();
+      if (doc.containsKey("enabled")) {
+        configStore.putBool("mqtt_enabled", doc["enabled"].as<bool>());
+      }
+      if (doc.containsKey("host")) {
+        configStore.putString("mqtt_host", doc["host"] | "");
+      }
+      if (doc.containsKey("port")) {
+        configStore.putUShort("mqtt_port", doc["port"] | MQTT_DEFAULT_PORT);
+      }
+      if (doc.containsKey("username")) {
+        configStore.putString("mqtt_user", doc["username"] | "");
+      }
+      if (doc.containsKey("password")) {
+        configStore.putString("mqtt_pass", doc["password"] | "");
+      }
+      if (doc.containsKey("base_topic")) {
+        configStore.putString("mqtt_base", doc["base_topic"] | "");
+      }
+      if (doc.containsKey("discovery")) {
+        configStore.putBool("mqtt_disc", doc["discovery"].as<bool>());
+      }
+      mqtt.requestReload();
 
       request->send(200, "application/json", "{\"success\":true}");
-
-      logMessage("INFO", "WiFi config updated, restarting...");
-      delay(1000);
-      ESP.restart();
     });
 
-  // API: Restart
-  server.on("/api/restart", HTTP_POST, [](AsyncWebServerRequest *request) {
-    request->send(200, "application/json", "{\"success\":true}");
-    logMessage("INFO", "Restart requested");
-    delay(1000);
-    ESP.restart();
-  });
-
-  // API: Get registration settings
-  server.on("/api/registration", HTTP_GET, [](AsyncWebServerRequest *request) {
-    if (deviceRegistration == nullptr) {
-      request->send(503, "application/json", "{\"error\":\"Registration manager not available\"}");
-      return;
-    }
+  // API: Power profile
+  server.on("/api/power", HTTP_GET, [](AsyncWebServerRequest *request) {
+    StaticJsonDocument<256> doc;
+    doc["profile"] = PowerManager::profileName(powerManager.getProfile());
+    doc["listen_interval"] = powerManager.getListenInterval();
+    powerManager.getStats(doc.createNestedObject("stats"));
 
-    String json = deviceRegistration->getSettingsJson();
+    String json;
+    serializeJson(doc, json);
     request->send(200, "application/json", json);
   });
 
-  // API: Set registration settings
-  server.on("/api/registration", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+  // API: Set the power profile; omitted fields keep their value
+  server.on("/api/power", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
     [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
-      if (deviceRegistration == nullptr) {
-        request->send(503, "application/json", "{\"error\":\"Registration manager not available\"}");
+      StaticJsonDocument<128> doc;
+      DeserializationError error = deserializeJson(doc, data, len);
+
+      if (error) {
+        request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
         return;
       }
 
-      StaticJsonDocument<512> doc;
-      DeserializationError error = deserializeJson(doc, data);
+      uint8_t profile = powerManager.getProfile();
+      if (doc.containsKey("profile")) {
+        profile = PowerManager::parseProfile(doc["profile"] | "");
+        if (profile >= POWER_PROFILE_COUNT) {
+          request->send(400, "application/json",
+                        "{\"error\":\"profile must be performance, balanced or low_power\"}");
+          return;
+        }
+      }
+      if (doc.containsKey("listen_interval")) {
+        powerManager.setListenInterval(doc["listen_interval"] | (int)POWER_DEFAULT_LISTEN_INTERVAL);
+        configStore.putUChar("pwr_listen", powerManager.getListenInterval());
+      }
+      configStore.putUChar("pwr_profile", profile);
+      powerManager.requestReload();
+
+      request->send(200, "application/json", "{\"success\":true}");
+    });
+
+  // API: UDP trigger channel settings and counters
+  server.on("/api/udp", HTTP_GET, [](AsyncWebServerRequest *request) {
+    StaticJsonDocument<384> doc;
+    doc["enabled"] = configStore.getBool("udp_enabled", false);
+    doc["port"] = configStore.getUShort("udp_port", UDP_DEFAULT_PORT);
+    doc["key_set"] = configStore.getString("udp_key", "").length() > 0;
+    udpChannel.getStats(doc.createNestedObject("stats"));
+
+    String json;
+    serializeJson(doc, json);
+    request->send(200, "application/json", json);
+  });
+
+  // API: Set UDP settings; omitted fields keep their value. A new key
+  // starts every remote's counter over.
+  server.on("/api/udp", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      StaticJsonDocument<256> doc;
+      DeserializationError error = deserializeJson(doc, data, len);
 
       if (error) {
         request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
         return;
       }
 
-      String serverUrl = doc["server_url"] | deviceRegistration->getServerUrl();
-      String deviceName = doc["device_name"] | deviceRegistration->getDeviceName();
-      String deviceType = doc["device_type"] | deviceRegistration->getDeviceType();
-      String deviceDescription = doc["device_description"] | deviceRegistration->getDeviceDescription();
-      bool enabled = doc["enabled"] | deviceRegistration->isEnabled();
-
-      deviceRegistration->updateSettings(serverUrl, deviceName, deviceType, deviceDescription, enabled);
+      if (doc.containsKey("key")) {
+        size_t keyLength = strlen(doc["key"] | "");
+        if (keyLength < UDP_MIN_KEY_LENGTH || keyLength > UDP_MAX_KEY_LENGTH) {
+          request->send(400, "application/json", "{\"error\":\"Key must be 16-64 characters\"}");
+          return;
+        }
+        configStore.putString("udp_key", doc["key"] | "");
+      }
+      if (doc.containsKey("enabled")) {
+        configStore.putBool("udp_enabled", doc["enabled"].as<bool>());
+      }
+      if (doc.containsKey("port")) {
+        configStore.putUShort("udp_port", doc["port"] | UDP_DEFAULT_PORT);
+      }
+      udpChannel.requestReload();
 
       request->send(200, "application/json", "{\"success\":true}");
     });
@@ -1843,56 +5234,21 @@ void setupWebServer() {
       return;
     }
 
-    bool success = deviceRegistration->registerDevice();
-
-    StaticJsonDocument<256> doc;
-    doc["success"] = success;
-    if (!success) {
-      doc["error"] = deviceRegistration->getLastError();
-    }
-
-    String json;
-    serializeJson(doc, json);
-    request->send(200, "application/json", json);
+    // Runs on the registration task; GET /api/registration shows the result
+    deviceRegistration->requestRegistration(true);
+    request->send(202, "application/json", "{\"success\":true,\"message\":\"Registration queued\"}");
   });
 
   // OTA Update handler
   server.on("/update", HTTP_POST, [](AsyncWebServerRequest *request) {
-    bool shouldReboot = !Update.hasError();
-    AsyncWebServerResponse *response = request->beginResponse(200, "text/plain",
-      shouldReboot ? "OK" : "FAIL");
-    response->addHeader("Connection", "close");
-    request->send(response);
-
-    if (shouldReboot) {
-      logMessage("INFO", "OTA update successful, restarting...");
+    if (firmwareUpload.respond(request)) {
+      logf(LOG_INFO, "OTA update successful, restarting...");
+      prepareForRestart();
       delay(1000);
       ESP.restart();
-    } else {
-      logMessage("ERROR", "OTA update failed");
     }
   }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
-    if (!index) {
-      logMessage("INFO", "OTA Update Start: " + filename);
-      if (!Update.begin(UPDATE_SIZE_UNKNOWN)) {
-        Update.printError(Serial);
-        logMessage("ERROR", "OTA begin failed");
-      }
-    }
-
-    if (Update.write(data, len) != len) {
-      Update.printError(Serial);
-      logMessage("ERROR", "OTA write failed");
-    }
-
-    if (final) {
-      if (Update.end(true)) {
-        logMessage("INFO", "OTA Update Success: " + String(index + len) + " bytes");
-      } else {
-        Update.printError(Serial);
-        logMessage("ERROR", "OTA end failed");
-      }
-    }
+    firmwareUpload.onChunk(request, index, data, len, final);
   });
 
   // Captive portal redirect
@@ -1907,191 +5263,659 @@ void setupWebServer() {
   server.begin();
   delay(200);  // Allow server to initialize
   yield();
-  logMessage("INFO", "Web server started on port 80");
+  logf(LOG_INFO, "Web server started on port 80");
 }
 
 void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
   if (type == WS_EVT_CONNECT) {
-    logMessage("INFO", "WebSocket client connected: " + client->remoteIP().toString());
+    // The upgrade request picks the encoding: /ws?format=msgpack for binary frames
+    AsyncWebServerRequest* request = (AsyncWebServerRequest*)arg;
+    bool binary = request != nullptr && request->hasParam("format") &&
+                  request->getParam("format")->value() == "msgpack";
+    IPAddress remoteIp = client->remoteIP();
+    if (!wsBroadcaster.add(client->id(), binary)) {
+      logf(LOG_WARN, "WebSocket client refused: %d.%d.%d.%d (%d clients)",
+           remoteIp[0], remoteIp[1], remoteIp[2], remoteIp[3], WS_MAX_CLIENTS);
+      client->close();
+      return;
+    }
+    logf(LOG_INFO, "WebSocket client connected: %d.%d.%d.%d (%s)",
+         remoteIp[0], remoteIp[1], remoteIp[2], remoteIp[3], binary ? "msgpack" : "json");
+    sendStatusToClient(client);
+    // The log backlog is sent when the client asks for it (see replayLogs)
+  } else if (type == WS_EVT_DISCONNECT) {
+    wsBroadcaster.remove(client->id());
+    logf(LOG_INFO, "WebSocket client disconnected");
+  } else if (type == WS_EVT_DATA) {
+    // Only small, unfragmented text requests are expected from the UI
+    AwsFrameInfo* info = (AwsFrameInfo*)arg;
+    if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT) {
+      return;
+    }
+
+    StaticJsonDocument<128> doc;
+    if (deserializeJson(doc, (const char*)data, len)) {
+      return;
+    }
+    const char* requestType = doc["type"] | "";
+    if (strcmp(requestType, "replay") == 0) {
+      // Sequence numbers restart on reboot, so a cursor from another boot is meaningless
+      uint32_t since = doc["since"] | 0;
+      if ((doc["boot"] | 0u) != bootId) {
+        since = 0;
+      }
+      replayLogs(client, since);
+    }
+  }
+}
+
+// Sends buffered log records newer than sinceSeq as one batched frame:
+// {"type":"logs","boot":...,"entries":[...],"last":seq,"done":bool}.
+// When the backlog does not fit, done is false and the client asks again
+// with since = last, so it paces the replay to what it has received.
+void replayLogs(AsyncWebSocketClient* client, uint32_t sinceSeq) {
+  if (wsBroadcaster.isBinary(client->id())) {
+    replayLogsBinary(client, sinceSeq);
+    return;
+  }
 
-    // Send existing logs to newly connected client
-    int count = min(logCount, LOG_BUFFER_SIZE);
-    int startIdx = (logIndex - count + LOG_BUFFER_SIZE) % LOG_BUFFER_SIZE;
+  const size_t footerReserve = 48;  // "],\"last\":4294967295,\"done\":false}"
+  char* frame = (char*)malloc(LOG_REPLAY_FRAME_BYTES);
+  if (frame == nullptr) {
+    // Still answer so the client stops waiting for the backlog
+    char empty[96];
+    int emptyLength = snprintf(empty, sizeof(empty),
+                               "{\"type\":\"logs\",\"boot\":%lu,\"entries\":[],\"last\":%lu,\"done\":true}",
+                               (unsigned long)bootId, (unsigned long)sinceSeq);
+    wsSend(client, empty, emptyLength);
+    return;
+  }
 
-    for (int i = 0; i < count; i++) {
-      int idx = (startIdx + i) % LOG_BUFFER_SIZE;
-      StaticJsonDocument<512> doc;
-      doc["type"] = "log";
-      doc["timestamp"] = logBuffer[idx].timestamp;
-      doc["level"] = logBuffer[idx].level;
-      doc["message"] = logBuffer[idx].message;
+  size_t used = snprintf(frame, LOG_REPLAY_FRAME_BYTES,
+                         "{\"type\":\"logs\",\"boot\":%lu,\"entries\":[", (unsigned long)bootId);
+  LogCursor cursor = {nextAfter(sinceSeq), 0};
+  LogRecord record;
+  size_t entries = 0;
+  bool more = false;
+  for (;;) {
+    LogCursor previous = cursor;
+    logLock();
+    bool haveRecord = logStore.read(cursor, record);
+    logUnlock();
+    if (!haveRecord) {
+      break;
+    }
 
-      String msg;
-      serializeJson(doc, msg);
-      client->text(msg);
+    size_t separator = entries > 0 ? 1 : 0;
+    size_t length = formatLogRecordJson(record, timebase, frame + used + separator,
+                                        LOG_REPLAY_FRAME_BYTES - used - separator - footerReserve);
+    if (length == 0) {
+      cursor = previous;  // Leave this record for the next batch
+      more = true;
+      break;
     }
-  } else if (type == WS_EVT_DISCONNECT) {
-    logMessage("INFO", "WebSocket client disconnected");
+    if (separator) {
+      frame[used] = ',';
+    }
+    used += separator + length;
+    entries++;
   }
+
+  used += snprintf(frame + used, LOG_REPLAY_FRAME_BYTES - used, "],\"last\":%lu,\"done\":%s}",
+                   (unsigned long)(cursor.seq - 1), more ? "false" : "true");
+  wsSend(client, frame, used);
+  free(frame);
 }
 
-void triggerRelay() {
-  logMessage("INFO", "Triggering relay");
-  digitalWrite(RELAY_PIN, HIGH);
-  digitalWrite(LED_PIN, LOW);  // LED ON (inverted)
-  relayActive = true;
-  relayStartTime = millis();
+// Binary form of replayLogs(), built by packLogReplay():
+// [WS_MSG_LOGS, boot, epoch, millisAtEpoch, [[seq, level, ms, message], ...], last, done]
+// epoch/millisAtEpoch are the clock anchor (nil before the first NTP sync)
+// that converts the millis() timestamps to wall-clock time.
+void replayLogsBinary(AsyncWebSocketClient* client, uint32_t sinceSeq) {
+  uint8_t* frame = (uint8_t*)malloc(LOG_REPLAY_FRAME_BYTES);
+  if (frame == nullptr) {
+    uint8_t empty[48];
+    MsgPackWriter out(empty, sizeof(empty));
+    out.writeArray(7);
+    out.writeUint(WS_MSG_LOGS);
+    out.writeUint(bootId);
+    packClock(out, timebase);
+    out.writeArray(0);
+    out.writeUint(sinceSeq);
+    out.writeBool(true);
+    wsSendBinary(client, empty, out.size());
+    return;
+  }
+
+  size_t length = packLogReplay(frame, LOG_REPLAY_FRAME_BYTES, bootId, timebase, sinceSeq,
+                                [](LogCursor& cursor, LogRecord& record) {
+                                  logLock();
+                                  bool haveRecord = logStore.read(cursor, record);
+                                  logUnlock();
+                                  return haveRecord;
+                                });
+  wsSendBinary(client, frame, length);
+  free(frame);
 }
 
-void handleRelay() {
-  if (relayActive && (millis() - relayStartTime >= RELAY_PULSE_TIME)) {
-    digitalWrite(RELAY_PIN, LOW);
-    digitalWrite(LED_PIN, HIGH);  // LED OFF (inverted) in normal mode
-    if (apMode) {
-      digitalWrite(LED_PIN, LOW);  // Keep LED ON in AP mode
+// Chunked-response filler for /api/logs. Records are read one at a time
+// under logLock, so memory use is one record no matter how large the log
+// arena is; a record that does not fit the chunk is carried over in
+// state.pending. Returning 0 ends the response.
+size_t fillLogStream(LogStreamState& state, uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (state.pendingOffset < state.pendingLength) {
+      size_t chunk = min(maxLen - written, state.pendingLength - state.pendingOffset);
+      memcpy(buffer + written, state.pending + state.pendingOffset, chunk);
+      state.pendingOffset += chunk;
+      written += chunk;
+      continue;
+    }
+
+    state.pendingOffset = 0;
+    state.pendingLength = 0;
+    if (state.phase == LogStreamState::HEADER) {
+      state.pendingLength = snprintf(state.pending, sizeof(state.pending), "{\"logs\":[");
+      state.phase = LogStreamState::ENTRIES;
+    } else if (state.phase == LogStreamState::ENTRIES) {
+      LogRecord record;
+      bool haveRecord = false;
+      if (state.remaining > 0) {
+        logLock();
+        haveRecord = logStore.read(state.cursor, record);
+        logUnlock();
+      }
+      if (!haveRecord) {
+        state.phase = LogStreamState::FOOTER;
+        continue;
+      }
+      size_t separator = state.entries > 0 ? 1 : 0;
+      state.pending[0] = ',';
+      state.pendingLength = separator + formatLogRecordJson(record, timebase,
+                                                            state.pending + separator,
+                                                            sizeof(state.pending) - separator);
+      state.entries++;
+      state.remaining--;
+    } else if (state.phase == LogStreamState::FOOTER) {
+      state.pendingLength = snprintf(state.pending, sizeof(state.pending), "],\"last\":%lu}",
+                                     (unsigned long)(state.cursor.seq > 0 ? state.cursor.seq - 1 : 0));
+      state.phase = LogStreamState::DONE;
+    } else {
+      break;
     }
-    relayActive = false;
-    logMessage("DEBUG", "Relay pulse complete");
   }
+  return written;
 }
 
-void updateDoorStatus() {
-  static bool lastDoorState = false;
-  bool currentState = digitalRead(CONTACT_PIN);
+const char* historyEventName(uint8_t event) {
+  switch (event) {
+    case HISTORY_BOOT: return "boot";
+    case HISTORY_OPENED: return "opened";
+    case HISTORY_CLOSED: return "closed";
+    case HISTORY_TRIGGER: return "trigger";
+    default: return "unknown";
+  }
+}
 
-  // Apply inversion if configured
-  if (statusInverted) {
-    currentState = !currentState;
+const char* triggerSourceName(uint8_t source) {
+  switch (source) {
+    case SOURCE_API: return "api";
+    case SOURCE_MQTT: return "mqtt";
+    case SOURCE_UDP: return "udp";
+    case SOURCE_BUTTON: return "button";
+    default: return "";
   }
+}
 
-  if (currentState != lastDoorState) {
-    doorOpen = currentState;
-    lastDoorState = currentState;
-    // Build message without concatenation
-    logMessage("INFO", doorOpen ? "Door status: OPEN" : "Door status: CLOSED");
+// One journal record as a JSON object; time is null when the clock was unknown
+size_t formatHistoryRecordJson(const HistoryRecord& record, char* buffer, size_t size) {
+  char epoch[12] = "null";
+  if (record.epoch != 0) {
+    snprintf(epoch, sizeof(epoch), "%lu", (unsigned long)record.epoch);
   }
+  int written = snprintf(buffer, size,
+                         "{\"seq\":%lu,\"event\":\"%s\",\"channel\":%u,\"source\":\"%s\",\"door_open\":%s,"
+                         "\"transition\":\"%s\",\"time\":%s,\"uptime_ms\":%lu}",
+                         (unsigned long)record.seq, historyEventName(record.event),
+                         (unsigned)historyChannel(record), triggerSourceName(historySource(record)),
+                         record.doorOpen ? "true" : "false",
+                         transitionName((DoorTransition)record.transition), epoch,
+                         (unsigned long)record.uptimeMs);
+  return written < 0 ? 0 : min((size_t)written, size - 1);
 }
 
-void handleStatusTransition() {
-  // Clear transition status after duration expires
-  if (doorStatusTransition.length() > 0) {
-    unsigned long elapsed = millis() - statusTransitionStartTime;
-    if (elapsed >= STATUS_TRANSITION_DURATION) {
-      doorStatusTransition = "";
-      logMessage("DEBUG", "Status transition cleared");
-      // Broadcast status update to all WebSocket clients
-      broadcastStatusUpdate();
+size_t fillHistoryStream(HistoryStreamState& state, uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (state.pendingOffset < state.pendingLength) {
+      size_t chunk = min(maxLen - written, state.pendingLength - state.pendingOffset);
+      memcpy(buffer + written, state.pending + state.pendingOffset, chunk);
+      state.pendingOffset += chunk;
+      written += chunk;
+      continue;
+    }
+
+    state.pendingOffset = 0;
+    state.pendingLength = 0;
+    if (state.phase == HistoryStreamState::HEADER) {
+      state.pendingLength = snprintf(state.pending, sizeof(state.pending), "{\"first\":%lu,\"events\":[",
+                                     (unsigned long)eventHistory.getFirstSeq());
+      state.phase = HistoryStreamState::ENTRIES;
+    } else if (state.phase == HistoryStreamState::ENTRIES) {
+      if (state.batchIndex == state.batchCount) {
+        state.batchIndex = 0;
+        state.batchCount = 0;
+        if (state.remaining > 0 && state.seq < state.end) {
+          state.batchCount = eventHistory.read(state.seq, state.batch,
+                                               min((size_t)(state.end - state.seq), (size_t)HISTORY_QUERY_BATCH));
+        }
+        if (state.batchCount == 0) {
+          state.phase = HistoryStreamState::FOOTER;
+        }
+        continue;
+      }
+
+      const HistoryRecord& record = state.batch[state.batchIndex++];
+      if (record.seq >= state.end) {
+        state.phase = HistoryStreamState::FOOTER;
+        continue;
+      }
+      state.seq = record.seq + 1;
+      if ((state.hasFrom || state.hasTo) &&
+          (record.epoch == 0 || (state.hasFrom && record.epoch < state.from) ||
+           (state.hasTo && record.epoch > state.to))) {
+        continue;
+      }
+      size_t separator = state.entries > 0 ? 1 : 0;
+      state.pending[0] = ',';
+      state.pendingLength = separator + formatHistoryRecordJson(record, state.pending + separator,
+                                                                sizeof(state.pending) - separator);
+      state.entries++;
+      state.remaining--;
+    } else if (state.phase == HistoryStreamState::FOOTER) {
+      // Pass last back as ?since= to continue where a ?limit cut the list short
+      bool more = state.remaining == 0 && state.seq < state.end;
+      state.pendingLength = snprintf(state.pending, sizeof(state.pending), "],\"last\":%lu,\"more\":%s}",
+                                     (unsigned long)(state.seq > 0 ? state.seq - 1 : 0), more ? "true" : "false");
+      state.phase = HistoryStreamState::DONE;
+    } else {
+      break;
     }
   }
+  return written;
 }
 
-void broadcastStatusUpdate() {
-  if (ws.count() > 0) {
-    StaticJsonDocument<512> doc;
-    doc["type"] = "status";
-    doc["door_open"] = doorOpen;
-    doc["status_transition"] = doorStatusTransition;
+// Queues one relay pulse on a door channel; returns false when the
+// channel's trigger queue is full or there is no such channel
+bool triggerRelay(uint8_t channel) {
+  if (channel >= doorChannels.size()) {
+    return false;
+  }
+  const char* name = doorChannels[channel].name;
+  RelayController::Result result = relays[channel].request();
+  if (result == RelayController::STARTED) {
+    logf(LOG_INFO, "Triggering relay (%s)", name);
+  } else if (result == RelayController::QUEUED) {
+    logf(LOG_INFO, "Relay busy - trigger queued (%s)", name);
+  } else {
+    logf(LOG_WARN, "Relay trigger rejected (%s, %d already queued)", name, RELAY_MAX_PENDING);
+  }
+  return result != RelayController::REJECTED;
+}
 
-    String msg;
-    serializeJson(doc, msg);
-    ws.textAll(msg);
+// Trigger from the API, MQTT or UDP: queues a pulse and shows the expected
+// transition
+bool startDoorTrigger(TriggerSource source, uint8_t channel) {
+  if (!triggerRelay(channel)) {
+    return false;
   }
+
+  // The loop picks the transition from the door state and pushes it to
+  // WebSocket clients, MQTT and the control server
+  deviceState.post(DeviceCommand::TRIGGERED, false, millis(), source, channel);
+  return true;
 }
 
-void handleButton() {
-  bool buttonState = digitalRead(BUTTON_PIN);
-  unsigned long currentTime = millis();
+// Debounced contact level from InputMonitor (input task)
+void onContactChanged(uint8_t channel, bool level, uint32_t timestamp) {
+  deviceState.post(DeviceCommand::CONTACT_CHANGED, level, timestamp, SOURCE_NONE, channel);
+}
 
-  // Button pressed (LOW due to INPUT_PULLUP)
-  if (buttonState == LOW && !buttonPressed) {
-    if (currentTime - lastButtonPress > DEBOUNCE_TIME) {
-      buttonPressed = true;
-      buttonPressStart = currentTime;
-      logMessage("DEBUG", "Button pressed");
-    }
+// Report door state to the control server when it changes. The first change
+// after a quiet period goes out immediately; further changes inside the
+// coalesce window are folded into one report at the end of the window.
+// Unchanged state is only re-sent as a slow heartbeat.
+// (Station mode only, and only after a successful registration.)
+// Returns the milliseconds until the next report could be due.
+uint32_t handleStatusReporting() {
+  if (deviceRegistration == nullptr || apMode || WiFi.status() != WL_CONNECTED ||
+      !deviceRegistration->getLastSuccess()) {
+    return SCHEDULER_IDLE_MS;
+  }
+  // MQTT carries the door state while it is up; HTTP takes over again if it drops
+  if (mqtt.isConnected()) {
+    return SCHEDULER_IDLE_MS;
   }
 
-  // Button released
-  if (buttonState == HIGH && buttonPressed) {
-    unsigned long pressDuration = currentTime - buttonPressStart;
-    buttonPressed = false;
-    lastButtonPress = currentTime;
-
-    // Long press (4+ seconds) = Factory reset
-    if (pressDuration >= 4000) {
-      logMessage("WARN", "Factory reset triggered!");
-      preferences.clear();
-      delay(500);
-      ESP.restart();
-    }
-    // Short press = Trigger relay
-    else if (pressDuration < 1000) {
-      logMessage("INFO", "Button short press - triggering relay");
-      triggerRelay();
-    }
+  DeviceState state = deviceState.get();
+  if (doorsChanged(state.doors, reportedDoors, state.doorCount)) {
+    memcpy(reportedDoors, state.doors, sizeof(reportedDoors));
+    statusUpdatePending = true;
+  }
+
+  unsigned long sinceLastUpdate = millis() - lastStatusUpdateTime;
+  bool coalesceWindowElapsed = sinceLastUpdate >= deviceRegistration->getStatusCoalesceMs();
+  bool heartbeatDue = sinceLastUpdate >= deviceRegistration->getStatusHeartbeatMs();
+
+  if ((statusUpdatePending && coalesceWindowElapsed) || heartbeatDue) {
+    deviceRegistration->queueStatusUpdate(state);
+    lastStatusUpdateTime = millis();
+    statusUpdatePending = false;
+  }
+
+  uint32_t dueAfter = statusUpdatePending ? deviceRegistration->getStatusCoalesceMs()
+                                          : deviceRegistration->getStatusHeartbeatMs();
+  sinceLastUpdate = millis() - lastStatusUpdateTime;
+  return sinceLastUpdate >= dueAfter ? 0 : dueAfter - sinceLastUpdate;
+}
+
+// Door, Wi-Fi and uptime fields; shared by /api/status and WebSocket pushes
+void addLiveStatus(JsonDocument& doc) {
+  LinkStatus link;
+  link.connected = linkState == LINK_ONLINE;
+  IPAddress ip = apMode ? WiFi.softAPIP() : WiFi.localIP();
+  snprintf(link.ip, sizeof(link.ip), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  link.rssi = WiFi.RSSI();
+  link.uptimeSeconds = millis() / 1000;
+  addLiveStatus(doc, deviceState.get(), doorChannels, link);
+}
+
+// Full status for a newly connected client, so the UI never has to poll
+void sendStatusToClient(AsyncWebSocketClient* client) {
+  StaticJsonDocument<1024> doc;
+  doc["type"] = "status";
+  addLiveStatus(doc);
+
+  if (wsBroadcaster.isBinary(client->id())) {
+    uint8_t frame[WS_STATUS_FRAME_BYTES];
+    wsSendBinary(client, frame, packStatus(doc, true, frame, sizeof(frame)));
+    return;
   }
+  String msg;
+  serializeJson(doc, msg);
+  wsSend(client, msg.c_str(), msg.length());
 }
 
-void logMessage(String level, String message) {
-  String timestamp = getFormattedTime();
+// DoorTransition from its transitionName()
+uint8_t transitionFromName(const char* name) {
+  return strcmp(name, "opening") == 0 ? TRANSITION_OPENING
+         : strcmp(name, "closing") == 0 ? TRANSITION_CLOSING
+         : TRANSITION_NONE;
+}
 
-  // Print to serial
-  Serial.print("[");
-  Serial.print(timestamp);
-  Serial.print("] [");
-  Serial.print(level);
-  Serial.print("] ");
-  Serial.println(message);
+// Binary form of a status document built for JSON clients:
+// [WS_MSG_STATUS, door_open, transition, wifi_connected, ip_address, rssi,
+//  uptime, epoch, millisAtEpoch, doors], with nil for fields the document
+// leaves out. transition is a DoorTransition; doors is
+// [[door_open, transition, name], ...] per channel; the clock anchor rides
+// along on full updates (withClock). Returns the frame length.
+size_t packStatus(const JsonDocument& doc, bool withClock, uint8_t* buffer, size_t capacity) {
+  MsgPackWriter out(buffer, capacity);
+  out.writeArray(10);
+  out.writeUint(WS_MSG_STATUS);
+
+  if (doc.containsKey("door_open")) {
+    out.writeBool(doc["door_open"].as<bool>());
+  } else {
+    out.writeNil();
+  }
+  if (doc.containsKey("status_transition")) {
+    out.writeUint(transitionFromName(doc["status_transition"] | ""));
+  } else {
+    out.writeNil();
+  }
+  if (doc.containsKey("wifi_connected")) {
+    out.writeBool(doc["wifi_connected"].as<bool>());
+  } else {
+    out.writeNil();
+  }
+  if (doc.containsKey("ip_address")) {
+    out.writeString(doc["ip_address"] | "");
+  } else {
+    out.writeNil();
+  }
+  if (doc.containsKey("rssi")) {
+    out.writeInt(doc["rssi"].as<int>());
+  } else {
+    out.writeNil();
+  }
+  if (doc.containsKey("uptime")) {
+    out.writeUint(doc["uptime"].as<uint32_t>());
+  } else {
+    out.writeNil();
+  }
+  if (withClock) {
+    packClock(out, timebase);
+  } else {
+    out.writeNil();
+    out.writeNil();
+  }
+  if (doc.containsKey("doors")) {
+    JsonArrayConst doors = doc["doors"].as<JsonArrayConst>();
+    out.writeArray(doors.size());
+    for (JsonObjectConst door : doors) {
+      out.writeArray(3);
+      out.writeBool(door["door_open"].as<bool>());
+      out.writeUint(transitionFromName(door["status_transition"] | ""));
+      out.writeString(door["name"] | "");
+    }
+  } else {
+    out.writeNil();
+  }
+  return out.ok() ? out.size() : 0;
+}
 
-  // Store in circular buffer
-  logBuffer[logIndex].timestamp = timestamp;
-  logBuffer[logIndex].level = level;
-  logBuffer[logIndex].message = message;
+// Called from loop(): pushes door changes as soon as they are seen, RSSI
+// when it moves noticeably, and a full resync once a minute.
+// Returns the milliseconds until the next RSSI check or resync.
+uint32_t handleStatusPush() {
+  if (ws.count() == 0) {
+    return WS_RSSI_CHECK_INTERVAL_MS;
+  }
 
-  logIndex = (logIndex + 1) % LOG_BUFFER_SIZE;
-  if (logCount < LOG_BUFFER_SIZE) {
-    logCount++;
+  unsigned long now = millis();
+  if (now - lastFullStatusPushTime >= WS_STATUS_REFRESH_MS) {
+    lastFullStatusPushTime = now;
+    lastRssiCheckTime = now;
+    broadcastStatusUpdate(true, false);
+  } else {
+    bool checkRssi = now - lastRssiCheckTime >= WS_RSSI_CHECK_INTERVAL_MS;
+    if (checkRssi) {
+      lastRssiCheckTime = now;
+    }
+    broadcastStatusUpdate(false, checkRssi);
   }
 
-  // Send to WebSocket clients
-  sendLogToWebSocket(level, message);
+  uint32_t untilRssi = WS_RSSI_CHECK_INTERVAL_MS - (now - lastRssiCheckTime);
+  uint32_t untilRefresh = WS_STATUS_REFRESH_MS - (now - lastFullStatusPushTime);
+  return min(untilRssi, untilRefresh);
 }
 
-void sendLogToWebSocket(String level, String message) {
-  if (ws.count() > 0) {
-    StaticJsonDocument<512> doc;
-    doc["type"] = "log";
-    doc["timestamp"] = getFormattedTime();
-    doc["level"] = level;
-    doc["message"] = message;
+// Sends {"type":"status",...} to all clients: every field when full,
+// otherwise only those that differ from the last push (nothing if none do).
+// Uptime rides along so clients can tick it locally between pushes.
+void broadcastStatusUpdate(bool full, bool checkRssi) {
+  StaticJsonDocument<1024> doc;
+  doc["type"] = "status";
+  DeviceState state = deviceState.get();
+  if (full) {
+    addLiveStatus(doc);
+  } else {
+    if (state.doors[0].doorOpen != pushedDoors[0].doorOpen) {
+      doc["door_open"] = state.doors[0].doorOpen;
+    }
+    if (state.doors[0].transition != pushedDoors[0].transition) {
+      doc["status_transition"] = transitionName(state.doors[0].transition);
+    }
+    // Every door goes out when one beyond channel 0 moved
+    if (doorsChanged(state.doors + 1, pushedDoors + 1, state.doorCount - 1)) {
+      addDoorStatus(doc, state, doorChannels);
+    }
+    if (checkRssi && !apMode) {
+      int rssi = WiFi.RSSI();
+      if (abs(rssi - pushedRssi) >= WS_RSSI_DELTA_DBM) {
+        doc["rssi"] = rssi;
+      }
+    }
+    if (doc.size() == 1) {
+      return;
+    }
+    doc["uptime"] = millis() / 1000;
+  }
+
+  memcpy(pushedDoors, state.doors, sizeof(pushedDoors));
+  if (doc.containsKey("rssi")) {
+    pushedRssi = doc["rssi"].as<int>();
+  }
 
-    String msg;
+  // Each encoding is built once, and only if some client uses it
+  size_t binaryClients = wsBroadcaster.binaryCount();
+  String msg;
+  if (wsBroadcaster.clientCount() > binaryClients) {
     serializeJson(doc, msg);
-    ws.textAll(msg);
   }
+  uint8_t frame[WS_STATUS_FRAME_BYTES];
+  size_t frameLength = 0;
+  if (binaryClients > 0) {
+    frameLength = packStatus(doc, full, frame, sizeof(frame));
+  }
+  wsBroadcaster.broadcastStatus(msg.c_str(), msg.length(), frame, frameLength, full);
+}
+
+// Direct sends to one client (connect status, log replays) go through these
+// two so queue overflows are counted; AsyncWebSocket drops the frame itself
+// when a client's queue is full. Broadcasts go through wsBroadcaster, which
+// never sends into a full queue.
+void wsSend(AsyncWebSocketClient* client, const char* message, size_t length) {
+  if (client->queueIsFull()) {
+    metrics.wsSendDrops.fetch_add(1, std::memory_order_relaxed);
+  }
+  client->text(message, length);
+}
+
+void wsSendBinary(AsyncWebSocketClient* client, const uint8_t* frame, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (client->queueIsFull()) {
+    metrics.wsSendDrops.fetch_add(1, std::memory_order_relaxed);
+  }
+  client->binary((uint8_t*)frame, length);
 }
 
-String getFormattedTime() {
-  struct tm timeinfo;
-  if(!getLocalTime(&timeinfo)){
-    // Fallback to uptime if time not set
-    unsigned long ms = millis();
-    unsigned long seconds = ms / 1000;
-    unsigned long minutes = seconds / 60;
-    unsigned long hours = minutes / 60;
+// {"type":"ota","state":"start"|"progress"|"verifying"|"success"|"error",...}
+// for firmware uploads and ArduinoOTA. total is 0 when the size is unknown.
+void broadcastOtaProgress(const char* state, size_t received, size_t total, const char* error) {
+  StaticJsonDocument<192> doc;
+  doc["type"] = "ota";
+  doc["state"] = state;
+  doc["received"] = received;
+  doc["total"] = total;
+  if (total > 0) {
+    doc["percent"] = (uint32_t)((uint64_t)received * 100 / total);
+  }
+  if (error != nullptr) {
+    doc["error"] = error;
+  }
+
+  char msg[WS_OTA_FRAME_BYTES];
+  size_t length = serializeJson(doc, msg, sizeof(msg));
+  wsBroadcaster.broadcastOta(msg, length);
+}
 
-    seconds %= 60;
-    minutes %= 60;
-    hours %= 24;
+// Debounced button level from InputMonitor (input task). Press durations
+// use the interrupt timestamps of the first edge of each press and release.
+// The board has one button, which drives door channel 0.
+void onButtonChanged(uint8_t index, bool level, uint32_t timestamp) {
+  // Button pressed (LOW due to INPUT_PULLUP)
+  if (!level) {
+    buttonPressed = true;
+    buttonPressStart = timestamp;
+    logf(LOG_DEBUG, "Button pressed");
+    return;
+  }
 
-    char timeStr[20];
-    sprintf(timeStr, "[UP] %02lu:%02lu:%02lu", hours, minutes, seconds);
-    return String(timeStr);
+  // Button released
+  if (!buttonPressed) {
+    return;
+  }
+  unsigned long pressDuration = timestamp - buttonPressStart;
+  buttonPressed = false;
+
+  // Long press (4+ seconds) = Factory reset
+  if (pressDuration >= LONG_PRESS_TIME) {
+    logf(LOG_WARN, "Factory reset triggered!");
+    configStore.discard();
+    preferences.clear();
+    delay(500);
+    ESP.restart();
+  }
+  // Short press = Trigger relay
+  else if (pressDuration < SHORT_PRESS_TIME) {
+    logf(LOG_INFO, "Button short press - triggering relay");
+    if (triggerRelay(0)) {
+      // From the micros() stamp the ISR took on the release edge, so the
+      // debounce settle time is included. The ISR only runs once the chip is
+      // awake, so light-sleep wake-up time is not.
+      metrics.buttonEdgeToRelay[powerManager.getProfile()].record(micros() - inputMonitor.getButtonChangeUs());
+      DeviceState state = deviceState.get();
+      eventHistory.record(HISTORY_TRIGGER, packHistorySource(SOURCE_BUTTON, 0), timestamp,
+                          state.doors[0].doorOpen, state.doors[0].transition);
+    }
   }
+}
+
+// Formats the message into a stack buffer before taking the log lock, so
+// other tasks only wait for the copy into the arena, then echoes it to serial
+// and WebSocket clients. Callers never build a String.
+void logWrite(LogLevel level, const char* format, ...) {
+  char message[LOG_MAX_MESSAGE];
+  uint32_t timestamp = millis();
+
+  va_list args;
+  va_start(args, format);
+  size_t length = formatLogMessage(message, format, args);
+  va_end(args);
+
+  logLock();
+  logStore.append(level, timestamp, message, length);
+  logUnlock();
 
   char timeStr[20];
-  strftime(timeStr, sizeof(timeStr), "%H:%M:%S", &timeinfo);
-  return String(timeStr);
+  timebase.format(timestamp, timeStr, sizeof(timeStr));
+  Serial.printf("[%s] [%s] %s\n", timeStr, logLevelName(level), message);
+
+  // WebSocket clients read the line back out of logStore
+  wsBroadcaster.notifyLog();
+}
+
+// Serializes access to logStore between the loop, AsyncTCP and reporter
+// tasks. The mutex is created at the top of setup(), before anything logs
+// or any other task exists.
+void logLock() {
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+}
+
+void logUnlock() {
+  xSemaphoreGive(logMutex);
+}
+
+// SNTP sync notification: teaches the timebase the wall-clock offset so log
+// timestamps never have to call the blocking getLocalTime()
+void onTimeSync(struct timeval* tv) {
+  uint32_t now = millis();
+  timebase.anchor((uint32_t)tv->tv_sec, now - (uint32_t)(tv->tv_usec / 1000));
 }
 
 void configureWatchdog(uint32_t timeoutSeconds) {
@@ -2138,7 +5962,7 @@ inline void feedWatchdog() {
 }
 
 void disableWatchdog() {
-  logMessage("DEBUG", "Disabling task watchdog");
+  logf(LOG_DEBUG, "Disabling task watchdog");
 
   esp_err_t deleteResult = esp_task_wdt_delete(NULL);
   if (deleteResult != ESP_OK && deleteResult != ESP_ERR_INVALID_STATE) {
@@ -2169,60 +5993,3 @@ void disableWatchdog() {
 
   watchdogEnabled = false;
 }
-
-void checkWiFiConnection() {
-  unsigned long currentMillis = millis();
-  
-  // Check if it's time to retry WiFi connection
-  if (currentMillis - lastWiFiRetryTime >= WIFI_RETRY_INTERVAL_MS) {
-    lastWiFiRetryTime = currentMillis;
-    
-    if (wifiSSID.length() > 0) {
-      char retryMsg[128];
-      snprintf(retryMsg, sizeof(retryMsg), "Periodic WiFi retry: Attempting to connect to %s", wifiSSID.c_str());
-      logMessage("INFO", retryMsg);
-      
-      // Ensure we are in AP+STA mode to allow connection attempt while keeping AP alive
-      if (WiFi.getMode() != WIFI_AP_STA) {
-        WiFi.mode(WIFI_AP_STA);
-      }
-      
-      WiFi.begin(wifiSSID.c_str(), wifiPassword.c_str());
-    }
-  }
-
-  // Check if we managed to connect
-  if (WiFi.status() == WL_CONNECTED) {
-    logMessage("INFO", "WiFi reconnected successfully!");
-    // Build messages without concatenation
-    char ipMsg[64];
-    IPAddress ip = WiFi.localIP();
-    snprintf(ipMsg, sizeof(ipMsg), "IP: %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-    logMessage("INFO", ipMsg);
-    
-    char rssiMsg[64];
-    snprintf(rssiMsg, sizeof(rssiMsg), "Signal: %d dBm", WiFi.RSSI());
-    logMessage("INFO", rssiMsg);
-    
-    // Switch to STA mode (disable AP)
-    WiFi.mode(WIFI_STA);
-    apMode = false;
-    digitalWrite(LED_PIN, HIGH);  // LED OFF (inverted)
-    
-    // Re-init time
-    configTzTime(TIMEZONE, NTP_SERVER);
-    
-    // Initialize registration if needed
-    if (deviceRegistration == nullptr) {
-        logMessage("INFO", "Initializing device registration...");
-        deviceRegistration = new DeviceRegistration(&preferences);
-        deviceRegistration->loadSettings();
-    }
-    
-    // Register device
-    if (deviceRegistration->isEnabled()) {
-      logMessage("INFO", "Registering device with control server...");
-      deviceRegistration->registerDevice();
-    }
-  }
-}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-bucket latency histogram for /api/metrics.
+//
+// Bucket bounds are upper limits in microseconds, shared by every histogram
+// so the output lines up; one extra bucket counts everything slower than the
+// last bound. record() is a handful of compares and adds and never
+// allocates. Not atomic: each histogram must have one writer at a time
+// (see Metrics in main.cpp); readers on other tasks may see a sample's
+// count and sum one update apart.
+class LatencyHistogram {
+public:
+  static constexpr size_t BUCKETS = 10;
+
+  static uint32_t bound(size_t index) {
+    static const uint32_t bounds[BUCKETS] = {
+      100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+    };
+    return bounds[index];
+  }
+
+  LatencyHistogram() : count(0), sumUs(0), maxUs(0) {
+    for (size_t i = 0; i <= BUCKETS; i++) {
+      counts[i] = 0;
+    }
+  }
+
+  void record(uint32_t us) {
+    size_t index = 0;
+    while (index < BUCKETS && us > bound(index)) {
+      index++;
+    }
+    counts[index]++;
+    count++;
+    sumUs += us;
+    if (us > maxUs) {
+      maxUs = us;
+    }
+  }
+
+  // Samples in bucket index alone (index == BUCKETS is the overflow bucket)
+  uint32_t bucketCount(size_t index) const { return counts[index]; }
+  uint32_t getCount() const { return count; }
+  uint64_t getSumUs() const { return sumUs; }
+  uint32_t getMaxUs() const { return maxUs; }
+
+private:
+  uint32_t counts[BUCKETS + 1];
+  uint32_t count;
+  uint64_t sumUs;
+  uint32_t maxUs;
+};
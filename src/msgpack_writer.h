@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Minimal MessagePack encoder into a caller-supplied buffer.
+//
+// Covers what the binary WebSocket frames need: arrays, nil, booleans,
+// integers and strings. Integers take the shortest MessagePack form, so a
+// small enum costs one byte and a millis() timestamp two to five. Nothing
+// allocates; once the buffer is full further writes are dropped and ok()
+// turns false, so callers check once at the end.
+class MsgPackWriter {
+public:
+  MsgPackWriter(uint8_t* buffer, size_t capacity)
+      : buffer(buffer), capacity(capacity), used(0), overflow(false) {}
+
+  void writeNil() { put(0xc0); }
+  void writeBool(bool value) { put(value ? 0xc3 : 0xc2); }
+
+  void writeUint(uint32_t value) {
+    if (value < 0x80) {
+      put((uint8_t)value);
+    } else if (value <= 0xff) {
+      put(0xcc);
+      put((uint8_t)value);
+    } else if (value <= 0xffff) {
+      put(0xcd);
+      putBigEndian(value, 2);
+    } else {
+      put(0xce);
+      putBigEndian(value, 4);
+    }
+  }
+
+  void writeInt(int32_t value) {
+    if (value >= 0) {
+      writeUint((uint32_t)value);
+    } else if (value >= -32) {
+      put((uint8_t)value);             // Negative fixint
+    } else if (value >= -128) {
+      put(0xd0);
+      put((uint8_t)value);
+    } else if (value >= -32768) {
+      put(0xd1);
+      putBigEndian((uint32_t)value, 2);
+    } else {
+      put(0xd2);
+      putBigEndian((uint32_t)value, 4);
+    }
+  }
+
+  void writeString(const char* value) { writeString(value, strlen(value)); }
+
+  void writeString(const char* value, size_t length) {
+    if (length < 32) {
+      put(0xa0 | (uint8_t)length);
+    } else if (length <= 0xff) {
+      put(0xd9);
+      put((uint8_t)length);
+    } else if (length <= 0xffff) {
+      put(0xda);
+      putBigEndian((uint32_t)length, 2);
+    } else {
+      put(0xdb);
+      putBigEndian((uint32_t)length, 4);
+    }
+    putBytes((const uint8_t*)value, length);
+  }
+
+  void writeArray(uint32_t count) {
+    if (count < 16) {
+      put(0x90 | (uint8_t)count);
+    } else if (count <= 0xffff) {
+      put(0xdc);
+      putBigEndian(count, 2);
+    } else {
+      put(0xdd);
+      putBigEndian(count, 4);
+    }
+  }
+
+  // For arrays whose length is only known at the end: reserves a five-byte
+  // header and returns its offset for finishArray()
+  size_t beginArray() {
+    size_t offset = used;
+    put(0xdd);
+    putBigEndian(0, 4);
+    return offset;
+  }
+
+  void finishArray(size_t offset, uint32_t count) {
+    if (offset + 5 <= used) {
+      for (int i = 0; i < 4; i++) {
+        buffer[offset + 1 + i] = (uint8_t)(count >> (24 - 8 * i));
+      }
+    }
+  }
+
+  size_t size() const { return used; }
+  bool ok() const { return !overflow; }
+
+  // Bytes still free, for callers that stop before the buffer fills up
+  size_t remaining() const { return capacity - used; }
+
+  // Drops everything written after a previous size(), e.g. an entry that
+  // did not fit
+  void truncate(size_t length) {
+    if (length <= used) {
+      used = length;
+      overflow = false;
+    }
+  }
+
+private:
+  uint8_t* buffer;
+  size_t capacity;
+  size_t used;
+  bool overflow;
+
+  void put(uint8_t value) {
+    if (used >= capacity) {
+      overflow = true;
+      return;
+    }
+    buffer[used++] = value;
+  }
+
+  void putBigEndian(uint32_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+      put((uint8_t)(value >> (8 * i)));
+    }
+  }
+
+  void putBytes(const uint8_t* data, size_t length) {
+    if (length > capacity - used) {
+      overflow = true;
+      used = capacity;
+      return;
+    }
+    memcpy(buffer + used, data, length);
+    used += length;
+  }
+};
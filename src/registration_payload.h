@@ -0,0 +1,96 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "door_channels.h"
+
+// Registration document sent to the smart-device server. Header-only and
+// free of Arduino calls, so the native benchmarks run the same code; the
+// SHA-256 hash and the HTTP side stay in DeviceRegistration (main.cpp).
+
+// Who the device is. The strings are linked into the document, not copied,
+// so they must outlive it.
+struct RegistrationInfo {
+  const char* name;            // Also sent as the hostname
+  const char* ip;
+  const char* mac;
+  const char* type;
+  const char* description;
+  const char* firmwareVersion;
+};
+
+// Enough for channel 0 plus 512 bytes per further door channel
+inline size_t registrationDocumentBytes(size_t channelCount) {
+  return 1536 + 512 * (channelCount > 0 ? channelCount - 1 : 0);
+}
+
+// Device info and capabilities; the caller adds the hash
+inline void addRegistrationFields(JsonDocument& doc, const RegistrationInfo& info,
+                                  const DoorChannelTable& channels) {
+  // Basic device info
+  doc["name"] = info.name;
+  doc["ip"] = info.ip;
+  doc["mac"] = info.mac;
+  doc["hostname"] = info.name;
+  doc["type"] = info.type;
+  doc["description"] = info.description;
+  doc["firmware_version"] = info.firmwareVersion;
+
+  // Device capabilities
+  JsonArray capabilities = doc.createNestedArray("capabilities");
+
+  // A door sensor and trigger pair per channel. Channel 0 keeps the
+  // single-door identifiers and text, so its hash does not change.
+  for (size_t i = 0; i < channels.size(); i++) {
+    const DoorChannel& channel = channels[i];
+    char suffix[4];
+    doorChannelSuffix(i, suffix, sizeof(suffix));
+    // Copied into the document, so one set of buffers serves every channel
+    char doorId[12];
+    char triggerId[12];
+    char doorDescription[48];
+    char triggerName[40];
+    char triggerDescription[40];
+    char endpoint[32];
+    snprintf(doorId, sizeof(doorId), "door%s", suffix);
+    snprintf(triggerId, sizeof(triggerId), "trigger%s", suffix);
+    if (i == 0) {
+      snprintf(doorDescription, sizeof(doorDescription), "Door open/closed status");
+      snprintf(triggerName, sizeof(triggerName), "Trigger");
+      snprintf(triggerDescription, sizeof(triggerDescription), "Trigger garage door opener");
+      snprintf(endpoint, sizeof(endpoint), "/api/trigger");
+    } else {
+      snprintf(doorDescription, sizeof(doorDescription), "%s open/closed status", channel.name);
+      snprintf(triggerName, sizeof(triggerName), "Trigger %s", channel.name);
+      snprintf(triggerDescription, sizeof(triggerDescription), "%s", triggerName);
+      snprintf(endpoint, sizeof(endpoint), "/api/trigger?channel=%u", (unsigned)i);
+    }
+
+    // Door status sensor (binary_sensor)
+    JsonObject doorCap = capabilities.createNestedObject();
+    doorCap["identifier"] = doorId;
+    doorCap["name"] = (const char*)channel.name;
+    doorCap["type"] = "binary_sensor";
+    doorCap["valueType"] = "boolean";
+    doorCap["description"] = doorDescription;
+
+    // Trigger capability (switch)
+    JsonObject triggerCap = capabilities.createNestedObject();
+    triggerCap["identifier"] = triggerId;
+    triggerCap["name"] = triggerName;
+    triggerCap["type"] = "switch";
+    triggerCap["valueType"] = "boolean";
+    triggerCap["description"] = triggerDescription;
+
+    // Control API for trigger
+    JsonObject triggerApi = triggerCap.createNestedObject("controlApi");
+    triggerApi["method"] = "POST";
+    triggerApi["endpoint"] = endpoint;
+    JsonArray triggerActions = triggerApi.createNestedArray("actions");
+    triggerActions.add("on");
+  }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCHEDULER_MAX_TASKS 12   // Slots in the loop task's scheduler (setupScheduler() in main.cpp)
+
+// Deadline-driven cooperative scheduler for the Arduino loop task.
+//
+// Each task is a plain function that does its work and returns how many
+// milliseconds until it next needs to run. runDue() runs every task whose
+// deadline has passed - plus the event-driven ones when the loop was woken
+// by a notification - and returns how long the caller may sleep. The clocks
+// are passed in, so nothing here depends on Arduino or FreeRTOS.
+template <size_t MaxTasks>
+class Scheduler {
+public:
+  typedef uint32_t (*TaskFunction)(uint32_t now);
+  typedef uint32_t (*ClockFunction)();
+
+  struct TaskStats {
+    const char* name;
+    uint32_t runs;
+    uint64_t totalUs;
+    uint32_t maxUs;
+    uint32_t lastUs;
+  };
+
+  Scheduler(ClockFunction clockMs, ClockFunction clockUs)
+      : clockMs(clockMs), clockUs(clockUs), count(0), passes(0), wakeups(0) {}
+
+  // Returns false when the table is full. New tasks run on the next pass.
+  // runOnWake tasks also run whenever runDue() is called with woken = true.
+  bool add(const char* name, TaskFunction function, bool runOnWake) {
+    if (count >= MaxTasks) {
+      return false;
+    }
+    Task& task = tasks[count++];
+    task.function = function;
+    task.runOnWake = runOnWake;
+    task.nextRun = clockMs();
+    task.stats.name = name;
+    task.stats.runs = 0;
+    task.stats.totalUs = 0;
+    task.stats.maxUs = 0;
+    task.stats.lastUs = 0;
+    return true;
+  }
+
+  // Runs due tasks and returns the milliseconds until the next deadline
+  // (UINT32_MAX when there are no tasks).
+  uint32_t runDue(bool woken) {
+    passes++;
+    if (woken) {
+      wakeups++;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      Task& task = tasks[i];
+      // Re-read the clock per task: an earlier one may have blocked
+      uint32_t now = clockMs();
+      if (!(woken && task.runOnWake) && (int32_t)(now - task.nextRun) < 0) {
+        continue;
+      }
+
+      uint32_t start = clockUs();
+      uint32_t delayMs = task.function(now);
+      uint32_t elapsed = clockUs() - start;
+      task.nextRun = now + delayMs;
+
+      task.stats.runs++;
+      task.stats.totalUs += elapsed;
+      task.stats.lastUs = elapsed;
+      if (elapsed > task.stats.maxUs) {
+        task.stats.maxUs = elapsed;
+      }
+    }
+
+    uint32_t now = clockMs();
+    uint32_t wait = UINT32_MAX;
+    for (size_t i = 0; i < count; i++) {
+      int32_t remaining = (int32_t)(tasks[i].nextRun - now);
+      uint32_t taskWait = remaining > 0 ? (uint32_t)remaining : 0;
+      if (taskWait < wait) {
+        wait = taskWait;
+      }
+    }
+    return wait;
+  }
+
+  // Stats are written by the loop task only; readers on other tasks may see
+  // values that are one run apart from each other.
+  size_t size() const { return count; }
+  const TaskStats& stats(size_t index) const { return tasks[index].stats; }
+  uint32_t getPasses() const { return passes; }
+  uint32_t getWakeups() const { return wakeups; }
+
+private:
+  struct Task {
+    TaskFunction function;
+    bool runOnWake;
+    uint32_t nextRun;
+    TaskStats stats;
+  };
+
+  ClockFunction clockMs;
+  ClockFunction clockUs;
+  Task tasks[MaxTasks];
+  size_t count;
+  uint32_t passes;
+  uint32_t wakeups;
+};
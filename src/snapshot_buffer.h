@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Single-writer value that any task can read without locks or allocation.
+//
+// The writer fills the slot readers are not looking at, then bumps the
+// generation to publish it. A reader copies the current slot and keeps the
+// copy if the generation did not move meanwhile. Unlike a plain seqlock a
+// reader never waits for a write in progress - on this single-core chip a
+// higher-priority reader spinning on a preempted writer would never finish -
+// it only retries when a write completed during its copy. T must be
+// trivially copyable.
+template <typename T>
+class SnapshotBuffer {
+public:
+  SnapshotBuffer() : slots(), generation(0) {}
+
+  // Only ever called from one task
+  void store(const T& value) {
+    uint32_t g = generation.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slots[(g + 1) & 1] = value;
+    generation.store(g + 1, std::memory_order_release);
+  }
+
+  T load() const {
+    for (;;) {
+      uint32_t before = generation.load(std::memory_order_acquire);
+      T copy = slots[before & 1];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (generation.load(std::memory_order_relaxed) == before) {
+        return copy;
+      }
+    }
+  }
+
+private:
+  T slots[2];
+  std::atomic<uint32_t> generation;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Maps millis() timestamps to wall-clock time without blocking.
+//
+// The clock is learned once from an SNTP sync (anchor()), after which any
+// millis() value - including ones recorded before the sync - converts to
+// epoch seconds with plain arithmetic. Until then timestamps are shown as
+// uptime. Unlike getLocalTime() nothing here ever waits for the network.
+class Timebase {
+public:
+  Timebase() : anchorEpoch(0), anchorMillis(0), version(0) {}
+
+  // Record that `epoch` (seconds) corresponds to `atMillis`. Called from the
+  // SNTP callback; readers on other tasks retry if they race with it.
+  void anchor(uint32_t epoch, uint32_t atMillis) {
+    uint32_t v = version.load(std::memory_order_relaxed);
+    version.store(v + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_release);
+    anchorEpoch = epoch;
+    anchorMillis = atMillis;
+    std::atomic_thread_fence(std::memory_order_release);
+    version.store(v + 2, std::memory_order_release);
+  }
+
+  bool isSynced() const {
+    return version.load(std::memory_order_acquire) != 0;
+  }
+
+  // Epoch seconds for a millis() timestamp, or 0 when the clock is unknown.
+  // Valid for timestamps within ~24 days of the last anchor.
+  uint32_t toEpoch(uint32_t timestampMs) const {
+    uint32_t epoch;
+    uint32_t millisAtEpoch;
+    if (!snapshot(epoch, millisAtEpoch)) {
+      return 0;
+    }
+    int32_t deltaMs = (int32_t)(timestampMs - millisAtEpoch);
+    // Round toward negative infinity so times just before the anchor stay correct
+    int32_t deltaSec = deltaMs >= 0 ? deltaMs / 1000 : -((999 - deltaMs) / 1000);
+    return epoch + deltaSec;
+  }
+
+  // Anchor pair for clients that convert timestamps themselves
+  bool getAnchor(uint32_t& epoch, uint32_t& millisAtEpoch) const {
+    return snapshot(epoch, millisAtEpoch);
+  }
+
+  // "HH:MM:SS" local time once synced, "[UP] HH:MM:SS" before that
+  void format(uint32_t timestampMs, char* buffer, size_t bufferSize) const {
+    uint32_t epoch = toEpoch(timestampMs);
+    if (epoch == 0) {
+      unsigned long seconds = timestampMs / 1000;
+      snprintf(buffer, bufferSize, "[UP] %02lu:%02lu:%02lu",
+               (seconds / 3600) % 24, (seconds / 60) % 60, seconds % 60);
+      return;
+    }
+
+    time_t t = (time_t)epoch;
+    struct tm timeinfo;
+    localtime_r(&t, &timeinfo);
+    strftime(buffer, bufferSize, "%H:%M:%S", &timeinfo);
+  }
+
+private:
+  uint32_t anchorEpoch;
+  uint32_t anchorMillis;
+  std::atomic<uint32_t> version;   // Odd while anchor() is writing, 0 until first sync
+
+  bool snapshot(uint32_t& epoch, uint32_t& millisAtEpoch) const {
+    for (;;) {
+      uint32_t before = version.load(std::memory_order_acquire);
+      if (before == 0) {
+        return false;
+      }
+      if (before & 1) {
+        continue;
+      }
+      epoch = anchorEpoch;
+      millisAtEpoch = anchorMillis;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+  }
+};
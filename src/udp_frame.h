@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UDP_MAX_SENDERS 8            // Remote ids 0..7; each keeps its own counter
+
+// Datagram layout for the local UDP trigger and status channel.
+//
+// Every frame is a fixed header, a short body and a truncated HMAC tag:
+//
+//   'G' 'D' version type sender counter(4, big endian) body... tag(16)
+//
+// The tag covers everything before it and is computed by the caller (see
+// UdpChannel in main.cpp), so nothing here depends on mbedtls or Arduino.
+// sender tells the remotes apart; each one keeps its own counter, which must
+// grow with every frame it sends.
+class UdpFrame {
+public:
+  static constexpr uint8_t VERSION = 1;
+  static constexpr size_t HEADER_BYTES = 9;
+  static constexpr size_t TAG_BYTES = 16;
+  static constexpr size_t MAX_BODY_BYTES = 16;
+  static constexpr size_t MAX_BYTES = HEADER_BYTES + MAX_BODY_BYTES + TAG_BYTES;
+  static constexpr uint8_t DEVICE_SENDER = 0xff;   // Frames sent by the device itself
+
+  enum Type : uint8_t {
+    TRIGGER = 1,   // Remote -> device: pulse the relay
+    QUERY = 2,     // Remote -> device: reply with the door state
+    ACK = 3,       // Device -> remote: reply to TRIGGER or QUERY
+    STATUS = 4     // Device -> broadcast: the door state changed
+  };
+
+  struct Header {
+    uint8_t type;
+    uint8_t sender;
+    uint32_t counter;
+  };
+
+  // Writes the header and returns its length; the body follows it
+  static size_t writeHeader(uint8_t* buffer, uint8_t type, uint8_t sender, uint32_t counter) {
+    buffer[0] = 'G';
+    buffer[1] = 'D';
+    buffer[2] = VERSION;
+    buffer[3] = type;
+    buffer[4] = sender;
+    putUint32(buffer + 5, counter);
+    return HEADER_BYTES;
+  }
+
+  // Checks the framing (not the tag) and fills header and the body bounds
+  static bool parse(const uint8_t* data, size_t length, Header& header, const uint8_t*& body,
+                    size_t& bodyLength) {
+    if (length < HEADER_BYTES + TAG_BYTES || length > MAX_BYTES) {
+      return false;
+    }
+    if (data[0] != 'G' || data[1] != 'D' || data[2] != VERSION) {
+      return false;
+    }
+    header.type = data[3];
+    header.sender = data[4];
+    header.counter = getUint32(data + 5);
+    body = data + HEADER_BYTES;
+    bodyLength = length - HEADER_BYTES - TAG_BYTES;
+    return true;
+  }
+
+  // Compares without an early exit, so the timing does not reveal how many
+  // leading bytes of a forged tag were right
+  static bool tagEquals(const uint8_t* a, const uint8_t* b) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < TAG_BYTES; i++) {
+      difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+  }
+
+  static void putUint32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+  }
+
+  static uint32_t getUint32(const uint8_t* in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+  }
+};
+
+// Highest counter accepted from each sender. A frame is only acted on when
+// its counter is above the last one, so a captured datagram cannot be played
+// back. The last counter itself comes back as REPEAT: a remote that missed
+// the ACK resends the same frame, and gets the ACK again without a second
+// relay pulse. Not thread-safe; the caller serializes access.
+template <size_t MaxSenders>
+class ReplayGuard {
+public:
+  enum Verdict { FRESH, REPEAT, STALE };
+
+  ReplayGuard() { reset(); }
+
+  void reset() {
+    for (size_t i = 0; i < MaxSenders; i++) {
+      last[i] = 0;
+    }
+  }
+
+  Verdict check(uint8_t sender, uint32_t counter) {
+    if (sender >= MaxSenders || counter < last[sender]) {
+      return STALE;
+    }
+    if (counter == last[sender]) {
+      return counter != 0 ? REPEAT : STALE;
+    }
+    last[sender] = counter;
+    return FRESH;
+  }
+
+  // Raw counters, for saving across reboots
+  uint32_t* data() { return last; }
+  static constexpr size_t bytes() { return sizeof(uint32_t) * MaxSenders; }
+
+private:
+  uint32_t last[MaxSenders];
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+// Minimal Arduino core for the native build: the pieces the firmware's hot
+// paths touch, driven by the simulated clock. Nothing here talks to
+// hardware.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "sim_clock.h"
+
+// Arduino's String is a heap string; std::string allocates the same way,
+// so allocation counts in the benchmarks match the firmware's
+typedef std::string String;
+
+inline uint32_t millis() { return simMillis(); }
+inline uint32_t micros() { return simMicros(); }
+
+// Blocking waits just move simulated time forward
+inline void delay(uint32_t ms) { simAdvanceMs(ms); }
+inline void delayMicroseconds(uint32_t us) { simAdvanceUs(us); }
+
+#ifndef min
+template <typename T>
+inline T min(T a, T b) { return b < a ? b : a; }
+template <typename T>
+inline T max(T a, T b) { return a < b ? b : a; }
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+// WiFi stand-in for the native build. Tests set the link fields directly.
+
+#include "Arduino.h"
+
+enum wl_status_t {
+  WL_IDLE_STATUS = 0,
+  WL_CONNECTED = 3,
+  WL_DISCONNECTED = 6
+};
+
+class IPAddress {
+public:
+  IPAddress() : octets{0, 0, 0, 0} {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets{a, b, c, d} {}
+
+  String toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+    return String(text);
+  }
+
+private:
+  uint8_t octets[4];
+};
+
+class WiFiClass {
+public:
+  wl_status_t status() const { return linkStatus; }
+  IPAddress localIP() const { return ip; }
+  IPAddress softAPIP() const { return IPAddress(192, 168, 4, 1); }
+  int8_t RSSI() const { return rssi; }
+  String macAddress() const { return mac; }
+
+  wl_status_t linkStatus = WL_CONNECTED;
+  IPAddress ip = IPAddress(192, 168, 1, 42);
+  int8_t rssi = -61;
+  String mac = "AA:BB:CC:DD:EE:FF";
+};
+
+inline WiFiClass WiFi;
@@ -0,0 +1,147 @@
+#pragma once
+
+// Micro-benchmark harness for the native build.
+//
+// run() times a loop of one operation with the host's steady clock and
+// counts heap allocations made inside it, then reports both per operation:
+//
+//   BENCH log_write 41.3 ns/op 0.00 allocs/op
+//
+// Allocation counts are exact and the same on every host, so suites assert
+// them against a budget. Timings are not; they are compared against a
+// previous run instead. Set GARAGE_BENCH_OUTPUT to a file to save the
+// results, and GARAGE_BENCH_BASELINE to a saved file to fail any benchmark
+// that got slower than GARAGE_BENCH_TOLERANCE percent (default 25).
+//
+// Defines the allocation hooks, so include it from one translation unit.
+
+#include <chrono>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace bench {
+
+inline uint64_t allocations = 0;
+
+struct Result {
+  double nsPerOp;
+  double allocsPerOp;
+  bool regressed;       // Slower than the baseline allows
+  double baselineNs;    // 0 when there was no baseline entry
+};
+
+// Keeps the optimizer from deleting work whose result is unused
+template <typename T>
+inline void keep(const T& value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+inline double baselineFor(const char* name) {
+  const char* path = getenv("GARAGE_BENCH_BASELINE");
+  FILE* file = path != nullptr ? fopen(path, "r") : nullptr;
+  if (file == nullptr) {
+    return 0;
+  }
+  char line[160];
+  double found = 0;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    char entry[64];
+    double ns;
+    if (sscanf(line, "BENCH %63s %lf", entry, &ns) == 2 && strcmp(entry, name) == 0) {
+      found = ns;
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+inline void save(const char* line) {
+  const char* path = getenv("GARAGE_BENCH_OUTPUT");
+  FILE* file = path != nullptr ? fopen(path, "a") : nullptr;
+  if (file != nullptr) {
+    fputs(line, file);
+    fputc('\n', file);
+    fclose(file);
+  }
+}
+
+// Calls op(i) for i in [0, iterations) after a short warm-up
+template <typename Op>
+Result run(const char* name, uint32_t iterations, Op op) {
+  for (uint32_t i = 0; i < iterations / 10 + 1; i++) {
+    op(i);
+  }
+
+  uint64_t allocationsBefore = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) {
+    op(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  uint64_t allocated = allocations - allocationsBefore;
+
+  Result result;
+  result.nsPerOp = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+                   iterations;
+  result.allocsPerOp = (double)allocated / iterations;
+  result.baselineNs = baselineFor(name);
+
+  const char* tolerance = getenv("GARAGE_BENCH_TOLERANCE");
+  double allowed = 1.0 + (tolerance != nullptr ? atof(tolerance) : 25.0) / 100.0;
+  result.regressed = result.baselineNs > 0 && result.nsPerOp > result.baselineNs * allowed;
+
+  char line[160];
+  snprintf(line, sizeof(line), "BENCH %s %.1f ns/op %.2f allocs/op", name, result.nsPerOp,
+           result.allocsPerOp);
+  printf("%s", line);
+  if (result.baselineNs > 0) {
+    printf(" (baseline %.1f ns/op%s)", result.baselineNs, result.regressed ? ", REGRESSED" : "");
+  }
+  printf("\n");
+  save(line);
+  return result;
+}
+
+}  // namespace bench
+
+// Every heap allocation goes through one of these. With glibc the C
+// allocator itself is wrapped, which also catches malloc() calls such as
+// ArduinoJson's DynamicJsonDocument pool; elsewhere only operator new is.
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+extern "C" void* malloc(size_t size) {
+  bench::allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  bench::allocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+  bench::allocations++;
+  return __libc_realloc(pointer, size);
+}
+#else
+void* operator new(size_t size) {
+  bench::allocations++;
+  void* pointer = malloc(size != 0 ? size : 1);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* pointer) noexcept { free(pointer); }
+void operator delete[](void* pointer) noexcept { free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { free(pointer); }
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// Simulated time for the native build.
+//
+// millis() and micros() from the Arduino shim read this clock, and it only
+// moves when a test moves it, so time-dependent code behaves the same on
+// every host and run. Both readings wrap like the firmware's 32-bit ones;
+// simSetMs() close to UINT32_MAX exercises the wrap.
+inline uint64_t simTimeUs = 0;
+
+inline void simSetMs(uint32_t ms) { simTimeUs = (uint64_t)ms * 1000; }
+inline void simAdvanceMs(uint32_t ms) { simTimeUs += (uint64_t)ms * 1000; }
+inline void simAdvanceUs(uint32_t us) { simTimeUs += us; }
+
+inline uint32_t simMillis() { return (uint32_t)(simTimeUs / 1000); }
+inline uint32_t simMicros() { return (uint32_t)simTimeUs; }
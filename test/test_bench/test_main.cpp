@@ -0,0 +1,231 @@
+// Hot-path benchmarks: ns/op and heap allocations per operation.
+//
+// Run with `pio test -e native -f test_bench -v` to see the BENCH lines.
+// Each test fails when its path allocates more than its budget; timings
+// are only checked against GARAGE_BENCH_BASELINE (see bench.h).
+//
+// Everything measured is the firmware's own header code (src/*.h) with
+// its own sizes; main.cpp only adds locking, the Wi-Fi and state reads that
+// feed these builders, and the sends.
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include <stdarg.h>
+#include <unity.h>
+
+#include "bench.h"
+#include "debouncer.h"
+#include "door_channels.h"
+#include "door_status.h"
+#include "event_journal.h"
+#include "log_format.h"
+#include "log_replay.h"
+#include "log_store.h"
+#include "registration_payload.h"
+#include "scheduler.h"
+#include "timebase.h"
+#include "udp_frame.h"
+
+static LogStore<LOG_ARENA_SIZE> logStore;
+static Timebase timebase;
+
+static void expectBudget(const bench::Result& result, double allocsPerOp) {
+  TEST_ASSERT_TRUE_MESSAGE(result.allocsPerOp <= allocsPerOp, "allocation budget exceeded");
+  TEST_ASSERT_FALSE_MESSAGE(result.regressed, "slower than the baseline");
+}
+
+// logWrite() without the lock, the serial echo and the WebSocket notify
+static void logWrite(LogLevel level, const char* format, ...) {
+  char message[LOG_MAX_MESSAGE];
+  va_list args;
+  va_start(args, format);
+  size_t length = formatLogMessage(message, format, args);
+  va_end(args);
+  logStore.append(level, millis(), message, length);
+  bench::keep(message);
+}
+
+static void fillLog(uint32_t records) {
+  logStore.clear();
+  for (uint32_t i = 0; i < records; i++) {
+    logWrite(LOG_INFO, "Door state changed: %s (rssi %d dBm, record %lu)", i % 2 ? "open" : "closed",
+             -60 - (int)(i % 20), (unsigned long)i);
+  }
+}
+
+void setUp() {
+  simSetMs(1000);
+}
+
+void tearDown() {}
+
+void test_log_write() {
+  bench::Result result = bench::run("log_write", 200000, [](uint32_t i) {
+    logWrite(LOG_INFO, "Signal: %d dBm, free heap %lu", -60 - (int)(i % 30),
+             (unsigned long)(180000 + i));
+  });
+  expectBudget(result, 0);
+}
+
+void test_log_record_json() {
+  fillLog(1);
+  timebase.anchor(1760000000, 500);
+  LogCursor cursor = {0, 0};
+  LogRecord record;
+  TEST_ASSERT_TRUE(logStore.read(cursor, record));
+
+  char buffer[96 + 6 * LOG_MAX_MESSAGE];
+  bench::Result result = bench::run("log_record_json", 100000, [&](uint32_t) {
+    bench::keep(formatLogRecordJson(record, timebase, buffer, sizeof(buffer)));
+  });
+  expectBudget(result, 0);
+}
+
+// replayLogsBinary() for a 64-record backlog, minus the malloc and the send
+void test_ws_log_replay() {
+  fillLog(64);
+  static uint8_t frame[LOG_REPLAY_FRAME_BYTES];
+  bench::Result result = bench::run("ws_log_replay_64", 20000, [&](uint32_t) {
+    size_t length = packLogReplay(frame, sizeof(frame), 0x5eed, timebase, 0,
+                                  [](LogCursor& cursor, LogRecord& record) { return logStore.read(cursor, record); });
+    bench::keep(length);
+  });
+  expectBudget(result, 0);
+}
+
+static DoorChannelTable doorChannels() {
+  DoorChannelTable channels;
+  channels.add(4, 5, 0, 1000, "Door");
+  return channels;
+}
+
+// addLiveStatus() for one door plus the String serialization of a JSON status push
+void test_status_json() {
+  DoorChannelTable channels = doorChannels();
+  DeviceState state = {};
+  state.doors[0].doorOpen = true;
+  state.doorCount = 1;
+  LinkStatus link = {WiFi.status() == WL_CONNECTED, "", WiFi.RSSI(), 0};
+  snprintf(link.ip, sizeof(link.ip), "%s", WiFi.localIP().toString().c_str());
+
+  bench::Result result = bench::run("status_json", 100000, [&](uint32_t) {
+    StaticJsonDocument<1024> doc;
+    doc["type"] = "status";
+    link.uptimeSeconds = millis() / 1000;
+    addLiveStatus(doc, state, channels, link);
+    String msg;
+    serializeJson(doc, msg);
+    bench::keep(msg);
+  });
+  expectBudget(result, 8);
+}
+
+// DeviceRegistration::refreshPayload() when the settings or the IP changed.
+// The device hashes the document with mbedtls SHA-256, which the native
+// build lacks, so a fixed hash stands in.
+void test_registration_payload() {
+  DoorChannelTable channels = doorChannels();
+  String payload;
+  bench::Result result = bench::run("registration_payload_build", 20000, [&](uint32_t) {
+    String ip = WiFi.localIP().toString();
+    String mac = WiFi.macAddress();
+    RegistrationInfo info = {"garage-door", ip.c_str(), mac.c_str(), "garage_door",
+                             "Athom garage door opener", "1.0.0"};
+    DynamicJsonDocument doc(registrationDocumentBytes(channels.size()));
+    addRegistrationFields(doc, info, channels);
+    String content;
+    serializeJson(doc, content);
+    doc["hash"] = "0123456789abcdef";
+    payload = "";
+    serializeJson(doc, payload);
+    bench::keep(payload);
+  });
+  expectBudget(result, 24);
+}
+
+// One press as InputMonitor sees it: a bounce burst, then the settle check
+void test_button_debounce() {
+  Debouncer button(DEBOUNCE_TIME);
+  button.reset(false, millis());
+  bench::Result result = bench::run("button_debounce", 200000, [&](uint32_t i) {
+    bool level = (i & 1) == 0;
+    for (int edge = 0; edge < 4; edge++) {
+      button.onEdge(edge % 2 == 0 ? level : !level, millis());
+      simAdvanceUs(300);
+    }
+    button.onEdge(level, millis());
+    bench::keep(button.update(millis()));
+    simAdvanceMs(DEBOUNCE_TIME);
+    bench::keep(button.update(millis()));
+  });
+  expectBudget(result, 0);
+}
+
+static uint32_t idleTask(uint32_t) { return 1000; }
+static uint32_t busyTask(uint32_t) { return 0; }
+
+// A pass over a full task table, one task due every pass
+void test_scheduler_pass() {
+  Scheduler<SCHEDULER_MAX_TASKS> scheduler(simMillis, simMicros);
+  for (size_t i = 0; i < SCHEDULER_MAX_TASKS; i++) {
+    scheduler.add("task", i == 4 ? busyTask : idleTask, i == 4);
+  }
+  bench::Result result = bench::run("scheduler_pass", 500000, [&](uint32_t) {
+    simAdvanceUs(100);
+    bench::keep(scheduler.runDue(false));
+  });
+  expectBudget(result, 0);
+}
+
+// Framing, tag compare and replay check of a TRIGGER; the HMAC itself is
+// mbedtls and not part of the native build
+void test_udp_frame_check() {
+  uint8_t datagram[UdpFrame::MAX_BYTES];
+  uint8_t tag[UdpFrame::TAG_BYTES] = {0};
+  ReplayGuard<UDP_MAX_SENDERS> guard;
+  bench::Result result = bench::run("udp_frame_check", 500000, [&](uint32_t i) {
+    size_t length = UdpFrame::writeHeader(datagram, UdpFrame::TRIGGER, 1, i + 1);
+    memcpy(datagram + length, tag, UdpFrame::TAG_BYTES);
+    length += UdpFrame::TAG_BYTES;
+
+    UdpFrame::Header header;
+    const uint8_t* body;
+    size_t bodyLength;
+    bool valid = UdpFrame::parse(datagram, length, header, body, bodyLength) &&
+                 UdpFrame::tagEquals(body + bodyLength, tag) &&
+                 guard.check(header.sender, header.counter) != ReplayGuard<UDP_MAX_SENDERS>::STALE;
+    bench::keep(valid);
+  });
+  expectBudget(result, 0);
+}
+
+// Both ends of a /api/history?from=&to= query over a full index
+void test_history_seek() {
+  static HistoryIndex<HISTORY_INDEX_CAPACITY> index(HISTORY_INDEX_STRIDE);
+  for (uint32_t i = 0; i < HISTORY_INDEX_CAPACITY; i++) {
+    index.add(1700000000 + i * 3600, 1 + i * HISTORY_INDEX_STRIDE);
+  }
+  TEST_ASSERT_EQUAL_UINT32(HISTORY_INDEX_CAPACITY, index.size());
+
+  bench::Result result = bench::run("history_seek", 500000, [&](uint32_t i) {
+    uint32_t from = 1700000000 + (i % HISTORY_INDEX_CAPACITY) * 3600;
+    bench::keep(index.seekFrom(from, 1));
+    bench::keep(index.seekTo(from + 86400));
+  });
+  expectBudget(result, 0);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_log_write);
+  RUN_TEST(test_log_record_json);
+  RUN_TEST(test_ws_log_replay);
+  RUN_TEST(test_status_json);
+  RUN_TEST(test_registration_payload);
+  RUN_TEST(test_button_debounce);
+  RUN_TEST(test_scheduler_pass);
+  RUN_TEST(test_udp_frame_check);
+  RUN_TEST(test_history_seek);
+  return UNITY_END();
+}
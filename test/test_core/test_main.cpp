@@ -0,0 +1,389 @@
+// Regression tests for the firmware's host-buildable core, run with
+// `pio test -e native -f test_core`. Time comes from the simulated clock,
+// so timeouts, settle windows and millis() wrap are exercised exactly.
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <unity.h>
+
+#include "backoff.h"
+#include "debouncer.h"
+#include "door_channels.h"
+#include "event_journal.h"
+#include "log_replay.h"
+#include "log_store.h"
+#include "metrics.h"
+#include "msgpack_writer.h"
+#include "scheduler.h"
+#include "snapshot_buffer.h"
+#include "spsc_queue.h"
+#include "timebase.h"
+#include "udp_frame.h"
+
+void setUp() {
+  simSetMs(1000);
+}
+
+void tearDown() {}
+
+void test_debouncer_ignores_bounce_back() {
+  Debouncer debouncer(20);
+  debouncer.reset(false, millis());
+  debouncer.onEdge(true, millis());
+  simAdvanceMs(5);
+  debouncer.onEdge(false, millis());
+  TEST_ASSERT_EQUAL_UINT32(20, debouncer.timeToSettle(millis()));
+  TEST_ASSERT_TRUE(debouncer.settling());
+  simAdvanceMs(20);
+  TEST_ASSERT_FALSE(debouncer.update(millis()));
+  TEST_ASSERT_FALSE(debouncer.settling());
+  TEST_ASSERT_FALSE(debouncer.level());
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, debouncer.timeToSettle(millis()));
+}
+
+void test_debouncer_reports_first_edge_across_wrap() {
+  simSetMs(UINT32_MAX - 10);
+  Debouncer debouncer(20);
+  debouncer.reset(false, millis());
+  uint32_t pressed = millis();
+  debouncer.onEdge(true, pressed);
+  simAdvanceMs(3);
+  debouncer.onEdge(false, millis());
+  simAdvanceMs(2);
+  debouncer.onEdge(true, millis());
+  simAdvanceMs(19);
+  TEST_ASSERT_FALSE(debouncer.update(millis()));
+  simAdvanceMs(1);
+  TEST_ASSERT_TRUE(debouncer.update(millis()));
+  TEST_ASSERT_TRUE(debouncer.level());
+  TEST_ASSERT_EQUAL_UINT32(pressed, debouncer.lastChange());
+  TEST_ASSERT_FALSE(debouncer.update(millis()));
+}
+
+static uint32_t taskRuns[2];
+static uint32_t slowTask(uint32_t) { taskRuns[0]++; return 500; }
+static uint32_t wakeTask(uint32_t) { taskRuns[1]++; return 60000; }
+
+void test_scheduler_deadlines_and_wake() {
+  taskRuns[0] = taskRuns[1] = 0;
+  Scheduler<4> scheduler(millis, micros);
+  TEST_ASSERT_TRUE(scheduler.add("slow", slowTask, false));
+  TEST_ASSERT_TRUE(scheduler.add("wake", wakeTask, true));
+
+  TEST_ASSERT_EQUAL_UINT32(500, scheduler.runDue(false));
+  TEST_ASSERT_EQUAL_UINT32(1, taskRuns[0]);
+  TEST_ASSERT_EQUAL_UINT32(1, taskRuns[1]);
+
+  simAdvanceMs(200);
+  TEST_ASSERT_EQUAL_UINT32(300, scheduler.runDue(true));
+  TEST_ASSERT_EQUAL_UINT32(1, taskRuns[0]);
+  TEST_ASSERT_EQUAL_UINT32(2, taskRuns[1]);
+
+  simAdvanceMs(300);
+  scheduler.runDue(false);
+  TEST_ASSERT_EQUAL_UINT32(2, taskRuns[0]);
+  TEST_ASSERT_EQUAL_UINT32(2, taskRuns[1]);
+  TEST_ASSERT_EQUAL_UINT32(3, scheduler.getPasses());
+  TEST_ASSERT_EQUAL_UINT32(1, scheduler.getWakeups());
+}
+
+void test_log_store_evicts_oldest_when_full() {
+  static LogStore<1024> store;
+  store.clear();
+  char message[64];
+  for (uint32_t i = 1; i <= 100; i++) {
+    size_t length = snprintf(message, sizeof(message), "line %lu", (unsigned long)i);
+    TEST_ASSERT_EQUAL_UINT32(i, store.append(LOG_INFO, millis(), message, length));
+  }
+  TEST_ASSERT_EQUAL_UINT32(100, store.newestSeq());
+  TEST_ASSERT_TRUE(store.oldestSeq() > 1);
+  TEST_ASSERT_EQUAL_UINT32(store.newestSeq() - store.oldestSeq() + 1, store.size());
+
+  // A cursor that fell behind skips ahead to the oldest record left
+  LogCursor cursor = {1, 0};
+  LogRecord record;
+  uint32_t expected = store.oldestSeq();
+  while (store.read(cursor, record)) {
+    snprintf(message, sizeof(message), "line %lu", (unsigned long)expected);
+    TEST_ASSERT_EQUAL_UINT32(expected, record.seq);
+    TEST_ASSERT_EQUAL_STRING(message, record.message);
+    expected++;
+  }
+  TEST_ASSERT_EQUAL_UINT32(101, expected);
+}
+
+void test_log_store_truncates_long_messages() {
+  static LogStore<1024> store;
+  store.clear();
+  char message[LOG_MAX_MESSAGE + 50];
+  memset(message, 'x', sizeof(message));
+  store.append(LOG_WARN, 42, message, sizeof(message));
+
+  LogCursor cursor = {0, 0};
+  LogRecord record;
+  TEST_ASSERT_TRUE(store.read(cursor, record));
+  TEST_ASSERT_EQUAL_UINT8(LOG_WARN, record.level);
+  TEST_ASSERT_EQUAL_UINT32(42, record.timestamp);
+  TEST_ASSERT_EQUAL_UINT32(LOG_MAX_MESSAGE, record.length);
+  TEST_ASSERT_FALSE(store.read(cursor, record));
+}
+
+void test_log_store_short_records_evict_only_what_they_need() {
+  static LogStore<1024> store;
+  store.clear();
+  // "ab" packs into 16 bytes, so exactly 64 records fill the arena
+  for (int i = 0; i < 100; i++) {
+    store.append(LOG_INFO, i, "ab", 2);
+  }
+  TEST_ASSERT_EQUAL_UINT32(64, store.size());
+  TEST_ASSERT_EQUAL_UINT32(37, store.oldestSeq());
+  TEST_ASSERT_EQUAL_UINT32(100, store.newestSeq());
+}
+
+static size_t formatMessage(char* message, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t length = formatLogMessage(message, format, args);
+  va_end(args);
+  return length;
+}
+
+void test_log_message_format_and_since_cursor() {
+  char message[LOG_MAX_MESSAGE];
+  TEST_ASSERT_EQUAL_UINT32(8, formatMessage(message, "rssi %d", -61));
+  TEST_ASSERT_EQUAL_STRING("rssi -61", message);
+  char longText[LOG_MAX_MESSAGE + 50];
+  memset(longText, 'y', sizeof(longText) - 1);
+  longText[sizeof(longText) - 1] = '\0';
+  TEST_ASSERT_EQUAL_UINT32(LOG_MAX_MESSAGE - 1, formatMessage(message, "%s", longText));
+  TEST_ASSERT_EQUAL_UINT8('\0', message[LOG_MAX_MESSAGE - 1]);
+
+  TEST_ASSERT_EQUAL_UINT32(6, nextAfter(5));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, nextAfter(UINT32_MAX));
+}
+
+void test_log_replay_batches_resume() {
+  static LogStore<1024> store;
+  store.clear();
+  for (int i = 0; i < 3; i++) {
+    store.append(LOG_INFO, 42, "abc", 3);
+  }
+  Timebase clock;
+  auto read = [](LogCursor& cursor, LogRecord& record) { return store.read(cursor, record); };
+
+  // Room for the header and one 8-byte entry: done is false and last is 1
+  uint8_t small[16 + 12 + 8 + 4];
+  size_t length = packLogReplay(small, sizeof(small), 0x5eed, clock, 0, read);
+  TEST_ASSERT_EQUAL_UINT32(22, length);
+  TEST_ASSERT_EQUAL_UINT8(WS_MSG_LOGS, small[1]);
+  TEST_ASSERT_EQUAL_UINT8(1, small[11]);
+  TEST_ASSERT_EQUAL_UINT8(0x01, small[length - 2]);
+  TEST_ASSERT_EQUAL_UINT8(0xc2, small[length - 1]);
+
+  // Asking again from last gets the rest
+  static uint8_t frame[LOG_REPLAY_FRAME_BYTES];
+  length = packLogReplay(frame, sizeof(frame), 0x5eed, clock, 1, read);
+  TEST_ASSERT_EQUAL_UINT8(2, frame[11]);
+  TEST_ASSERT_EQUAL_UINT8(0x03, frame[length - 2]);
+  TEST_ASSERT_EQUAL_UINT8(0xc3, frame[length - 1]);
+
+  // A saturated cursor replays nothing instead of starting over
+  length = packLogReplay(frame, sizeof(frame), 0x5eed, clock, UINT32_MAX, read);
+  TEST_ASSERT_EQUAL_UINT8(0, frame[11]);
+  TEST_ASSERT_EQUAL_UINT8(0xc3, frame[length - 1]);
+}
+
+void test_msgpack_shortest_forms_and_overflow() {
+  uint8_t buffer[16];
+  MsgPackWriter out(buffer, sizeof(buffer));
+  out.writeUint(5);
+  out.writeUint(200);
+  out.writeInt(-1);
+  out.writeInt(-100);
+  out.writeString("hi");
+  TEST_ASSERT_TRUE(out.ok());
+  const uint8_t expected[] = {0x05, 0xcc, 200, 0xff, 0xd0, (uint8_t)-100, 0xa2, 'h', 'i'};
+  TEST_ASSERT_EQUAL_UINT32(sizeof(expected), out.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, buffer, sizeof(expected));
+
+  size_t before = out.size();
+  out.writeString("this does not fit");
+  TEST_ASSERT_FALSE(out.ok());
+  out.truncate(before);
+  TEST_ASSERT_TRUE(out.ok());
+  TEST_ASSERT_EQUAL_UINT32(before, out.size());
+}
+
+void test_backoff_stays_within_bounds() {
+  Backoff backoff(1000, 60000);
+  TEST_ASSERT_EQUAL_UINT32(500, backoff.next(0));
+  TEST_ASSERT_EQUAL_UINT32(2000, backoff.next(1000));
+  for (int i = 0; i < 20; i++) {
+    backoff.next(0);
+  }
+  TEST_ASSERT_EQUAL_UINT32(30000, backoff.next(0));
+  TEST_ASSERT_EQUAL_UINT32(60000, backoff.next(30000));
+  backoff.reset();
+  TEST_ASSERT_EQUAL_UINT32(0, backoff.getAttempts());
+}
+
+void test_timebase_converts_before_and_after_anchor() {
+  Timebase timebase;
+  TEST_ASSERT_EQUAL_UINT32(0, timebase.toEpoch(millis()));
+  timebase.anchor(1760000000, 10000);
+  TEST_ASSERT_EQUAL_UINT32(1760000000, timebase.toEpoch(10999));
+  TEST_ASSERT_EQUAL_UINT32(1760000002, timebase.toEpoch(12000));
+  TEST_ASSERT_EQUAL_UINT32(1759999999, timebase.toEpoch(9999));
+  TEST_ASSERT_EQUAL_UINT32(1759999999, timebase.toEpoch(9000));
+}
+
+void test_udp_frame_round_trip_and_replay() {
+  uint8_t datagram[UdpFrame::MAX_BYTES] = {0};
+  size_t length = UdpFrame::writeHeader(datagram, UdpFrame::TRIGGER, 2, 0x01020304);
+  length += UdpFrame::TAG_BYTES;
+
+  UdpFrame::Header header;
+  const uint8_t* body;
+  size_t bodyLength;
+  TEST_ASSERT_TRUE(UdpFrame::parse(datagram, length, header, body, bodyLength));
+  TEST_ASSERT_EQUAL_UINT8(UdpFrame::TRIGGER, header.type);
+  TEST_ASSERT_EQUAL_UINT8(2, header.sender);
+  TEST_ASSERT_EQUAL_UINT32(0x01020304, header.counter);
+  TEST_ASSERT_EQUAL_UINT32(0, bodyLength);
+  TEST_ASSERT_FALSE(UdpFrame::parse(datagram, length - 1, header, body, bodyLength));
+
+  ReplayGuard<4> guard;
+  TEST_ASSERT_EQUAL(ReplayGuard<4>::STALE, guard.check(0, 0));
+  TEST_ASSERT_EQUAL(ReplayGuard<4>::FRESH, guard.check(0, 7));
+  TEST_ASSERT_EQUAL(ReplayGuard<4>::REPEAT, guard.check(0, 7));
+  TEST_ASSERT_EQUAL(ReplayGuard<4>::STALE, guard.check(0, 6));
+  TEST_ASSERT_EQUAL(ReplayGuard<4>::STALE, guard.check(4, 100));
+}
+
+void test_history_index_seeks() {
+  HistoryIndex<8> index(64);
+  TEST_ASSERT_TRUE(index.add(1000, 1));
+  TEST_ASSERT_FALSE(index.add(1100, 20));    // Inside the stride
+  TEST_ASSERT_TRUE(index.add(2000, 65));
+  TEST_ASSERT_TRUE(index.add(3000, 129));
+  TEST_ASSERT_FALSE(index.add(2500, 200));   // Clock went backwards
+
+  TEST_ASSERT_EQUAL_UINT32(1, index.seekFrom(500, 1));
+  TEST_ASSERT_EQUAL_UINT32(65, index.seekFrom(2500, 1));
+  TEST_ASSERT_EQUAL_UINT32(65, index.seekTo(1500));
+  TEST_ASSERT_EQUAL_UINT32(UINT32_MAX, index.seekTo(3000));
+
+  index.dropBefore(65);
+  TEST_ASSERT_EQUAL_UINT32(2, index.size());
+  TEST_ASSERT_EQUAL_UINT32(70, index.seekFrom(1500, 70));
+}
+
+void test_door_channels_pack_and_validate() {
+  DoorChannelTable table;
+  TEST_ASSERT_TRUE(table.add(18, 7, DOOR_CONTACT_INVERTED | DOOR_CONTACT_PULLUP, 1000, "Left"));
+  TEST_ASSERT_TRUE(table.add(5, 6, 0, 740, "Right"));
+  TEST_ASSERT_EQUAL_UINT32(700, table[1].pulseMs());   // Rounded to DOOR_PULSE_UNIT_MS
+
+  DoorChannelTable restored;
+  restored.addPacked(packDoorChannel(table[0]), table[0].name);
+  TEST_ASSERT_EQUAL_UINT8(18, restored[0].contactPin);
+  TEST_ASSERT_EQUAL_UINT8(7, restored[0].relayPin);
+  TEST_ASSERT_TRUE(restored[0].inverted());
+  TEST_ASSERT_TRUE(restored[0].pullup());
+  TEST_ASSERT_FALSE(table[1].pullup());
+  TEST_ASSERT_EQUAL_UINT32(1000, restored[0].pulseMs());
+
+  const uint8_t reserved[] = {3, 4};
+  const uint8_t inputOnly[] = {9, 19};
+  const char* error = nullptr;
+  TEST_ASSERT_TRUE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  TEST_ASSERT_TRUE(table.add(4, 8, 0, 1000, "Gate"));        // LED pin
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  table.clear();
+  TEST_ASSERT_TRUE(table.add(18, 18, 0, 1000, "Twice"));
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  table.clear();
+  TEST_ASSERT_TRUE(table.add(18, 7, 0, 60000, "Slow"));      // Clamped, then out of range
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  TEST_ASSERT_EQUAL_STRING("pulse_ms out of range", error);
+  table.clear();
+  TEST_ASSERT_TRUE(table.add(19, 7, 0, 1000, "Contact"));    // Input-only pins still take a contact
+  TEST_ASSERT_TRUE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  TEST_ASSERT_TRUE(table.add(5, 9, 0, 1000, "Strap"));
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  TEST_ASSERT_EQUAL_STRING("relay_pin is a strapping or USB pin", error);
+  table.clear();
+  TEST_ASSERT_TRUE(table.add(18, 7, 0, 1000, "Side \"A\""));   // Would need escaping in JSON
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+  table.clear();
+  TEST_ASSERT_TRUE(table.add(18, 7, 0, 1000, "Gar\xc3\xa1ge"));  // UTF-8 could be cut mid-character
+  TEST_ASSERT_FALSE(table.validate(reserved, sizeof(reserved), inputOnly, sizeof(inputOnly), error));
+
+  char suffix[4];
+  doorChannelSuffix(0, suffix, sizeof(suffix));
+  TEST_ASSERT_EQUAL_STRING("", suffix);
+  doorChannelSuffix(2, suffix, sizeof(suffix));
+  TEST_ASSERT_EQUAL_STRING("3", suffix);
+
+  // Journal records keep the channel next to the trigger source
+  HistoryRecord record = {};
+  record.source = packHistorySource(SOURCE_UDP, 3);
+  TEST_ASSERT_EQUAL_UINT8(SOURCE_UDP, historySource(record));
+  TEST_ASSERT_EQUAL_UINT8(3, historyChannel(record));
+  record.source = SOURCE_BUTTON;    // Written before channels existed
+  TEST_ASSERT_EQUAL_UINT8(0, historyChannel(record));
+}
+
+void test_latency_histogram_buckets() {
+  LatencyHistogram histogram;
+  histogram.record(100);
+  histogram.record(101);
+  histogram.record(7000000);
+  TEST_ASSERT_EQUAL_UINT32(1, histogram.bucketCount(0));
+  TEST_ASSERT_EQUAL_UINT32(1, histogram.bucketCount(1));
+  TEST_ASSERT_EQUAL_UINT32(1, histogram.bucketCount(LatencyHistogram::BUCKETS));
+  TEST_ASSERT_EQUAL_UINT32(3, histogram.getCount());
+  TEST_ASSERT_EQUAL_UINT32(7000000, histogram.getMaxUs());
+}
+
+void test_queue_and_snapshot() {
+  SpscQueue<uint32_t, 4> queue;
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(queue.push(i));
+  }
+  TEST_ASSERT_FALSE(queue.push(99));
+  uint32_t item = 0;
+  for (uint32_t i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(queue.pop(item));
+    TEST_ASSERT_EQUAL_UINT32(i, item);
+  }
+  TEST_ASSERT_FALSE(queue.pop(item));
+
+  SnapshotBuffer<HistoryRecord> snapshot;
+  HistoryRecord record = {7, 1760000000, millis(), HISTORY_OPENED, SOURCE_API, 1, 0};
+  snapshot.store(record);
+  HistoryRecord copy = snapshot.load();
+  TEST_ASSERT_EQUAL_UINT32(7, copy.seq);
+  TEST_ASSERT_EQUAL_UINT8(SOURCE_API, copy.source);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_debouncer_ignores_bounce_back);
+  RUN_TEST(test_debouncer_reports_first_edge_across_wrap);
+  RUN_TEST(test_scheduler_deadlines_and_wake);
+  RUN_TEST(test_log_store_evicts_oldest_when_full);
+  RUN_TEST(test_log_store_truncates_long_messages);
+  RUN_TEST(test_log_store_short_records_evict_only_what_they_need);
+  RUN_TEST(test_log_message_format_and_since_cursor);
+  RUN_TEST(test_log_replay_batches_resume);
+  RUN_TEST(test_msgpack_shortest_forms_and_overflow);
+  RUN_TEST(test_backoff_stays_within_bounds);
+  RUN_TEST(test_timebase_converts_before_and_after_anchor);
+  RUN_TEST(test_udp_frame_round_trip_and_replay);
+  RUN_TEST(test_history_index_seeks);
+  RUN_TEST(test_door_channels_pack_and_validate);
+  RUN_TEST(test_latency_histogram_buckets);
+  RUN_TEST(test_queue_and_snapshot);
+  return UNITY_END();
+}
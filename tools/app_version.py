@@ -0,0 +1,78 @@
+"""
+PlatformIO post-link step: write FIRMWARE_VERSION into the app descriptor
+(esp_app_desc_t) of the linked ELF, before the .bin is made from it.
+
+The Arduino core's descriptor carries the version of the prebuilt
+libraries, not ours. A device pulling an image from the control server
+refuses it unless the descriptor's version matches the one offered, so the
+descriptor has to say which firmware this is.
+"""
+
+import os
+import re
+import struct
+
+Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+
+PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+APP_DESC_SECTION = b".flash.appdesc"
+APP_DESC_MAGIC = 0xABCD5432
+VERSION_OFFSET = 16   # magic_word, secure_version, reserv1[2]
+VERSION_SIZE = 32
+
+
+def firmware_version(env):
+    for define in env.get("CPPDEFINES", []):
+        if isinstance(define, (list, tuple)) and define[0] == "FIRMWARE_VERSION":
+            return str(define[1]).replace("\\", "").strip('"')
+    # Not overridden: the default in main.cpp
+    with open(os.path.join(PROJECT_DIR, "src", "main.cpp"), "r", encoding="utf-8") as f:
+        match = re.search(r'#define FIRMWARE_VERSION "([^"]*)"', f.read())
+    return match.group(1)
+
+
+# File offset of an ELF32 (little endian) section, by name
+def section_offset(elf, wanted):
+    shoff, = struct.unpack_from("<I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+
+    def header(index):
+        # sh_name, sh_type, sh_flags, sh_addr, sh_offset
+        return struct.unpack_from("<IIIII", elf, shoff + index * shentsize)
+
+    names = header(shstrndx)[4]
+    for index in range(shnum):
+        name, _, _, _, offset = header(index)
+        start = names + name
+        if elf[start:elf.index(b"\0", start)] == wanted:
+            return offset
+    return None
+
+
+def stamp(target, source, env):
+    path = target[0].get_abspath()
+    version = firmware_version(env)
+    encoded = version.encode()
+    if len(encoded) >= VERSION_SIZE:
+        raise ValueError("FIRMWARE_VERSION must be shorter than %d bytes" % VERSION_SIZE)
+
+    with open(path, "rb") as f:
+        elf = bytearray(f.read())
+    offset = find_app_desc(elf)
+    if offset is None:
+        raise ValueError("%s has no app descriptor" % os.path.basename(path))
+
+    elf[offset + VERSION_OFFSET:offset + VERSION_OFFSET + VERSION_SIZE] = encoded.ljust(VERSION_SIZE, b"\0")
+    with open(path, "wb") as f:
+        f.write(elf)
+    print("app_version: %s" % version)
+
+
+def find_app_desc(elf):
+    offset = section_offset(elf, APP_DESC_SECTION)
+    if offset is None or struct.unpack_from("<I", elf, offset)[0] != APP_DESC_MAGIC:
+        return None
+    return offset
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", stamp)  # noqa: F821
@@ -0,0 +1,64 @@
+"""
+PlatformIO pre-build step: gzip web/index.html and embed it as a PROGMEM
+byte array in src/web_index.h so the firmware can serve it zero-copy.
+
+The header is only rewritten when the page content changes, which keeps
+incremental builds from recompiling main.cpp for nothing.
+"""
+
+import gzip
+import hashlib
+import os
+
+Import("env")  # noqa: F821 - provided by PlatformIO/SCons
+
+PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+SOURCE = os.path.join(PROJECT_DIR, "web", "index.html")
+TARGET = os.path.join(PROJECT_DIR, "src", "web_index.h")
+
+
+def build_header(html):
+    # mtime=0 keeps the gzip stream (and therefore the ETag) reproducible
+    compressed = gzip.compress(html, compresslevel=9, mtime=0)
+    etag = hashlib.sha256(html).hexdigest()[:16]
+
+    lines = [
+        "// Generated by tools/embed_web.py from web/index.html - do not edit",
+        "#pragma once",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "#define INDEX_HTML_ETAG \"\\\"%s\\\"\"" % etag,
+        "#define INDEX_HTML_RAW_LEN %d" % len(html),
+        "",
+        "const size_t INDEX_HTML_GZ_LEN = %d;" % len(compressed),
+        "const uint8_t INDEX_HTML_GZ[] PROGMEM = {",
+    ]
+    for i in range(0, len(compressed), 16):
+        chunk = compressed[i:i + 16]
+        lines.append("  " + ", ".join("0x%02x" % b for b in chunk) + ",")
+    lines.append("};")
+    lines.append("")
+    return "\n".join(lines), len(compressed)
+
+
+def main():
+    with open(SOURCE, "rb") as f:
+        html = f.read()
+
+    header, gz_len = build_header(html)
+
+    if os.path.exists(TARGET):
+        with open(TARGET, "r") as f:
+            if f.read() == header:
+                return
+
+    with open(TARGET, "w") as f:
+        f.write(header)
+    print("embed_web: %s -> %s (%d -> %d bytes gzip)" % (
+        os.path.relpath(SOURCE, PROJECT_DIR),
+        os.path.relpath(TARGET, PROJECT_DIR),
+        len(html), gz_len))
+
+
+main()